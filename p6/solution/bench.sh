@@ -0,0 +1,58 @@
+#!/bin/bash
+
+# time a sequential write and read through wfs for each block size
+# usage: ./bench.sh [file_mb] [block sizes...]
+# --direct-io=1 keeps the kernel page cache out of the reads, big_writes lets FUSE send
+# writes larger than 4K; REPS repeats each transfer and prints the median rate (3 by default)
+# DD_BS sets the transfer size, WFS_OPTS adds mount options, e.g. to compare the zero-copy paths:
+#   DD_BS=1M WFS_OPTS="-o splice_read,splice_write,splice_move" ./bench.sh
+# IO lists the disk I/O backends to time on the same images, RAID picks the mode (0 by default):
+#   IO="pread uring" RAID=1 ./bench.sh
+
+size_mb=${1:-32}
+shift
+sizes=${*:-512 4096 65536}
+dd_bs=${DD_BS:-4K}
+backends=${IO:-mmap}
+raid=${RAID:-0}
+reps=${REPS:-3}
+# raid 5 needs a third disk
+disks="bench-disk1 bench-disk2"
+[ "$raid" = 5 ] && disks="$disks bench-disk3"
+
+make -s all || exit 1
+mkdir -p mnt
+
+# run a dd of the file and print its rate in MB/s
+rate() {
+    local start=$(date +%s%N)
+    dd "$@" status=none || return 1
+    echo $((size_mb * 1048576 * 1000 / ($(date +%s%N) - start)))
+}
+
+median() {
+    printf "%s\n" "$@" | sort -n | awk '{ r[NR] = $1 } END { print r[int((NR + 1) / 2)] }'
+}
+
+for bs in $sizes; do
+    rm -f $disks
+    truncate -s $(((size_mb + 8) * 1024 * 1024)) $disks
+    ./mkfs -r $raid $(printf -- "-d %s " $disks) -i 32 -b $(((size_mb + 4) * 1024 * 1024 / bs)) -B $bs || exit 1
+    for io in $backends; do
+        # mounted as it would be, multithreaded with tracing off
+        ./wfs $disks --direct-io=1 --io=$io -o big_writes $WFS_OPTS mnt || exit 1
+
+        w=()
+        r=()
+        for n in $(seq $reps); do
+            w+=($(rate if=/dev/zero of=mnt/bench bs=$dd_bs count=$((size_mb * 1024 * 1024)) iflag=count_bytes))
+            r+=($(rate if=mnt/bench of=/dev/null bs=$dd_bs))
+            # the next run and backend write their own file into the same blocks
+            rm -f mnt/bench
+        done
+        echo "block size $bs, --io=$io: write $(median ${w[@]}) MB/s, read $(median ${r[@]}) MB/s"
+        fusermount -u mnt
+    done
+done
+
+rm -f $disks
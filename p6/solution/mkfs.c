@@ -11,22 +11,40 @@
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+
+// zeros are written this many bytes at a time where a hole cannot be punched
+#define ZERO_CHUNK (1024 * 1024)
 
 // initialize superblock
-int superblock_initial(struct wfs_sb *sb, int raid, int diskNum, int inodeNum, int blockNum, off_t disk_size)
+int superblock_initial(struct wfs_sb *sb, int raid, int diskNum, int inodeNum, int blockNum, int blockSize, int journalBlocks, off_t disk_size)
 {
     sb->num_inodes = inodeNum;
     sb->num_data_blocks = blockNum;
+    sb->block_size = blockSize;
     sb->i_bitmap_ptr = sizeof(struct wfs_sb);
     sb->d_bitmap_ptr = sb->i_bitmap_ptr + inodeNum / 8;
 
-    sb->i_blocks_ptr = ((sb->d_bitmap_ptr + blockNum / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
-    sb->d_blocks_ptr = sb->i_blocks_ptr + inodeNum * INODE_SIZE;
+    // inodes keep their own 512 byte slots, the data region starts on a block boundary
+    sb->i_blocks_ptr = ((sb->d_bitmap_ptr + blockNum / 8 + INODE_SIZE - 1) / INODE_SIZE) * INODE_SIZE;
+    sb->d_blocks_ptr = ((sb->i_blocks_ptr + inodeNum * INODE_SIZE + blockSize - 1) / blockSize) * blockSize;
 
     sb->raid = raid;
     sb->diskNum = diskNum;
+    sb->version = WFS_VERSION;
+
+    // verified mirrors keep a checksum per data block after the data region
+    sb->c_blocks_ptr = 0;
+    if (raid == 2)
+        sb->c_blocks_ptr = sb->d_blocks_ptr + (off_t)blockNum * blockSize;
 
-    if (disk_size < sb->d_blocks_ptr + blockNum * BLOCK_SIZE)
+    // the metadata journal goes last, every disk keeps a copy
+    sb->j_blocks = journalBlocks;
+    sb->j_blocks_ptr = journalBlocks > 0 ? data_end(sb) : 0;
+
+    if (disk_size < disk_end(sb))
     {
         return -1;
     }
@@ -34,34 +52,105 @@ int superblock_initial(struct wfs_sb *sb, int raid, int diskNum, int inodeNum, i
     return 0;
 }
 
-int write_bitmap(int fd, off_t offset, size_t size, uint8_t initial_value)
+// free a range of the image, it reads back as zeros and the image stays sparse
+int punch_hole(int fd, off_t offset, off_t len)
+{
+    // by syscall number, glibc only declares fallocate with _GNU_SOURCE whose LOCK_READ clashes with wfs.h
+    return syscall(SYS_fallocate, fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0 ? 0 : -1;
+}
+
+// write zeros over a range in large pieces
+int write_zeros(int fd, off_t offset, off_t len)
 {
-    uint8_t *bitmap = calloc(1, size);
-    if (bitmap == NULL)
+    char *zeros = calloc(1, ZERO_CHUNK);
+    if (zeros == NULL)
     {
-        perror("Error: bitmap initialization");
+        perror("Error: zero buffer");
         return -1;
     }
-    bitmap[0] = initial_value;
+    while (len > 0)
+    {
+        size_t n = len < ZERO_CHUNK ? len : ZERO_CHUNK;
+        if (pwrite(fd, zeros, n, offset) != n)
+        {
+            perror("Error: zero fill");
+            free(zeros);
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    free(zeros);
+    return 0;
+}
 
-    if (lseek(fd, offset, SEEK_SET) == -1)
+// one disk set up by its own thread
+struct disk_init
+{
+    const char *path;
+    struct wfs_sb sb;
+    const struct wfs_inode *root;
+    int res;
+};
+
+// zero the filesystem, then write the superblock, both bitmaps and the root inode
+// with one write, they sit next to each other at the front of the disk
+void *init_disk(void *arg)
+{
+    struct disk_init *d = arg;
+    struct wfs_sb *sb = &d->sb;
+    d->res = -1;
+
+    int fd = open(d->path, O_RDWR);
+    if (fd == -1)
     {
-        perror("Error: bitmap offset");
-        free(bitmap);
-        return -1;
+        perror("Error: open disk");
+        return NULL;
     }
-    if (write(fd, bitmap, size) != size)
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1)
     {
-        perror("Error: bitmap modification");
-        free(bitmap);
-        return -1;
+        perror("Error: get file stats");
+        close(fd);
+        return NULL;
+    }
+    if (file_stat.st_size < disk_end(sb))
+    {
+        fprintf(stderr, "Error: Disk image %s is too small\n", d->path);
+        close(fd);
+        return NULL;
     }
 
-    free(bitmap);
-    return 0;
+    size_t head_size = sb->i_blocks_ptr + (d->root->num + 1) * INODE_SIZE;
+    uint8_t *head = calloc(1, head_size);
+    if (head == NULL)
+    {
+        perror("Error: metadata buffer");
+        close(fd);
+        return NULL;
+    }
+    memcpy(head, sb, sizeof(struct wfs_sb));
+    // the root inode is taken, no data block is
+    head[sb->i_bitmap_ptr] = 0x01;
+    memcpy(head + sb->i_blocks_ptr + d->root->num * INODE_SIZE, d->root, sizeof(struct wfs_inode));
+
+    // punching the whole filesystem out leaves zeros everywhere, where holes are not
+    // supported (block devices, some filesystems) only checksums and journal must be zeroed,
+    // and under raid 5 the data blocks, whose parity has to match them
+    int zeroed = punch_hole(fd, 0, disk_end(sb)) == 0 ||
+                 (write_zeros(fd, sb->c_blocks_ptr, checksum_size(sb)) == 0 &&
+                  write_zeros(fd, sb->j_blocks_ptr, (off_t)sb->j_blocks * sb->block_size) == 0 &&
+                  (sb->raid != 5 || write_zeros(fd, sb->d_blocks_ptr, data_size(sb)) == 0));
+    if (zeroed && pwrite(fd, head, head_size, 0) != head_size)
+        perror("Error: metadata initialize");
+    else if (zeroed)
+        d->res = 0;
+    free(head);
+    close(fd);
+    return NULL;
 }
 
-int mkfs_initial(int raid, char **diskimgs, int diskNum, int inodeNum, int blockNum)
+int mkfs_initial(int raid, char **diskimgs, int diskNum, int inodeNum, int blockNum, int blockSize, int journalBlocks)
 {
     int fd = -1;
     struct stat file_stat;
@@ -90,7 +179,7 @@ int mkfs_initial(int raid, char **diskimgs, int diskNum, int inodeNum, int block
     disk_size = file_stat.st_size;
     close(fd);
 
-    if (superblock_initial(&sb, raid, diskNum, inodeNum, blockNum, disk_size) != 0)
+    if (superblock_initial(&sb, raid, diskNum, inodeNum, blockNum, blockSize, journalBlocks, disk_size) != 0)
     {
         fprintf(stderr, "Error setting up superblock; disk image may be too small\n");
         return -1;
@@ -108,66 +197,29 @@ int mkfs_initial(int raid, char **diskimgs, int diskNum, int inodeNum, int block
     root_inode.atim = root_inode.mtim = root_inode.ctim = current_time;
     root_inode.blocks[0] = 0;
 
-    // Iterate over all disks to set up the file system
+    // every disk is set up by its own thread, they only differ in diskIndex
+    struct disk_init disks[MAX_DISKS];
+    pthread_t threads[MAX_DISKS];
+    int started[MAX_DISKS];
     for (i = 0; i < diskNum; i++)
     {
-        fd = open(diskimgs[i], O_RDWR);
-        if (fd == -1)
-        {
-            perror("Error: open disk");
-            goto error;
-        }
-        if (fstat(fd, &file_stat) == -1)
-        {
-            perror("Error: get file stats");
-            goto error;
-        }
-        if (file_stat.st_size < sb.d_blocks_ptr + (blockNum * BLOCK_SIZE))
-        {
-            fprintf(stderr, "Error: Disk image %s is too small\n", diskimgs[i]);
-            goto error;
-        }
-
-        // change the diskIndex in sb
-        sb.diskIndex = i;
-
-        // Write superblock
-        if (lseek(fd, 0, SEEK_SET) == -1 || write(fd, &sb, sizeof(struct wfs_sb)) != sizeof(struct wfs_sb))
-        {
-            perror("Error: superblock initialize");
-            goto error;
-        }
-
-        // Write inode bitmap
-        size_t inodemapSize = sb.d_bitmap_ptr - sb.i_bitmap_ptr;
-        if (write_bitmap(fd, sb.i_bitmap_ptr, inodemapSize, 0x01) != 0)
-            goto error;
-
-        // Write data bitmap
-        size_t datamapSize = sb.i_blocks_ptr - sb.d_bitmap_ptr;
-        if (write_bitmap(fd, sb.d_bitmap_ptr, datamapSize, 0x00) != 0)
-            goto error;
-
-        // Write root inode
-        uint8_t buffer[BLOCK_SIZE] = {0};
-        memcpy(buffer, &root_inode, sizeof(struct wfs_inode));
-        off_t rootOffset = sb.i_blocks_ptr + (root_inode.num * BLOCK_SIZE);
-        if (lseek(fd, rootOffset, SEEK_SET) == -1 || write(fd, buffer, BLOCK_SIZE) != BLOCK_SIZE)
-        {
-            perror("Error writing root inode");
-            goto error;
-        }
-
-        close(fd);
-        fd = -1; // Reset fd for next disk
+        disks[i] = (struct disk_init){.path = diskimgs[i], .sb = sb, .root = &root_inode};
+        disks[i].sb.diskIndex = i;
+        // without a thread the disk is set up right here
+        started[i] = pthread_create(&threads[i], NULL, init_disk, &disks[i]) == 0;
+        if (!started[i])
+            init_disk(&disks[i]);
     }
 
-    return 0;
-
-error:
-    if (fd != -1)
-        close(fd);
-    return -1;
+    int res = 0;
+    for (i = 0; i < diskNum; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        if (disks[i].res != 0)
+            res = -1;
+    }
+    return res;
 }
 
 int main(int argc, char *argv[])
@@ -177,9 +229,11 @@ int main(int argc, char *argv[])
     int diskNum = 0;
     int inodeNum = -1;
     int blockNum = -1;
+    int blockSize = DEFAULT_BLOCK_SIZE;
+    int journalBlocks = 0;
     int opt;
 
-    while ((opt = getopt(argc, argv, "r:d:i:b:")) != -1)
+    while ((opt = getopt(argc, argv, "r:d:i:b:B:j:")) != -1)
     {
         switch (opt)
         {
@@ -196,6 +250,10 @@ int main(int argc, char *argv[])
             {
                 raid = 2;
             }
+            else if (strcmp(optarg, "5") == 0)
+            {
+                raid = 5;
+            }
             else
             {
                 return 1;
@@ -214,16 +272,33 @@ int main(int argc, char *argv[])
         case 'b':
             blockNum = atoi(optarg);
             break;
+        case 'B':
+            // bytes per data block, a power of two from 512 to 64K
+            blockSize = atoi(optarg);
+            if (blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0)
+            {
+                fprintf(stderr, "Error: block size must be a power of two from %d to %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+                return 1;
+            }
+            break;
+        case 'j':
+            // blocks in the metadata journal, 0 for none
+            journalBlocks = atoi(optarg);
+            if (journalBlocks < 0)
+                return 1;
+            break;
             return 1;
         }
     }
 
-    if (raid == -1 || diskNum == 0 || ((raid == 0 || raid == 1 || raid == 2) && diskNum < 2) || (inodeNum == -1 || blockNum == -1))
+    // raid 5 needs two disks of data next to the parity
+    if (raid == -1 || diskNum == 0 || ((raid == 0 || raid == 1 || raid == 2) && diskNum < 2) || (raid == 5 && diskNum < 3) ||
+        (inodeNum == -1 || blockNum == -1))
     {
         return 1;
     }
 
-    if (mkfs_initial(raid, diskimgs, diskNum, inodeNum, blockNum) < 0)
+    if (mkfs_initial(raid, diskimgs, diskNum, inodeNum, blockNum, blockSize, journalBlocks) < 0)
     {
         return -1;
     }
@@ -1,888 +1,4078 @@
 #define FUSE_USE_VERSION 30
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+// linux/fs.h under it has a BLOCK_SIZE of its own, ours is the superblock's
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE
 #include "wfs.h"
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <endian.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <stdarg.h>
 
 // global variables
 char *diskimgs[MAX_DISKS];
+int diskfds[MAX_DISKS];
+char *diskmaps[MAX_DISKS];
+off_t disksizes[MAX_DISKS];
 struct wfs_sb sb;
 uint8_t *ibitmap = NULL;
 uint8_t *dbitmap = NULL;
+size_t ibit_cursor = 0;
+size_t dbit_cursor = 0;
+size_t ibit_free = 0;
+size_t dbit_free = 0;
 struct wfs_inode *inodes = NULL;
+uint8_t *inode_dirty = NULL;
+uint8_t *ibitmap_dirty = NULL;
+uint8_t *dbitmap_dirty = NULL;
+uint32_t *checksums = NULL;
+uint8_t *checksum_dirty = NULL;
+time_t last_flush = 0;
 size_t diskTurn = 0;
+int disk_io = DISK_IO_MMAP;
+int parallel_io = 1;
+int missing_disk = -1; // raid 5 disk the set was mounted without, or a mirror until its rebuild starts
+int rebuild_disk = -1;  // mirror being rebuilt, written to but not read from
+char *rebuild_image = NULL;
+int rebuild_rate = REBUILD_RATE;
+int dir_format = DIR_LINEAR;
+int inline_files = 0;
+int multithreaded = 1;
+double entry_timeout = ENTRY_TIMEOUT;
+double attr_timeout = ATTR_TIMEOUT;
+int direct_io = 0;
+int readahead_blocks = READAHEAD_BLOCKS;
+int write_behind_blocks = WRITE_BEHIND_BLOCKS;
+uint64_t *lookups = NULL; // lookups the kernel holds on each inode, see wfs_forget
+int *parents = NULL;      // directory each inode is in, for the .. of its listing
+// locking
+// every inode has a reader/writer lock, a directory's is taken before its entries'
+// alloc_lock guards the bitmaps, their cursors, free counts and dirty flags
+// flush_lock serializes metadata flushes
+// txn_lock is held shared by operations changing metadata and exclusively while a flush
+// copies the metadata, it is taken after flush_lock and before any inode lock
+// no inode lock is ever taken while holding one of the mutexes
+// while a mirror is rebuilt, writes to every mirror hold rebuild_lock shared and the
+// rebuild holds it exclusively for each run it copies, it is taken last
+pthread_rwlock_t *inode_locks = NULL;
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t txn_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t repair_lock = PTHREAD_MUTEX_INITIALIZER;
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
-static int wfs_getattr(const char *path, struct stat *stbuf)
+// inode slot and table indexes leading to file block block_idx
+// returns how many tables sit between the inode and the data, -1 past the largest file
+int blockPath(int block_idx, int *slot, int idx[3])
 {
-    // Implementation of getattr function to retrieve file attributes
-    // Fill stbuf structure with the attributes of the file/directory indicated by path
-    // ...
-    int inode_index = parsePath(path, 0, NULL);
-    if (inode_index < 0)
+    size_t rel = block_idx;
+    if (block_idx <= D_BLOCK)
     {
-        // printf("The path %s doesn't exist\ninode_index:%d\n", path, inode_index);
-        return -ENOENT;
+        *slot = block_idx;
+        return 0;
     }
-
-    stbuf->st_uid = inodes[inode_index].uid;
-    stbuf->st_gid = inodes[inode_index].gid;
-    stbuf->st_atime = inodes[inode_index].atim;
-    stbuf->st_mtime = inodes[inode_index].mtim;
-    stbuf->st_mode = inodes[inode_index].mode;
-    stbuf->st_size = inodes[inode_index].size;
-    // printf("find path %s\n", path);
-    return 0; // Return 0 on success
-}
-
-static int wfs_mknod(const char *path, mode_t mode, dev_t rdev)
-{
-    printf("Enter wfs_mknod: %s\n", path);
-    if (getIbit() == sb.num_inodes)
+    rel -= IND_BLOCK;
+    if (rel < PTRS_PER_BLOCK)
     {
-        return -ENOSPC;
+        *slot = IND_BLOCK;
+        idx[0] = rel;
+        return 1;
     }
-    // if (!S_ISREG(mode))
-    // {
-    //     perror("Error: not use mknod to create a common file\n");
-    //     return -EINVAL;
-    // }
-    // get the inode index of dir being write to
-    char name[MAX_NAME + 2];
-    int inode_index = parsePath(path, 1, name);
-    if (inode_index == -2)
+    rel -= PTRS_PER_BLOCK;
+    if (rel < PTRS_PER_BLOCK * PTRS_PER_BLOCK)
     {
-        perror("Error: same name already exist\n");
-        return -EEXIST;
+        *slot = DIND_BLOCK;
+        idx[0] = rel / PTRS_PER_BLOCK;
+        idx[1] = rel % PTRS_PER_BLOCK;
+        return 2;
     }
-    else if (inode_index == -1)
+    rel -= PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+    if (rel < PTRS_PER_BLOCK * PTRS_PER_BLOCK * PTRS_PER_BLOCK)
     {
-        perror("Error: path cannot be accessed\n");
-        return -ENOENT;
+        *slot = TIND_BLOCK;
+        idx[0] = rel / (PTRS_PER_BLOCK * PTRS_PER_BLOCK);
+        idx[1] = rel / PTRS_PER_BLOCK % PTRS_PER_BLOCK;
+        idx[2] = rel % PTRS_PER_BLOCK;
+        return 3;
     }
+    return -1;
+}
 
-    if (writeToDir(inode_index, name, 0, mode) < 0)
+int mapInit(struct block_map *map, struct wfs_inode *inode)
+{
+    memset(map, 0, sizeof(struct block_map));
+    map->inode = inode;
+    map->leaf = -1;
+    map->table[0] = malloc(3 * BLOCK_SIZE);
+    if (map->table[0] == NULL)
     {
-        perror("Error: not enough space\n");
-        return -ENOSPC;
+        perror("Error: allocate indirect tables\n");
+        return -1;
     }
-    updateMetadata();
-    print_non_empty_entries(0);
+    map->table[1] = map->table[0] + PTRS_PER_BLOCK;
+    map->table[2] = map->table[1] + PTRS_PER_BLOCK;
     return 0;
 }
-static int wfs_mkdir(const char *path, mode_t mode)
+
+// make the table at ptr (+1) the one loaded at level, a fresh table starts zeroed
+static void mapLoad(struct block_map *map, int level, off_t ptr, int fresh)
 {
-    printf("Enter test wfs_mkdir:%s\n", path);
-    if (getIbit() == sb.num_inodes)
-    {
-        return -ENOSPC;
-    }
-    char name[MAX_NAME + 2];
-    int inode_index = parsePath(path, 1, name);
-    if (inode_index == -2)
+    if (map->db[level] == ptr)
+        return;
+    if (map->dirty[level])
+        write_metablock_toIdx(map->db[level] - 1, map->table[level]);
+    map->db[level] = ptr;
+    map->dirty[level] = fresh;
+    if (fresh)
+        memset(map->table[level], 0, BLOCK_SIZE);
+    else
+        read_from_indirect_db(ptr - 1, map->table[level]);
+}
+
+off_t *mapBlock(struct block_map *map, int block_idx)
+{
+    int slot, idx[3];
+    int depth = blockPath(block_idx, &slot, idx);
+    if (depth < 0)
+        return NULL;
+    off_t *ptr = &map->inode->blocks[slot];
+    map->leaf = -1;
+    for (int l = 0; l < depth; l++)
     {
-        perror("Error: same name already exist\n");
-        return -EEXIST;
+        int fresh = *ptr == 0;
+        if (fresh)
+        {
+            if (map->pool == NULL)
+                return NULL;
+            *ptr = map->pool[map->pool_next++] + 1;
+            mapDirty(map);
+        }
+        mapLoad(map, l, *ptr, fresh);
+        map->leaf = l;
+        ptr = &map->table[l][idx[l]];
     }
-    else if (inode_index == -1)
+    return ptr;
+}
+
+// data block of file block block_idx, -1 for a hole
+off_t mapDataBlock(struct block_map *map, int block_idx)
+{
+    off_t *slot = mapBlock(map, block_idx);
+    return slot == NULL ? -1 : *slot - 1;
+}
+
+// return 1 when file block block_idx has no data block yet and add the tables
+// it is missing to *tables, a table shared with the block before is only counted there
+int mapMissing(struct block_map *map, int block_idx, int first, int *tables)
+{
+    int slot, idx[3];
+    int depth = blockPath(block_idx, &slot, idx);
+    off_t ptr = map->inode->blocks[slot];
+    for (int l = 0; l < depth; l++)
     {
-        perror("Error: path cannot be accessed\n");
-        return -ENOENT;
+        if (ptr == 0)
+        {
+            // the table at level l starts at this block when every index below it is 0
+            int k = l;
+            while (k < depth && idx[k] == 0)
+                k++;
+            *tables += block_idx == first || k == depth;
+            continue;
+        }
+        mapLoad(map, l, ptr, 0);
+        ptr = map->table[l][idx[l]];
     }
+    return ptr == 0;
+}
+
+// the last slot returned by mapBlock was changed
+void mapDirty(struct block_map *map)
+{
+    if (map->leaf >= 0)
+        map->dirty[map->leaf] = 1;
+}
 
-    // printf("mkdir: inode_index: %d, name: %s\n", inode_index, name);
-    if (writeToDir(inode_index, name, 1, mode) < 0)
+void mapFlush(struct block_map *map)
+{
+    for (int l = 0; l < 3; l++)
     {
-        perror("Error: not enough space\n");
-        return -ENOSPC;
+        if (map->dirty[l])
+            write_metablock_toIdx(map->db[l] - 1, map->table[l]);
+        map->dirty[l] = 0;
     }
-    updateMetadata();
-    // printf("Successful create dir %s\n", name);
-    printf("disk1:");
-    print_non_empty_entries(0);
-    printf("disk2:");
-    print_non_empty_entries(1);
-    printf("disk3:");
-    print_non_empty_entries(2);
-    return 0;
 }
-static int wfs_unlink(const char *path)
+
+void mapFree(struct block_map *map)
+{
+    free(map->table[0]);
+}
+
+void freeBlockTree(off_t ptr, int depth)
 {
-    int inode_index = parsePath(path, 0, NULL);
-    if (inode_index < 0)
+    if (ptr == 0)
+        return;
+    if (depth > 0)
     {
-        perror("The path doesn't exist");
-        return -ENOENT;
+        off_t table[PTRS_PER_BLOCK];
+        read_from_indirect_db(ptr - 1, table);
+        for (size_t i = 0; i < PTRS_PER_BLOCK; i++)
+            freeBlockTree(table[i], depth - 1);
     }
-    if (S_ISDIR(inodes[inode_index].mode))
+    clear_dbit(ptr - 1);
+}
+
+// linear directories only hold dentry blocks, everything else maps through tables
+void freeInodeBlocks(struct wfs_inode *inode)
+{
+    int linear = S_ISDIR(inode->mode) && !(inode->flags & WFS_DIR_HASHED);
+    for (int i = 0; i < N_BLOCKS; i++)
+        freeBlockTree(inode->blocks[i], linear || i <= D_BLOCK ? 0 : i - D_BLOCK);
+}
+
+int promoteInline(struct wfs_inode *inode)
+{
+    if (inode->size > 0)
     {
-        perror("Error: Try to unlink a dir");
-        return -1;
+        int db_index;
+        if (allocDbitRun(1, &db_index, -1) != 0)
+            return -1;
+        // INLINE_DATA_SIZE is below the smallest block size, one block holds it all
+        char block[BLOCK_SIZE];
+        memset(block, 0, BLOCK_SIZE);
+        memcpy(block, inode->inline_data, inode->size);
+        write_datablock_toIdx(db_index, block);
+        inode->blocks[0] = db_index + 1;
     }
+    inode->flags &= ~WFS_INLINE_DATA;
+    memset(inode->inline_data, 0, INLINE_DATA_SIZE);
+    return 0;
+}
+
+// data block of directory block i, -1 past the last one
+// map is only used by hashed directories
+static int dirBlock(struct wfs_inode *dir, struct block_map *map, int i)
+{
+    if (dir->flags & WFS_DIR_HASHED)
+        return i < dir->dir_buckets ? mapDataBlock(map, i) : -1;
+    return i < N_BLOCKS ? dir->blocks[i] - 1 : -1;
+}
 
-    // free db it takes up
+// directory entries
+// a linear directory fills DENTRY_NUM dentries per block in slot order and is scanned whole
+// return the inode number of name, -1 if it is not there
+int lookupDentry(struct wfs_inode *dir, const char *name)
+{
+    if (dir->flags & WFS_DIR_HASHED)
+        return hashLookup(dir, name);
     for (int i = 0; i < N_BLOCKS; i++)
     {
-        int db_idx = inodes[inode_index].blocks[i] - 1;
-        if (db_idx == -1)
-            continue;
-        // unlink indirect blocks
-        if (i == N_BLOCKS - 1)
+        int db_index = dir->blocks[i] - 1;
+        // if db_index =-1, then this block have been allocated to a datablock yet
+        if (db_index == -1)
+            break;
+        struct wfs_dentry db[DENTRY_NUM];
+        getDataBlockByDbindex(db, db_index);
+        for (int j = 0; j < DENTRY_NUM; j++)
         {
-            off_t indirect_db_idx[BLOCK_SIZE / sizeof(off_t)];
-            read_from_indirect_db(db_idx, indirect_db_idx);
-            for (int j = 0; j < BLOCK_SIZE / sizeof(off_t); j++)
-            {
-                off_t db_indirect_block = indirect_db_idx[j] - 1;
-                printf("Unlink: unmap block_idx:%d,j:%d,data_block_ids:%d\n", i, j, db_idx);
-                if (db_indirect_block == -1)
-                    continue;
-                dbitmap[db_indirect_block / 8] &= ~(1 << db_indirect_block % 8);
-            }
+            if (db[j].name[0] != '\0' && strcmp(db[j].name, name) == 0)
+                return db[j].num;
         }
-        // unlink direct blocks
-        dbitmap[db_idx / 8] &= ~(1 << db_idx % 8);
-        // printf("Unlink: unmap dbitmap: block_idx: %d, data_block_idx: %d\n", i, db_idx);
     }
+    return -1;
+}
 
-    free_inode_from_parent(path, inode_index);
-    print_non_empty_entries(0);
+// return -1 if there is no room for another entry
+int addDentry(struct wfs_inode *dir, const char *name, int num)
+{
+    if (dir->flags & WFS_DIR_HASHED)
+        return hashInsert(dir, name, num);
+    // get first dentry block with empty dentry
+    int data_block_idx;
+    off_t newDataPtr = dataToWrite_ptr(dir, &data_block_idx);
+    if (newDataPtr < 0)
+        return -1;
+    struct wfs_dentry db[DENTRY_NUM];
+    getDataBlockByDbindex(db, data_block_idx);
+    strncpy(db[newDataPtr].name, name, MAX_NAME - 1);
+    db[newDataPtr].name[MAX_NAME - 1] = '\0';
+    db[newDataPtr].num = num;
+    // write to every disk through the block layer
+    write_metablock_toIdx(data_block_idx, db);
     return 0;
 }
-static int wfs_rmdir(const char *path)
+
+void removeDentry(struct wfs_inode *dir, const char *name)
 {
-    int inode_index = parsePath(path, 0, NULL);
-    if (inode_index < 0)
-    {
-        perror("The path doesn't exist");
-        return -ENOENT;
-    }
-    if (!S_ISDIR(inodes[inode_index].mode))
+    if (dir->flags & WFS_DIR_HASHED)
     {
-        perror("Error: Try to rmdir a file");
-        return -1;
+        hashRemove(dir, name);
+        return;
     }
-
-    // 新增：检查目录是否为空
-    if (inodes[inode_index].size > 0) // 假设 size 表示目录中的条目数
+    // find the dentry
+    for (int i = 0; i < N_BLOCKS; i++)
     {
-        perror("Error: Directory is not empty");
-        return -ENOTEMPTY; // 返回目录不为空的错误
+        off_t dentry_block_idx = dir->blocks[i] - 1;
+        if (dentry_block_idx == -1)
+            break;
+        struct wfs_dentry db[DENTRY_NUM];
+        getDataBlockByDbindex(db, dentry_block_idx);
+        for (int j = 0; j < DENTRY_NUM; j++)
+        {
+            if (strcmp(db[j].name, name) == 0)
+            {
+                memset(&db[j], 0, sizeof(struct wfs_dentry));
+                write_metablock_toIdx(dentry_block_idx, (void *)db);
+                return;
+            }
+        }
     }
+}
 
-    free_inode_from_parent(path, inode_index);
-    print_non_empty_entries(0);
-    return 0;
+// hashed directories
+// bucket i is block i of the directory, mapped through the same tables as file blocks
+// a bucket's first dentry is its header: no name, and num is 1 once an insert had to
+// probe past the bucket, lookups only go on to the next bucket while that is set
+// the table doubles before it gets more than 3/4 full, so probes stay short
+uint32_t nameHash(const char *name)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (; *name != '\0'; name++)
+        h = (h ^ (uint8_t)*name) * 16777619u;
+    return h;
 }
-static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+
+int hashLookup(struct wfs_inode *dir, const char *name)
 {
-    printf("Enter wfs_read\n");
-    int inode_index = parsePath(path, 0, NULL);
-    if (inode_index < 0)
-    {
-        perror("The path doesn't exist");
-        return -ENOENT;
-    }
-    if (S_ISDIR(inodes[inode_index].mode))
-    {
-        perror("Error: Try to read a dir");
+    struct block_map map;
+    if (dir->dir_buckets == 0 || mapInit(&map, dir) != 0)
         return -1;
-    }
-    if (offset > inodes[inode_index].size)
+    uint32_t h = nameHash(name);
+    int num = -1;
+    for (int p = 0; p < dir->dir_buckets; p++)
     {
-        perror("Error: Try to read out of a file");
-        return -1;
+        struct wfs_dentry bucket[DENTRY_NUM];
+        getDataBlockByDbindex(bucket, mapDataBlock(&map, (h + p) % dir->dir_buckets));
+        for (int j = 1; j < DENTRY_NUM && num < 0; j++)
+        {
+            if (bucket[j].name[0] != '\0' && strcmp(bucket[j].name, name) == 0)
+                num = bucket[j].num;
+        }
+        if (num >= 0 || bucket[0].num == 0)
+            break;
     }
+    mapFree(&map);
+    return num;
+}
 
-    struct wfs_inode inode = inodes[inode_index];
-    if (offset + size > inode.size)
-    {
-        size = inode.size - offset;
-    }
+// the directory's size counts its entries, it is updated by the caller
+int hashInsert(struct wfs_inode *dir, const char *name, int num)
+{
+    int entries = dir->size / sizeof(struct wfs_dentry);
+    int capacity = dir->dir_buckets * (DENTRY_NUM - 1);
+    // a table that cannot grow takes entries until it is full
+    if ((entries + 1) * 4 > capacity * 3 &&
+        hashGrow(dir, dir->dir_buckets ? dir->dir_buckets * 2 : 1) != 0 && entries >= capacity)
+        return -1;
 
-    // read the file
-    size_t read = 0;
-    while (size > 0)
+    struct block_map map;
+    if (mapInit(&map, dir) != 0)
+        return -1;
+    uint32_t h = nameHash(name);
+    int res = -1;
+    for (int p = 0; p < dir->dir_buckets && res < 0; p++)
     {
-        int block_idx = offset / BLOCK_SIZE;
-        int db_offset = offset % BLOCK_SIZE;
-        off_t db_idx;
-
-        // direct blocks
-        if (block_idx <= D_BLOCK)
+        int db_index = mapDataBlock(&map, (h + p) % dir->dir_buckets);
+        struct wfs_dentry bucket[DENTRY_NUM];
+        getDataBlockByDbindex(bucket, db_index);
+        for (int j = 1; j < DENTRY_NUM && res < 0; j++)
         {
-            db_idx = inode.blocks[block_idx] - 1;
+            if (bucket[j].name[0] != '\0')
+                continue;
+            strncpy(bucket[j].name, name, MAX_NAME - 1);
+            bucket[j].name[MAX_NAME - 1] = '\0';
+            bucket[j].num = num;
+            res = 0;
         }
-        // indirect blocks
-        else
+        // a full bucket sends lookups on to the next one
+        if (res == 0 || bucket[0].num == 0)
         {
-            // TODO: implement indirect block
-            off_t indirect_db_idx[BLOCK_SIZE / sizeof(off_t)];
-            read_from_indirect_db(inode.blocks[IND_BLOCK] - 1, indirect_db_idx);
-            db_idx = indirect_db_idx[block_idx - IND_BLOCK] - 1;
+            if (res < 0)
+                bucket[0].num = 1;
+            write_metablock_toIdx(db_index, bucket);
         }
-
-        char block[BLOCK_SIZE];
-        getDataBlockByDbindex((void *)block, db_idx);
-
-        size_t read_bytes = MIN(BLOCK_SIZE - db_offset, size);
-        memcpy(buf + read, block + db_offset, read_bytes);
-
-        // // Debug output to check read data
-        // printf("Read from block %zu: ", db_idx);
-        // for (size_t i = 0; i < read_bytes; i++)
-        // {
-        //     printf("%02x ", (unsigned char)block[db_offset + i]);
-        // }
-        // printf("\n");
-
-        read += read_bytes;
-        offset += read_bytes;
-        size -= read_bytes;
     }
-    return read;
+    mapFree(&map);
+    return res;
 }
-static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+
+void hashRemove(struct wfs_inode *dir, const char *name)
 {
-    printf("Enter wfs_write: %s\n", path);
-    int inode_index = parsePath(path, 0, NULL);
-    if (inode_index < 0)
-    {
-        return -ENOENT;
-    }
-    // Check if the inode is a directory
-    if (S_ISDIR(inodes[inode_index].mode))
+    struct block_map map;
+    if (dir->dir_buckets == 0 || mapInit(&map, dir) != 0)
+        return;
+    uint32_t h = nameHash(name);
+    for (int p = 0; p < dir->dir_buckets; p++)
     {
-        return -EISDIR; // Return error code for writing to a directory
+        int db_index = mapDataBlock(&map, (h + p) % dir->dir_buckets);
+        struct wfs_dentry bucket[DENTRY_NUM];
+        getDataBlockByDbindex(bucket, db_index);
+        int found = 0;
+        for (int j = 1; j < DENTRY_NUM && !found; j++)
+        {
+            if (bucket[j].name[0] != '\0' && strcmp(bucket[j].name, name) == 0)
+            {
+                memset(&bucket[j], 0, sizeof(struct wfs_dentry));
+                write_metablock_toIdx(db_index, bucket);
+                found = 1;
+            }
+        }
+        if (found || bucket[0].num == 0)
+            break;
     }
-    // Check if the write exceeds the maximum file size
-    if (size + offset > (N_BLOCKS - 1 + (BLOCK_SIZE / sizeof(off_t))) * BLOCK_SIZE)
+    mapFree(&map);
+}
+
+// place a dentry in the in-memory buckets of a table being rebuilt
+static void hashPlace(struct wfs_dentry *buckets, int nbuckets, const struct wfs_dentry *entry)
+{
+    uint32_t h = nameHash(entry->name);
+    for (int p = 0; p < nbuckets; p++)
     {
-        return -ENOSPC;
+        struct wfs_dentry *bucket = buckets + (size_t)((h + p) % nbuckets) * DENTRY_NUM;
+        for (int j = 1; j < DENTRY_NUM; j++)
+        {
+            if (bucket[j].name[0] == '\0')
+            {
+                bucket[j] = *entry;
+                return;
+            }
+        }
+        bucket[0].num = 1;
     }
-    size_t written = 0;
+}
 
-    // save a copy for old dbitmap
-    uint8_t *dbitmap_old = malloc((sb.num_data_blocks / 8));
-    if (dbitmap_old == NULL)
+// rebuild the table with nbuckets buckets in freshly allocated blocks, then free the old ones
+// return -1 and leave the directory alone if there is not enough space
+int hashGrow(struct wfs_inode *dir, int nbuckets)
+{
+    struct wfs_inode grown = *dir;
+    memset(grown.blocks, 0, sizeof(grown.blocks));
+    grown.dir_buckets = nbuckets;
+    struct block_map map, old;
+    if (mapInit(&map, &grown) != 0)
+        return -1;
+    if (mapInit(&old, dir) != 0)
     {
-        perror("Failed to allocate memory for dbitmap_old\n");
-        return -1; // 处理内存分配失败
+        mapFree(&map);
+        return -1;
     }
-    memcpy(dbitmap_old, dbitmap, (sb.num_data_blocks / 8));
-    // save a copy for inode
-    struct wfs_inode inode = inodes[inode_index];
 
-    // write the file
-    while (size > 0)
+    int need_data = 0;
+    int need_tables = 0;
+    for (int b = 0; b < nbuckets; b++)
+        need_data += mapMissing(&map, b, 0, &need_tables);
+    int need = need_data + need_tables;
+    int *new_blocks = malloc(need * sizeof(int));
+    struct wfs_dentry *buckets = calloc(nbuckets, BLOCK_SIZE);
+    int res = -1;
+    if (new_blocks != NULL && buckets != NULL && allocDbitRun(need, new_blocks, -1) == 0)
     {
-        int block_idx = offset / BLOCK_SIZE;
-        int db_offset = offset % BLOCK_SIZE;
-        off_t db_idx;
-
-        // direct blocks
-        if (block_idx <= D_BLOCK)
+        for (int b = 0; b < dir->dir_buckets; b++)
         {
-            if (inode.blocks[block_idx] == 0)
+            struct wfs_dentry bucket[DENTRY_NUM];
+            getDataBlockByDbindex(bucket, mapDataBlock(&old, b));
+            for (int j = 1; j < DENTRY_NUM; j++)
             {
-                // Allocate a data block
-                int new_block = getDbit();
-                if (new_block < 0)
-                {
-                    memcpy(dbitmap, dbitmap_old, (sb.num_data_blocks / 8));
-                    return -ENOSPC;
-                }
-                inode.blocks[block_idx] = new_block + 1;
-                set_dbit(new_block);
+                if (bucket[j].name[0] != '\0')
+                    hashPlace(buckets, nbuckets, &bucket[j]);
             }
-            db_idx = inode.blocks[block_idx] - 1;
         }
-        // indirect blocks
-        else
+
+        // the buckets take the front of the run and the tables go after them
+        map.pool = new_blocks;
+        map.pool_next = need_data;
+        for (int b = 0; b < nbuckets; b++)
         {
-            // TODO: implement indirect block
-            int indirect_block_db_idx = inode.blocks[IND_BLOCK] - 1;
-            // initialize indirect dir db
-            if (indirect_block_db_idx == -1)
-            {
-                // Allocate a data block
-                int new_block = getDbit();
-                if (new_block < 0)
-                {
-                    memcpy(dbitmap, dbitmap_old, (sb.num_data_blocks / 8));
-                    return -ENOSPC;
-                }
-                inode.blocks[IND_BLOCK] = new_block + 1;
-                indirect_block_db_idx = new_block;
-                set_dbit(new_block);
-            }
+            *mapBlock(&map, b) = new_blocks[b] + 1;
+            mapDirty(&map);
+            write_metablock_toIdx(new_blocks[b], buckets + (size_t)b * DENTRY_NUM);
+        }
+        mapFlush(&map);
 
-            // read indirect dir datablock
-            off_t indirect_db_idx[BLOCK_SIZE / sizeof(off_t)];
-            read_from_indirect_db(inode.blocks[IND_BLOCK] - 1, indirect_db_idx);
+        freeInodeBlocks(dir);
+        memcpy(dir->blocks, grown.blocks, sizeof(dir->blocks));
+        dir->dir_buckets = nbuckets;
+        res = 0;
+    }
+    free(new_blocks);
+    free(buckets);
+    mapFree(&old);
+    mapFree(&map);
+    return res;
+}
 
-            // initialize indirect db if needed
-            if (indirect_db_idx[block_idx - IND_BLOCK] == 0)
-            {
-                // Allocate a data block
-                int new_block = getDbit();
-                if (new_block < 0)
-                {
-                    memcpy(dbitmap, dbitmap_old, (sb.num_data_blocks / 8));
-                    return -ENOSPC;
-                }
-                indirect_db_idx[block_idx - IND_BLOCK] = new_block + 1;
-                write_datablock_toIdx(indirect_block_db_idx, indirect_db_idx);
-                set_dbit(new_block);
-            }
-            db_idx = indirect_db_idx[block_idx - IND_BLOCK] - 1;
-        }
+// FUSE numbers the root FUSE_ROOT_ID, wfs numbers it 0
+#define WFS_NUM(ino) ((int)((ino) - FUSE_ROOT_ID))
+#define FUSE_INO(num) ((fuse_ino_t)(num) + FUSE_ROOT_ID)
+// the statistics file takes the number after the last inode
+#define STATS_NUM ((int)sb.num_inodes)
 
-        char block[BLOCK_SIZE];
-        getDataBlockByDbindex((void *)block, db_idx);
+// the caller holds the inode's lock
+static void inodeAttr(int num, struct stat *stbuf)
+{
+    struct wfs_inode *inode = &inodes[num];
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_ino = FUSE_INO(num);
+    stbuf->st_mode = inode->mode;
+    stbuf->st_nlink = inode->nlinks;
+    stbuf->st_uid = inode->uid;
+    stbuf->st_gid = inode->gid;
+    stbuf->st_size = inode->size;
+    stbuf->st_atime = inode->atim;
+    stbuf->st_mtime = inode->mtim;
+    stbuf->st_ctime = inode->ctim;
+}
 
-        size_t copy_bytes = MIN(BLOCK_SIZE - db_offset, size);
-        memcpy(block + db_offset, buf + written, copy_bytes);
+static void statsAttr(struct stat *stbuf)
+{
+    char report[STATS_SIZE];
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_ino = FUSE_INO(STATS_NUM);
+    stbuf->st_mode = S_IFREG | 0644;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = inodes[0].uid;
+    stbuf->st_gid = inodes[0].gid;
+    stbuf->st_atime = stbuf->st_mtime = time(NULL);
+    stbuf->st_size = statsFormat(report, sizeof(report));
+}
 
-        write_datablock_toIdx(db_idx, block);
+// hand the kernel an entry for inode num in directory parent, that is one more lookup of it
+// the caller holds the inode's lock
+static void inodeEntry(int num, int parent, struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->ino = FUSE_INO(num);
+    e->attr_timeout = attr_timeout;
+    e->entry_timeout = entry_timeout;
+    inodeAttr(num, &e->attr);
+    __atomic_add_fetch(&lookups[num], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&parents[num], parent, __ATOMIC_RELAXED);
+}
 
-        // // Debug output to check written data
-        // printf("Written to block %zu: ", db_idx);
-        // for (size_t i = 0; i < copy_bytes; i++)
-        // {
-        //     printf("%02x ", (unsigned char)block[db_offset + i]);
-        // }
-        // printf("\n");
+// lock a directory the kernel named by its inode number
+static int lockDir(int num, int lock)
+{
+    lockInode(num, lock);
+    if (S_ISDIR(inodes[num].mode))
+        return 0;
+    unlockInode(num);
+    return -ENOTDIR;
+}
 
-        written += copy_bytes;
-        offset += copy_bytes;
-        size -= copy_bytes;
+static int wfs_lookup(int parent, const char *name, struct fuse_entry_param *e)
+{
+    TRACE(TRACE_OPS, "lookup %d %s", parent, name);
+    if (parent == 0 && strcmp(name, STATS_NAME) == 0)
+    {
+        // the statistics change between calls, so the kernel must not cache them
+        memset(e, 0, sizeof(*e));
+        e->ino = FUSE_INO(STATS_NUM);
+        e->entry_timeout = entry_timeout;
+        statsAttr(&e->attr);
+        return 0;
     }
-
-    // Update inode size if needed
-    if (offset > inode.size)
+    int res = lockDir(parent, LOCK_READ);
+    if (res < 0)
+        return res;
+    int num = getInodeFromName(name, parent);
+    if (num < 0)
     {
-        inode.size = offset;
+        unlockInode(parent);
+        return -ENOENT;
     }
-    inode.mtim = time(NULL);
-    inodes[inode_index] = inode;
-    updateMetadata();
-    print_non_empty_entries(0);
-    return written;
+    lockInode(num, LOCK_READ);
+    inodeEntry(num, parent, e);
+    unlockInode(num);
+    unlockInode(parent);
+    return 0;
 }
-static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+
+// the kernel dropped nlookup of its lookups of an inode
+// an inode unlinked while the kernel still held it goes with the last one
+static void wfs_forget(int num, uint64_t nlookup)
 {
-    printf("Enter wfs_readdir for path: %s\n", path);
+    if (num == STATS_NUM)
+        return;
+    TRACE(TRACE_OPS, "forget %d %ju", num, (uintmax_t)nlookup);
+    beginOp();
+    lockInode(num, LOCK_WRITE);
+    int orphan = __atomic_sub_fetch(&lookups[num], nlookup, __ATOMIC_RELAXED) == 0 &&
+                 (inodes[num].flags & WFS_ORPHAN);
+    if (orphan)
+        releaseInode(num);
+    unlockInode(num);
+    endOp();
+    if (orphan)
+        metadataChanged();
+}
 
-    // 获取目录的 inode 索引
-    int inode_index = parsePath(path, 0, NULL);
-    if (inode_index < 0)
+static int wfs_getattr(int num, struct stat *stbuf)
+{
+    TRACE(TRACE_OPS, "getattr %d", num);
+    if (num == STATS_NUM)
     {
-        perror("The path doesn't exist");
-        return -ENOENT;
+        statsAttr(stbuf);
+        return 0;
     }
+    lockInode(num, LOCK_READ);
+    inodeAttr(num, stbuf);
+    unlockInode(num);
+    return 0;
+}
 
-    // 检查是否是目录
-    if (!S_ISDIR(inodes[inode_index].mode))
+// only the statistics file changes size, truncating it resets them
+// wfs has no chmod, chown or resizing of files, times are set as asked
+static int wfs_setattr(int num, struct stat *attr, int to_set, struct stat *stbuf)
+{
+    TRACE(TRACE_OPS, "setattr %d %x", num, (unsigned)to_set);
+    if (num == STATS_NUM)
     {
-        perror("Error: Not a directory");
-        return -ENOTDIR;
+        if (to_set & FUSE_SET_ATTR_SIZE)
+            statsReset();
+        statsAttr(stbuf);
+        return 0;
     }
-
-    // 填充目录项
-    filler(buf, ".", NULL, 0);  // 添加当前目录项
-    filler(buf, "..", NULL, 0); // 添加父目录项
-
-    // 遍历数据块，读取目录项
-    for (int i = 0; i < N_BLOCKS; i++)
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+        return -ENOSYS;
+    beginOp();
+    lockInode(num, LOCK_WRITE);
+    struct wfs_inode *inode = &inodes[num];
+    if ((to_set & FUSE_SET_ATTR_SIZE) && attr->st_size != inode->size)
     {
-        int db_index = inodes[inode_index].blocks[i] - 1; // 获取数据块索引
-        if (db_index == -1)
-            break; // 如果没有更多数据块，退出
-
-        struct wfs_dentry entries[DENTRY_NUM];
-        getDataBlockByDbindex(entries, db_index); // 读取数据块
-
-        // 遍历目录项
-        for (int j = 0; j < DENTRY_NUM; j++)
-        {
-            if (entries[j].name[0] != '\0') // 如果目录项有效
-            {
-                filler(buf, entries[j].name, NULL, 0); // 加目录项到缓冲区
-            }
-        }
+        unlockInode(num);
+        endOp();
+        return -ENOSYS;
     }
-
-    return 0; // 成功返回
+    time_t now = time(NULL);
+    if (to_set & FUSE_SET_ATTR_ATIME)
+        inode->atim = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? now : attr->st_atime;
+    if (to_set & FUSE_SET_ATTR_MTIME)
+        inode->mtim = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? now : attr->st_mtime;
+    if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))
+        markInodeDirty(num);
+    inodeAttr(num, stbuf);
+    unlockInode(num);
+    endOp();
+    metadataChanged();
+    return 0;
 }
 
-static struct fuse_operations ops = {
-    .getattr = wfs_getattr,
-    .mknod = wfs_mknod,
-    .mkdir = wfs_mkdir,
-    .unlink = wfs_unlink,
-    .rmdir = wfs_rmdir,
-    .read = wfs_read,
-    .write = wfs_write,
-    .readdir = wfs_readdir,
-};
-
-// helper method
-int initialMetadata(char *name)
+// create a file (m 0) or directory (m 1) in directory parent
+static int wfs_create(int parent, const char *name, int m, mode_t mode, struct fuse_entry_param *e)
 {
-    int fd = -1;
-    fd = open(name, O_RDWR);
-    if (fd == -1)
+    TRACE(TRACE_OPS, "%s %d %s mode %o", m ? "mkdir" : "mknod", parent, name, (unsigned)mode);
+    if (parent == 0 && strcmp(name, STATS_NAME) == 0)
+        return -EEXIST;
+    // a dentry holds the name and its end
+    if (strlen(name) >= MAX_NAME)
+        return -ENAMETOOLONG;
+    // the directory stays write-locked until the entry is in
+    beginOp();
+    int res = lockDir(parent, LOCK_WRITE);
+    if (res == 0 && getInodeFromName(name, parent) >= 0)
     {
-        perror("Error opening first disk image\n");
-        return -1;
+        perror("Error: same name already exist\n");
+        unlockInode(parent);
+        res = -EEXIST;
     }
-
-    // read the superblock
-    if (read(fd, &sb, sizeof(struct wfs_sb)) != sizeof(struct wfs_sb))
+    if (res < 0)
     {
-        perror("Failed to read superblock\n");
-        return -1;
+        endOp();
+        return res;
     }
 
-    // allocate and read the ibitmap
-    size_t ibitmap_size = sb.num_inodes / 8;
-    ibitmap = (uint8_t *)malloc(ibitmap_size);
-    if (ibitmap == NULL)
-    {
-        perror("Failed to allocate memory for ibitmap\n");
-        close(fd);
-        return 1;
-    }
-    if (lseek(fd, sb.i_bitmap_ptr, SEEK_SET) == -1)
+    int num = writeToDir(parent, name, m, mode);
+    if (num >= 0)
     {
-        perror("Error: ibitmap offset\n");
-        free(ibitmap);
-        close(fd);
-        return -1;
+        lockInode(num, LOCK_READ);
+        inodeEntry(num, parent, e);
+        unlockInode(num);
     }
-    if (read(fd, ibitmap, ibitmap_size) != ibitmap_size)
+    unlockInode(parent);
+    endOp();
+    if (num < 0)
     {
-        perror("Failed to read ibitmap\n");
-        free(ibitmap);
-        close(fd);
-        return -1;
+        // blocks freed by earlier operations may only be waiting for a commit
+        if (journalReclaim())
+            return wfs_create(parent, name, m, mode, e);
+        perror("Error: not enough space\n");
+        return -ENOSPC;
     }
+    metadataChanged();
+    return 0;
+}
 
-    // allocate and read the dbitmap
-    if (sb.raid != 0)
+// remove a file (m 0) or an empty directory (m 1) from directory parent
+static int wfs_remove(int parent, const char *name, int m)
+{
+    TRACE(TRACE_OPS, "%s %d %s", m ? "rmdir" : "unlink", parent, name);
+    if (parent == 0 && strcmp(name, STATS_NAME) == 0)
+        return -EPERM;
+    // the parent and then the victim are write-locked while the entry goes away
+    beginOp();
+    int res = lockDir(parent, LOCK_WRITE);
+    if (res < 0)
     {
-        size_t dbitmap_size = sb.num_data_blocks / 8;
-        dbitmap = (uint8_t *)malloc(dbitmap_size);
-        memset(dbitmap, 0, dbitmap_size);
+        endOp();
+        return res;
     }
-    // raid ==0
-    else
+    int inode_index = getInodeFromName(name, parent);
+    if (inode_index < 0)
     {
-        size_t dbitmap_size = (sb.num_data_blocks / 8) * sb.diskNum;
-        dbitmap = (uint8_t *)malloc(dbitmap_size);
-        memset(dbitmap, 0, dbitmap_size);
+        unlockInode(parent);
+        perror("The path doesn't exist");
+        endOp();
+        return -ENOENT;
     }
-
-    // allocate and read the inodes
-    size_t inodes_size = sb.num_inodes * INODE_SIZE;
-    inodes = (struct wfs_inode *)malloc(inodes_size);
-    if (inodes == NULL)
+    lockInode(inode_index, LOCK_WRITE);
+    if (!m && S_ISDIR(inodes[inode_index].mode))
     {
-        perror("Failed to allocate memory for inodes\n");
-        free(ibitmap);
-        free(dbitmap);
-        close(fd);
-        return 1;
+        perror("Error: Try to unlink a dir");
+        res = -EISDIR;
     }
-    if (lseek(fd, sb.i_blocks_ptr, SEEK_SET) == -1)
+    else if (m && !S_ISDIR(inodes[inode_index].mode))
     {
-        perror("Error: inodes offset\n");
-        free(ibitmap);
-        free(dbitmap);
-        free(inodes);
-        close(fd);
-        return -1;
+        perror("Error: Try to rmdir a file");
+        res = -ENOTDIR;
     }
-    if (read(fd, inodes, inodes_size) != inodes_size)
+    // a directory's size counts its entries
+    else if (m && inodes[inode_index].size > 0)
     {
-        perror("Failed to read inodes\n");
-        free(ibitmap);
-        free(dbitmap);
-        free(inodes);
-        close(fd);
-        return -1;
+        perror("Error: Directory is not empty");
+        res = -ENOTEMPTY;
     }
+    else
+        free_inode_from_parent(parent, name, inode_index);
+    unlockInode(inode_index);
+    unlockInode(parent);
+    endOp();
+    if (res != 0)
+        return res;
 
-    // return 0 on success
+    metadataChanged();
     return 0;
 }
-
-int checkValidDiskfile(char *name, char **diskimgs)
+// read the statistics report as if it were a file
+static int statsRead(char *buf, size_t size, off_t offset)
 {
-    int fd = -1;
-    fd = open(name, O_RDWR);
-    if (fd == -1)
-    {
-        perror("Error opening disk image\n");
-        return 1;
-    }
+    char report[STATS_SIZE];
+    int len = statsFormat(report, sizeof(report));
+    if (offset >= len)
+        return 0;
+    size = MIN(size, (size_t)(len - offset));
+    memcpy(buf, report + offset, size);
+    return size;
+}
 
-    // read the superblock
-    if (read(fd, &sb, sizeof(struct wfs_sb)) != sizeof(struct wfs_sb))
-    {
-        perror("Failed to read superblock\n");
-        return 1;
-    }
-    close(fd);
+// what wfs keeps about an open file, in its fi->fh
+struct open_file
+{
+    pthread_mutex_t lock;
+    off_t next;   // where the last read stopped, a read starting there is sequential
+    int seq;      // sequential reads in a row
+    int ra_end;   // file blocks before it are read or queued for readahead
+    int mirror;   // raid 1 mirror a sequential stream reads from
+    int dirty;    // writes left blocks behind in the block cache since the last flush
+};
 
-    // store name in correct diskimg
-    diskimgs[sb.diskIndex] = name;
+// the statistics change between calls, so the kernel must not cache them
+static int wfs_open(int num, struct fuse_file_info *fi)
+{
+    if (num == STATS_NUM || direct_io)
+        fi->direct_io = 1;
+    if (num == STATS_NUM)
+        return 0;
+    struct open_file *of = calloc(1, sizeof(struct open_file));
+    if (of == NULL)
+        return -ENOMEM;
+    pthread_mutex_init(&of->lock, NULL);
+    of->mirror = sb.raid == 1 ? readMirror() : 0;
+    fi->fh = (uintptr_t)of;
     return 0;
 }
 
-void filter_argv(int *argc, char *argv[], int i)
+// a close writes back what its writes left in the block cache, merged into runs
+static int wfs_flush(int num, struct fuse_file_info *fi)
 {
-    // move argv pointer, from 1 to i
-    for (int j = 1; j + i < *argc; j++)
+    struct open_file *of = (struct open_file *)(uintptr_t)fi->fh;
+    if (of == NULL || !__atomic_exchange_n(&of->dirty, 0, __ATOMIC_RELAXED))
+        return 0;
+    TRACE(TRACE_OPS, "flush %d", num);
+    return cache_flush() == 0 ? 0 : -EIO;
+}
+
+static int wfs_release(int num, struct fuse_file_info *fi)
+{
+    int res = wfs_flush(num, fi);
+    struct open_file *of = (struct open_file *)(uintptr_t)fi->fh;
+    if (of != NULL)
     {
-        argv[j] = argv[j + i];
+        pthread_mutex_destroy(&of->lock);
+        free(of);
     }
-
-    // 更新 argc
-    *argc -= i;
+    return res;
 }
-// find the datablock (512b) corresponding to the db_index
-int getDataBlockByDbindex(void *buffer, int db_index)
+
+// note where a read of size bytes from offset stopped, if it went on from the last one
+// queue the blocks after it that are not read ahead yet, once half the window is used up
+// return the mirror a raid 1 read takes, a sequential stream stays on one
+static int readaheadNote(int num, struct open_file *of, off_t offset, size_t size, off_t file_size)
 {
-    // striping mode
-    if (sb.raid == 0)
+    pthread_mutex_lock(&of->lock);
+    if (offset != of->next)
     {
-        int fd = open(diskimgs[db_index % sb.diskNum], O_RDWR);
-        off_t db_start_ptr = sb.d_blocks_ptr + (db_index / sb.diskNum) * BLOCK_SIZE;
-        lseek(fd, db_start_ptr, SEEK_SET);
-        if (read(fd, buffer, BLOCK_SIZE) < BLOCK_SIZE)
-        {
-            perror("Error: read from datablock\n");
-            return -1;
-        }
-        close(fd);
+        of->seq = 0;
+        of->ra_end = 0;
     }
-    // mirroring mode
-    else if (sb.raid == 1)
+    else
+        of->seq++;
+    of->next = offset + size;
+    int mirror = of->seq > 0 || sb.raid != 1 ? of->mirror : readMirror();
+    if (of->seq > 0 && readahead_blocks > 0 && size > 0)
     {
-        int fd = open(diskimgs[0], O_RDWR);
-        off_t db_start_ptr = sb.d_blocks_ptr + db_index * BLOCK_SIZE;
-        // printf("mainmethodIndex: %jd\n", (intmax_t)db_start_ptr);
-        lseek(fd, db_start_ptr, SEEK_SET);
-        if (read(fd, buffer, BLOCK_SIZE) < BLOCK_SIZE)
+        int next = (offset + size - 1) / BLOCK_SIZE + 1;
+        int end = MIN(next + readahead_blocks, (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        int first = MAX(of->ra_end, next);
+        if (first <= next + readahead_blocks / 2 && first < end)
         {
-            perror("Error: read from datablock\n");
-            return -1;
+            readaheadQueue(num, first, end - first, mirror);
+            of->ra_end = end;
         }
-        close(fd);
     }
-    else if (sb.raid == 2)
+    pthread_mutex_unlock(&of->lock);
+    return mirror;
+}
+
+// lock file num for reading and clamp size to what it holds from offset
+// return 0, or a negative error with nothing locked
+static int lockForRead(int num, size_t *size, off_t offset)
+{
+    // readers of the same file share its lock
+    lockInode(num, LOCK_READ);
+    struct wfs_inode *inode = &inodes[num];
+    if (S_ISDIR(inode->mode))
     {
-        char temp_buffers[sb.diskNum][BLOCK_SIZE]; // 用于存储从每个磁盘读取的数据块
-        int votes[sb.diskNum];                     // 用于记录每个数据块的得票数
-        memset(votes, 0, sizeof(votes));           // 初始化得票数为0
+        unlockInode(num);
+        perror("Error: Try to read a dir");
+        return -EISDIR;
+    }
+    if (offset >= inode->size)
+        *size = 0;
+    else if (offset + *size > inode->size)
+        *size = inode->size - offset;
+    return 0;
+}
 
-        for (int i = 0; i < sb.diskNum; i++)
-        {
-            int fd = open(diskimgs[i], O_RDWR);
-            if (fd < 0)
-            {
-                perror("Error: open disk image\n");
-                return -1;
-            }
+// read size bytes of a file from offset, the caller checked they are in the file
+static int readFileData(struct wfs_inode *inode, char *buf, size_t size, off_t offset)
+{
+    if (size == 0)
+        return 0;
 
-            off_t db_start_ptr = sb.d_blocks_ptr + db_index * BLOCK_SIZE;
-            lseek(fd, db_start_ptr, SEEK_SET);
+    // inline files never touch a data block
+    if (inode->flags & WFS_INLINE_DATA)
+    {
+        memcpy(buf, inode->inline_data + offset, size);
+        return size;
+    }
 
-            if (read(fd, temp_buffers[i], BLOCK_SIZE) < BLOCK_SIZE)
-            {
-                perror("Error: read from datablock\n");
-                close(fd);
-                return -1;
-            }
-            close(fd);
-        }
+    // map every block of the read
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + size - 1) / BLOCK_SIZE;
+    struct block_map map;
+    if (mapInit(&map, inode) != 0)
+        return -ENOMEM;
 
-        for (int i = 0; i < sb.diskNum; i++)
+    // read the file, whole blocks that are contiguous on disk go in one run
+    size_t read = 0;
+    for (int b = first; b <= last;)
+    {
+        off_t db_idx = mapDataBlock(&map, b);
+        off_t block_start = (off_t)b * BLOCK_SIZE;
+        int db_offset = offset + read - block_start;
+        size_t read_bytes = MIN(BLOCK_SIZE - db_offset, size - read);
+
+        // a block read ahead is in the block cache, a run stops before one
+        if (db_offset == 0 && read_bytes == BLOCK_SIZE && db_idx >= 0 && cache_get(buf + read, db_idx))
         {
-            for (int j = 0; j < sb.diskNum; j++)
-            {
-                if (memcmp(temp_buffers[i], temp_buffers[j], BLOCK_SIZE) == 0)
-                {
-                    votes[i]++;
-                }
-            }
+            read += BLOCK_SIZE;
+            b++;
+            continue;
         }
-
-        int max_votes = -1;
-        int selected_index = 0;
-        for (int i = 0; i < sb.diskNum; i++)
+        if (db_offset == 0 && read_bytes == BLOCK_SIZE && db_idx >= 0)
         {
-            if (votes[i] > max_votes || (votes[i] == max_votes && i < selected_index))
-            {
-                max_votes = votes[i];
-                selected_index = i;
-            }
+            int run = 1;
+            while (b + run <= last && block_start + (off_t)(run + 1) * BLOCK_SIZE <= offset + size &&
+                   mapDataBlock(&map, b + run) == db_idx + run && !cache_get(NULL, db_idx + run))
+                run++;
+            readDataBlocks(buf + read, db_idx, run);
+            read += (size_t)run * BLOCK_SIZE;
+            b += run;
+            continue;
         }
 
-        memcpy(buffer, temp_buffers[selected_index], BLOCK_SIZE);
+        // a hole reads as zeros
+        char block[BLOCK_SIZE];
+        if (db_idx < 0)
+            memset(block, 0, BLOCK_SIZE);
+        else
+            getDataBlockByDbindex((void *)block, db_idx);
+        memcpy(buf + read, block + db_offset, read_bytes);
+        read += read_bytes;
+        b++;
     }
-
-    // verified mirroring
-    // TODO
-    // 问题：1v太tm麻烦了等会做
-    // else
-    // {
-    // }
-    return 0;
+    mapFree(&map);
+    return read;
 }
 
-// return the num corresponding to name in this inode with inode_index file
-// return -1 if file/dir with name do not exist
-int getInodeFromName(char *name, int inode_index)
+// the vector and the memory of its buffers go once the reply is sent
+static void freeBufvec(struct fuse_bufvec *bv)
 {
-    // find file/dir name
-    for (int i = 0; i < N_BLOCKS; i++)
+    for (size_t i = 0; i < bv->count; i++)
     {
-        int db_index = inodes[inode_index].blocks[i] - 1;
-        // printf("db_index: %d, inode_index: %d, i: %d\n", db_index, inode_index, i);
-        // if db_index =-1, then this block have been allocated to a datablock yet
-        if (db_index == -1)
-            break;
-        struct wfs_dentry db[DENTRY_NUM];
-        // printf("name: %s,db_index: %d\n", name, db_index);
-        getDataBlockByDbindex(db, db_index);
-        for (int j = 0; j < DENTRY_NUM; j++)
-        {
-            if (db[j].name[0] != '\0')
-                // printf("i:%d, j:%d name: %s\n", i, j, db[j].name);
-                if (strcmp(db[j].name, name) == 0)
-                {
-                    return db[j].num;
-                }
-        }
+        if (!(bv->buf[i].flags & FUSE_BUF_IS_FD))
+            free(bv->buf[i].mem);
     }
-    // if fail to find it after searching, then return -1;
-    return -1;
+    free(bv);
 }
 
-// parsePath, return the inode number of the corresponding file/dir
-// mode0: read the file/dir of the path
-// mode1: try to create the file of the path
-// mode2: read parent path
-int parsePath(const char *input, int mode, char *output)
+// a file range as ranges of the disk image files, holes as zeroed memory
+// raid 1 takes the whole range from mirror
+// return NULL if memory ran out
+static struct fuse_bufvec *fileExtents(struct wfs_inode *inode, size_t size, off_t offset, int mirror)
 {
-    int inode_index = 0;
-    char *path = strdup(input);
-    char *token = strtok((char *)path, "/");
-    // return 0 when root dir
-    if (token == NULL)
-        return inode_index;
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + size - 1) / BLOCK_SIZE;
+    struct block_map map;
+    struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec) + (size_t)(last - first) * sizeof(struct fuse_buf));
+    if (bv == NULL)
+        return NULL;
+    *bv = FUSE_BUFVEC_INIT(0);
+    bv->count = 0;
+    if (mapInit(&map, inode) != 0)
+    {
+        free(bv);
+        return NULL;
+    }
 
-    while (token != NULL)
+    // raid 0 and 5 take every block from its disk
+    size_t done = 0;
+    for (int b = first; b <= last; b++)
     {
-        char *name = token;
-        token = strtok(NULL, "/");
-        // if next token is NULL, then name should be the last one in the path
-        if (token == NULL)
+        off_t db_idx = mapDataBlock(&map, b);
+        int in_block = offset + done - (off_t)b * BLOCK_SIZE;
+        size_t n = MIN(BLOCK_SIZE - in_block, size - done);
+        struct fuse_buf *prev = bv->count > 0 ? &bv->buf[bv->count - 1] : NULL;
+        done += n;
+        if (db_idx < 0)
         {
-            // read mode = 0
-            if (mode == 0)
-            {
-                if (getInodeFromName(name, inode_index) < 0)
-                {
-                    return -1;
-                }
-                // return the inode of the file/dir of the path
-                return getInodeFromName(name, inode_index);
-            }
-            // create mode =1
-            else if (mode == 1)
-            {
-                int res = getInodeFromName(name, inode_index);
-                if (res >= 0)
-                {
-                    perror("Error: such name exist\n");
-                    return -2;
-                }
-                if (res == -2)
-                {
-                    perror("Shoudn't enter here\n");
-                    return -2;
-                }
-                strcpy(output, name);
-                // return the inode_index of the dir of file being created
-                return inode_index;
-            }
-            else if (mode == 2)
+            // a hole reads as zeros
+            if (prev != NULL && !(prev->flags & FUSE_BUF_IS_FD))
             {
-                strcpy(output, name);
-                return inode_index;
+                char *mem = realloc(prev->mem, prev->size + n);
+                if (mem == NULL)
+                    break;
+                memset(mem + prev->size, 0, n);
+                prev->mem = mem;
+                prev->size += n;
+                continue;
             }
+            struct fuse_buf *buf = &bv->buf[bv->count];
+            *buf = (struct fuse_buf){.size = n, .mem = calloc(1, n), .fd = -1};
+            if (buf->mem == NULL)
+                break;
+            bv->count++;
+            continue;
         }
-        // else name should be a dir
+
+        // the file has to hold what the block cache holds
+        if (cache_writeback(db_idx) != 0)
+            break;
+        int disk = sb.raid == 1 ? mirror : db_disk(db_idx);
+        int fd = diskfds[disk];
+        off_t pos = db_offset(db_idx) + in_block;
+        statsDisk(disk, 0, n);
+        if (prev != NULL && (prev->flags & FUSE_BUF_IS_FD) && prev->fd == fd && prev->pos + (off_t)prev->size == pos)
+            prev->size += n;
         else
+            bv->buf[bv->count++] = (struct fuse_buf){.size = n, .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK, .fd = fd, .pos = pos};
+    }
+    mapFree(&map);
+    if (fuse_buf_size(bv) != size)
+    {
+        freeBufvec(bv);
+        return NULL;
+    }
+    return bv;
+}
+
+// zero-copy read
+// raid 0, 1 and 5 hand FUSE the ranges of the disk image files holding the data, so with
+// splice the kernel moves them into the reply without a copy through wfs
+// the kernel reads them after the inode lock is gone, like a read racing a write
+// raid 1v has to check every block, a raid 5 set without a disk has to rebuild its blocks
+// and inline files are in memory anyway, those are read into one buffer
+static int wfs_read_buf(int inode_index, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    TRACE(TRACE_OPS, "read %d %zu@%jd", inode_index, size, (intmax_t)offset);
+    if (inode_index == STATS_NUM)
+    {
+        struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec));
+        char *report = malloc(size + 1);
+        if (bv == NULL || report == NULL)
         {
-            // find the inode_index corresponding to the name
-            inode_index = getInodeFromName(name, inode_index);
-            if (inode_index < 0)
-            {
-                perror("Error: 2. fail to find such dir/file\n");
-                return -1;
-            }
-            // if it is not a dir, error
-            if (!S_ISDIR(inodes[inode_index].mode))
+            free(bv);
+            free(report);
+            return -ENOMEM;
+        }
+        *bv = FUSE_BUFVEC_INIT(statsRead(report, size, offset));
+        bv->buf[0].mem = report;
+        *bufp = bv;
+        return 0;
+    }
+    int res = lockForRead(inode_index, &size, offset);
+    if (res < 0)
+        return res;
+    struct wfs_inode inode = inodes[inode_index];
+    struct open_file *of = (struct open_file *)(uintptr_t)fi->fh;
+    int mirror = of != NULL ? readaheadNote(inode_index, of, offset, size, inode.size) : sb.raid == 1 ? readMirror() : 0;
+
+    struct fuse_bufvec *bv;
+    if (sb.raid == 2 || missing_disk >= 0 || (inode.flags & WFS_INLINE_DATA) || size == 0)
+    {
+        bv = malloc(sizeof(struct fuse_bufvec));
+        if (bv != NULL)
+        {
+            *bv = FUSE_BUFVEC_INIT(size);
+            bv->buf[0].mem = malloc(size + 1);
+            res = bv->buf[0].mem == NULL ? -ENOMEM : readFileData(&inode, bv->buf[0].mem, size, offset);
+            if (res < 0)
             {
-                perror("Error: Not a directory\n");
-                return -1;
+                freeBufvec(bv);
+                bv = NULL;
             }
         }
     }
-    return -1;
+    else
+        bv = fileExtents(&inode, size, offset, mirror);
+    unlockInode(inode_index);
+    if (bv == NULL)
+        return res < 0 ? res : -ENOMEM;
+    *bufp = bv;
+    return 0;
 }
 
-// write entry to file
-// mode=0, file entry; mode = 1, dir entry
-// return -2 if the disk is not enough
-int writeToDir(int inode_index, char *name, int m, int mode)
+// take len bytes from a FUSE buffer into memory
+static int copyFromBufvec(void *dst, struct fuse_bufvec *src, size_t len)
 {
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(len);
+    mem.buf[0].mem = dst;
+    return fuse_buf_copy(&mem, src, 0) == (ssize_t)len ? 0 : -1;
+}
 
+// zero-copy write
+// data arriving in a pipe goes from it straight into the disk images, see writeDataBlocksBuf
+static int wfs_write_buf(int inode_index, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(buf);
+    TRACE(TRACE_OPS, "write %d %zu@%jd", inode_index, size, (intmax_t)offset);
+    if (inode_index == STATS_NUM)
+    {
+        statsReset();
+        return size;
+    }
+    // a writer owns the file until its blocks and size are updated
+    beginOp();
+    lockInode(inode_index, LOCK_WRITE);
+    // save a copy for inode
     struct wfs_inode inode = inodes[inode_index];
-    if (sb.raid == 0)
+    // Check if the inode is a directory
+    if (S_ISDIR(inode.mode))
     {
-        // get first dentry block with empty dentry
-        int data_block_idx;
-        off_t newDataPtr = dataToWrite_ptr(&inode, &data_block_idx);
-        struct wfs_dentry db[DENTRY_NUM];
-
-        getDataBlockByDbindex(db, data_block_idx);
-
-        // update parent inode
-        inode.size += sizeof(struct wfs_dentry);
-        if (m == 1)
-            inode.nlinks++;
-        inodes[inode_index] = inode;
-
-        // update parent data block
-        struct wfs_dentry new_dentry;
-        strncpy(new_dentry.name, name, MAX_NAME - 1);
-        new_dentry.name[MAX_NAME - 1] = '\0';
-        new_dentry.num = getIbit();
-        db[newDataPtr] = new_dentry;
-
-        // update new child Inode
-        if (createNewInode(name, m, mode) < 0)
-        {
-            return -2;
-        }
-
-        // write to the file
-        write_datablock_toIdx(data_block_idx, db);
-
+        unlockInode(inode_index);
+        endOp();
+        return -EISDIR; // Return error code for writing to a directory
+    }
+    // Check if the write exceeds the maximum file size, block numbers also have to fit an int
+    if (size + offset > MIN(MAX_FILE_BLOCKS, INT_MAX) * BLOCK_SIZE)
+    {
+        unlockInode(inode_index);
+        endOp();
+        return -ENOSPC;
+    }
+    if (size == 0)
+    {
+        unlockInode(inode_index);
+        endOp();
         return 0;
     }
-    // 问题 在写dir的时候要区别1/1v吗
-    else
+
+    if (inode.flags & WFS_INLINE_DATA)
     {
-        off_t newDataPtr = dataToWrite_ptr(&inode, NULL);
-        if (newDataPtr <= 0)
+        if (offset + size <= INLINE_DATA_SIZE)
+        {
+            // bytes past the old size are still zero, a gap reads as a hole
+            if (copyFromBufvec(inode.inline_data + offset, buf, size) != 0)
+            {
+                unlockInode(inode_index);
+                endOp();
+                return -EIO;
+            }
+            if (offset + size > inode.size)
+                inode.size = offset + size;
+            inode.mtim = time(NULL);
+            inodes[inode_index] = inode;
+            markInodeDirty(inode_index);
+            unlockInode(inode_index);
+            endOp();
+            metadataChanged();
+            return size;
+        }
+        // the file outgrows its inode, it stays promoted even if the rest of the write fails
+        if (promoteInline(&inode) != 0)
         {
-            perror("Error: Not enough data blocks\n");
-            return -2;
+            unlockInode(inode_index);
+            endOp();
+            return journalReclaim() ? wfs_write_buf(inode_index, buf, offset, fi) : -ENOSPC;
         }
-        // update the parent inode
-        inode.size += sizeof(struct wfs_dentry);
-        if (m == 1)
-            inode.nlinks++;
         inodes[inode_index] = inode;
+        markInodeDirty(inode_index);
+    }
 
-        // update the parent data block
-        struct wfs_dentry new_dentry;
-        strncpy(new_dentry.name, name, MAX_NAME - 1);
-        new_dentry.name[MAX_NAME - 1] = '\0';
-        new_dentry.num = getIbit();
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + size - 1) / BLOCK_SIZE;
 
-        // update new child Inode
-        if (createNewInode(name, m, mode) < 0)
+    // reserve every missing block of the write, tables included, as contiguous runs
+    struct block_map map;
+    if (mapInit(&map, &inode) != 0)
+    {
+        unlockInode(inode_index);
+        endOp();
+        return -ENOMEM;
+    }
+    // a file growing a few blocks at a time stays contiguous when its new blocks follow
+    // the one before them, so they are looked for there first
+    int need_data = 0;
+    int need_tables = 0;
+    int goal = -1;
+    for (int b = first; b <= last; b++)
+    {
+        int missing = mapMissing(&map, b, first, &need_tables);
+        if (missing && need_data == 0 && b > 0)
         {
-            return -2;
+            off_t prev = mapDataBlock(&map, b - 1);
+            goal = prev < 0 ? -1 : prev + 1;
         }
-        // 写入每个文件
-        for (int i = 0; i < sb.diskNum; i++)
+        need_data += missing;
+    }
+    int need = need_data + need_tables;
+    int new_blocks[need + 1];
+    if (need > 0 && allocDbitRun(need, new_blocks, goal) != 0)
+    {
+        mapFree(&map);
+        unlockInode(inode_index);
+        endOp();
+        // blocks freed by earlier operations may only be waiting for a commit
+        return journalReclaim() ? wfs_write_buf(inode_index, buf, offset, fi) : -ENOSPC;
+    }
+    // the tables go after the data so the data run stays contiguous
+    map.pool = new_blocks;
+    map.pool_next = need_data;
+    int next_new = 0;
+    int fresh[last - first + 1];
+    for (int b = first; b <= last; b++)
+    {
+        off_t *slot = mapBlock(&map, b);
+        fresh[b - first] = *slot == 0;
+        if (*slot == 0)
         {
-            int fd = open(diskimgs[i], O_RDWR);
-            if (fd == -1)
-            {
-                perror("Error opening disk image\n");
-                return -1;
-            }
-
-            // Check if newDataPtr is a multiple of 512
-            if (newDataPtr % 512 == 0)
-            {
-                // Clear the 512 bytes starting from newDataPtr
-                char clear_buffer[512] = {0};
-                if (pwrite(fd, clear_buffer, sizeof(clear_buffer), newDataPtr) != sizeof(clear_buffer))
-                {
-                    perror("Error clearing block before writing dentry\n");
-                    close(fd);
-                    return -1;
-                }
-            }
-            // write the new dentry
-            if (pwrite(fd, &new_dentry, sizeof(struct wfs_dentry), newDataPtr) != sizeof(struct wfs_dentry))
-            {
-                perror("Error writing dentry\n");
-                close(fd);
-                return -1;
-            }
-
-            close(fd);
-            fd = -1;
+            *slot = new_blocks[next_new++] + 1;
+            mapDirty(&map);
         }
-        // return 0 on success
-        return 0;
     }
-}
-// get ptr to write from inode
-// return -1 if there is not enough space
-off_t dataToWrite_ptr(struct wfs_inode *inode, int *datablock_block_idx)
-{
-    // check if enough data block
-    size_t dbit = getDbit();
-    off_t write_ptr;
 
-    // find the first empty dentry
-    for (int i = 0; i < N_BLOCKS; i++)
+    // write the file, whole blocks that are contiguous on disk go in one run
+    // a small write leaves its whole blocks behind in the block cache like partial ones,
+    // they go to the disks merged with their neighbours later
+    int behind = write_behind_blocks > 0 && cache_blocks > 0 && size < (size_t)write_behind_blocks * BLOCK_SIZE &&
+                 size < WRITE_BEHIND_MAX;
+    int cached = 0;
+    size_t written = 0;
+    // a failed block ends the write, the file keeps what went through before it
+    int failed = 0;
+    for (int b = first; b <= last;)
     {
-        off_t dentry_block_idx = inode->blocks[i] - 1;
-        printf("inodeNum:%d, block_idx: %d, db_block_idx: %zu\n", inode->num, i, dentry_block_idx);
-        // create a new dentry block
-        if (inode->blocks[i] == 0)
+        off_t db_idx = mapDataBlock(&map, b);
+        off_t block_start = (off_t)b * BLOCK_SIZE;
+        int db_offset = offset + written - block_start;
+        size_t copy_bytes = MIN(BLOCK_SIZE - db_offset, size - written);
+
+        if (db_offset == 0 && copy_bytes == BLOCK_SIZE && !behind)
         {
-            inode->blocks[i] = dbit + 1;
-            write_ptr = sb.d_blocks_ptr + dbit * BLOCK_SIZE;
-            set_dbit(dbit);
-            // printf("new block, write_ptr: %zu\n", write_ptr);
-            printf("inodeNum:%d, block_idx: %d, db_block_idx+1: %zu\n", inode->num, i, inode->blocks[i]);
-            if (sb.raid == 0)
-            {
-                *datablock_block_idx = dbit;
-                return 0;
-            }
-            else
+            int run = 1;
+            while (b + run <= last && block_start + (off_t)(run + 1) * BLOCK_SIZE <= offset + size &&
+                   mapDataBlock(&map, b + run) == db_idx + run)
+                run++;
+            if (writeDataBlocksBuf(db_idx, run, buf) != 0)
             {
-                return write_ptr;
+                failed = 1;
+                break;
             }
+            written += (size_t)run * BLOCK_SIZE;
+            b += run;
+            continue;
+        }
+
+        // partial block, a fresh one starts zeroed
+        char block[BLOCK_SIZE];
+        if (fresh[b - first])
+            memset(block, 0, BLOCK_SIZE);
+        else if (copy_bytes < BLOCK_SIZE && getDataBlockByDbindex((void *)block, db_idx) != 0)
+        {
+            failed = 1;
+            break;
+        }
+        if (copyFromBufvec(block + db_offset, buf, copy_bytes) != 0 || write_datablock_toIdx(db_idx, block) != 0)
+        {
+            failed = 1;
+            break;
+        }
+        cached = 1;
+        written += copy_bytes;
+        b++;
+    }
+    mapFlush(&map);
+    mapFree(&map);
+    struct open_file *of = (struct open_file *)(uintptr_t)fi->fh;
+    if (of != NULL && cached)
+        __atomic_store_n(&of->dirty, 1, __ATOMIC_RELAXED);
+
+    // Update inode size if needed
+    if (offset + written > inode.size)
+    {
+        inode.size = offset + written;
+    }
+    inode.mtim = time(NULL);
+    inodes[inode_index] = inode;
+    markInodeDirty(inode_index);
+    unlockInode(inode_index);
+    endOp();
+    metadataChanged();
+    return failed && written == 0 ? -EIO : (int)written;
+}
+// a directory's entries taken at opendir, readdir hands them out from the offset asked for
+struct dir_listing
+{
+    char *buf;
+    size_t len;
+    size_t size;
+};
+
+static int listAdd(fuse_req_t req, struct dir_listing *list, const char *name, int num, mode_t mode)
+{
+    size_t entsize = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+    if (list->len + entsize > list->size)
+    {
+        size_t size = MAX(list->size * 2, list->len + entsize);
+        char *buf = realloc(list->buf, size);
+        if (buf == NULL)
+            return -1;
+        list->buf = buf;
+        list->size = size;
+    }
+    struct stat stbuf = {.st_ino = FUSE_INO(num), .st_mode = mode};
+    // an entry records the offset of the one after it
+    fuse_add_direntry(req, list->buf + list->len, list->size - list->len, name, &stbuf, list->len + entsize);
+    list->len += entsize;
+    return 0;
+}
+
+static void listFree(struct dir_listing *list)
+{
+    free(list->buf);
+    free(list);
+}
+
+static int wfs_opendir(fuse_req_t req, int num, struct dir_listing **listp)
+{
+    TRACE(TRACE_OPS, "readdir %d", num);
+    int res = lockDir(num, LOCK_READ);
+    if (res < 0)
+        return res;
+    struct wfs_inode *dir = &inodes[num];
+    struct dir_listing *list = calloc(1, sizeof(struct dir_listing));
+    struct block_map map;
+    if (list == NULL || mapInit(&map, dir) != 0)
+    {
+        free(list);
+        unlockInode(num);
+        return -ENOMEM;
+    }
+
+    // the kernel looked the directory up before opening it, so its parent is known
+    int parent = num == 0 ? 0 : __atomic_load_n(&parents[num], __ATOMIC_RELAXED);
+    res = listAdd(req, list, ".", num, S_IFDIR) | listAdd(req, list, "..", parent, S_IFDIR);
+    // bucket headers of a hashed directory have no name and are skipped like empty dentries
+    for (int i = 0; res == 0; i++)
+    {
+        int db_index = dirBlock(dir, &map, i);
+        if (db_index == -1)
+            break;
+
+        struct wfs_dentry entries[DENTRY_NUM];
+        getDataBlockByDbindex(entries, db_index);
+        for (int j = 0; j < DENTRY_NUM && res == 0; j++)
+        {
+            if (entries[j].name[0] == '\0')
+                continue;
+            // the entry's type comes from its inode
+            lockInode(entries[j].num, LOCK_READ);
+            mode_t mode = inodes[entries[j].num].mode;
+            unlockInode(entries[j].num);
+            res = listAdd(req, list, entries[j].name, entries[j].num, mode);
+        }
+    }
+
+    mapFree(&map);
+    unlockInode(num);
+    if (res != 0)
+    {
+        listFree(list);
+        return -ENOMEM;
+    }
+    *listp = list;
+    return 0;
+}
+
+static int wfs_fsync(int inode_index, int datasync, struct fuse_file_info *fi)
+{
+    TRACE(TRACE_OPS, "fsync %d", inode_index);
+    if (cache_flush() != 0 || updateMetadata() != 0 || syncDisks() != 0)
+        return -EIO;
+    return 0;
+}
+
+// FUSE has forked into the background by now, so threads are started here
+static void wfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+    if (disk_io == DISK_IO_URING && uringInit() != 0)
+    {
+        fprintf(stderr, "wfs: io_uring is not available, using pread\n");
+        disk_io = DISK_IO_PREAD;
+    }
+    // io_uring runs the disks in parallel without them
+    if (parallel_io && disk_io != DISK_IO_URING && startDiskWorkers() != 0)
+        perror("Error: starting disk workers, disk I/O stays serial\n");
+    if (startRebuild() != 0)
+        perror("Error: starting the rebuild\n");
+    if (startReadahead() != 0)
+        perror("Error: starting readahead, files are read as asked\n");
+    if (startFlusher() != 0)
+        fprintf(stderr, "wfs: no metadata flusher, an idle mount only flushes at fsync or unmount\n");
+}
+
+static void wfs_destroy(void *userdata)
+{
+    stopFlusher();
+    stopReadahead();
+    stopRebuild();
+    // FUSE forgets every inode at unmount
+    reclaimOrphans();
+    if (cache_flush() != 0)
+        fprintf(stderr, "wfs: cached blocks could not be written back at unmount\n");
+    updateMetadata();
+    stopDiskWorkers();
+    // everything is in place, a clean unmount leaves nothing to replay
+    if (sb.j_blocks > 0)
+        journalClear();
+    syncDisks();
+    uringStop();
+    closeDisks();
+}
+
+// every operation FUSE calls is timed for the statistics, then answered
+static void replyEntry(fuse_req_t req, int res, struct fuse_entry_param *e)
+{
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_entry(req, e);
+}
+static void replyAttr(fuse_req_t req, int res, struct stat *stbuf)
+{
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_attr(req, stbuf, WFS_NUM(stbuf->st_ino) == STATS_NUM ? 0 : attr_timeout);
+}
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    uint64_t start = statsClock();
+    struct fuse_entry_param e;
+    int res = wfs_lookup(WFS_NUM(parent), name, &e);
+    statsOp(STAT_LOOKUP, start);
+    replyEntry(req, res, &e);
+}
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    wfs_forget(WFS_NUM(ino), nlookup);
+    fuse_reply_none(req);
+}
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+    for (size_t i = 0; i < count; i++)
+        wfs_forget(WFS_NUM(forgets[i].ino), forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    uint64_t start = statsClock();
+    struct stat stbuf;
+    int res = wfs_getattr(WFS_NUM(ino), &stbuf);
+    statsOp(STAT_GETATTR, start);
+    replyAttr(req, res, &stbuf);
+}
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+    struct stat stbuf;
+    int res = wfs_setattr(WFS_NUM(ino), attr, to_set, &stbuf);
+    replyAttr(req, res, &stbuf);
+}
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    uint64_t start = statsClock();
+    struct fuse_entry_param e;
+    int res = wfs_create(WFS_NUM(parent), name, 0, mode, &e);
+    statsOp(STAT_MKNOD, start);
+    replyEntry(req, res, &e);
+}
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    uint64_t start = statsClock();
+    struct fuse_entry_param e;
+    int res = wfs_create(WFS_NUM(parent), name, 1, mode, &e);
+    statsOp(STAT_MKDIR, start);
+    replyEntry(req, res, &e);
+}
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    uint64_t start = statsClock();
+    int res = wfs_remove(WFS_NUM(parent), name, 0);
+    statsOp(STAT_UNLINK, start);
+    fuse_reply_err(req, -res);
+}
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    uint64_t start = statsClock();
+    int res = wfs_remove(WFS_NUM(parent), name, 1);
+    statsOp(STAT_RMDIR, start);
+    fuse_reply_err(req, -res);
+}
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int res = wfs_open(WFS_NUM(ino), fi);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else if (fuse_reply_open(req, fi) != 0)
+        wfs_release(WFS_NUM(ino), fi);
+}
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, -wfs_flush(WFS_NUM(ino), fi));
+}
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, -wfs_release(WFS_NUM(ino), fi));
+}
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    uint64_t start = statsClock();
+    struct fuse_bufvec *bv;
+    int res = wfs_read_buf(WFS_NUM(ino), &bv, size, off, fi);
+    statsOp(STAT_READ, start);
+    if (res < 0)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_data(req, bv, FUSE_BUF_SPLICE_MOVE);
+    freeBufvec(bv);
+}
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *fi)
+{
+    uint64_t start = statsClock();
+    int res = wfs_write_buf(WFS_NUM(ino), buf, off, fi);
+    statsOp(STAT_WRITE, start);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
+}
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+    src.buf[0].mem = (void *)buf;
+    ll_write_buf(req, ino, &src, off, fi);
+}
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    uint64_t start = statsClock();
+    struct dir_listing *list;
+    int res = wfs_opendir(req, WFS_NUM(ino), &list);
+    statsOp(STAT_READDIR, start);
+    if (res < 0)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fi->fh = (uintptr_t)list;
+    if (fuse_reply_open(req, fi) != 0)
+        listFree(list);
+}
+// the kernel drops an entry cut off at the end of the reply and asks for it again
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct dir_listing *list = (struct dir_listing *)(uintptr_t)fi->fh;
+    if ((size_t)off >= list->len)
+        fuse_reply_buf(req, NULL, 0);
+    else
+        fuse_reply_buf(req, list->buf + off, MIN(size, list->len - off));
+}
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    listFree((struct dir_listing *)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    uint64_t start = statsClock();
+    int res = wfs_fsync(WFS_NUM(ino), datasync, fi);
+    statsOp(STAT_FSYNC, start);
+    fuse_reply_err(req, -res);
+}
+
+static struct fuse_lowlevel_ops ops = {
+    .init = wfs_init,
+    .destroy = wfs_destroy,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .forget_multi = ll_forget_multi,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .mknod = ll_mknod,
+    .mkdir = ll_mkdir,
+    .unlink = ll_unlink,
+    .rmdir = ll_rmdir,
+    .open = ll_open,
+    .flush = ll_flush,
+    .release = ll_release,
+    .read = ll_read,
+    .write = ll_write,
+    .write_buf = ll_write_buf,
+    .opendir = ll_opendir,
+    .readdir = ll_readdir,
+    .releasedir = ll_releasedir,
+    .fsync = ll_fsync,
+};
+
+// helper method
+// load the superblock, bitmaps and inodes from the mapped disk images
+int initialMetadata()
+{
+    // read the superblock
+    if (disk_read(0, &sb, sizeof(struct wfs_sb), 0) != 0)
+    {
+        perror("Failed to read superblock\n");
+        return -1;
+    }
+    if (sb.version != WFS_VERSION)
+    {
+        fprintf(stderr, "Error: disk format version %d, wfs only mounts version %d\n", sb.version, WFS_VERSION);
+        return -1;
+    }
+    if (sb.block_size < MIN_BLOCK_SIZE || sb.block_size > MAX_BLOCK_SIZE || (sb.block_size & (sb.block_size - 1)) != 0)
+    {
+        fprintf(stderr, "Error: bad block size %d\n", sb.block_size);
+        return -1;
+    }
+
+    // finish the last committed transaction before reading any metadata
+    crc32cInit();
+    if (sb.raid == 5)
+        stripeInit();
+    if (journalRecover() != 0)
+    {
+        perror("Failed to replay the journal\n");
+        return -1;
+    }
+
+    // allocate and read the ibitmap
+    size_t ibitmap_size = sb.num_inodes / 8;
+    // bitmaps are padded to whole 64-bit words for the allocator scan
+    ibitmap = (uint8_t *)calloc((ibitmap_size + 7) / 8, 8);
+    if (ibitmap == NULL)
+    {
+        perror("Failed to allocate memory for ibitmap\n");
+        return -1;
+    }
+    if (disk_read(0, ibitmap, ibitmap_size, sb.i_bitmap_ptr) != 0)
+    {
+        perror("Failed to read ibitmap\n");
+        free(ibitmap);
+        return -1;
+    }
+
+    // allocate and read the dbitmap
+    size_t dbitmap_size = sb.num_data_blocks / 8;
+    // raid == 0 keeps room for every disk
+    if (sb.raid == 0)
+        dbitmap_size *= sb.diskNum;
+    dbitmap = (uint8_t *)calloc((dbitmap_size + 7) / 8, 8);
+    if (dbitmap == NULL)
+    {
+        perror("Failed to allocate memory for dbitmap\n");
+        free(ibitmap);
+        return -1;
+    }
+    // every disk keeps the bits of the blocks it stores under raid 0, mirrors keep all of them
+    for (int i = 0; i < (sb.raid == 0 ? sb.diskNum : 1); i++)
+    {
+        uint8_t disk_dbitmap[sb.num_data_blocks / 8];
+        if (disk_read(i, disk_dbitmap, sizeof(disk_dbitmap), sb.d_bitmap_ptr) != 0)
+        {
+            perror("Failed to read dbitmap\n");
+            free(ibitmap);
+            free(dbitmap);
+            return -1;
+        }
+        for (size_t j = 0; j < sizeof(disk_dbitmap); j++)
+            dbitmap[j] |= disk_dbitmap[j];
+    }
+
+    // allocate and read the inodes
+    inodes = (struct wfs_inode *)malloc(sb.num_inodes * sizeof(struct wfs_inode));
+    if (inodes == NULL)
+    {
+        perror("Failed to allocate memory for inodes\n");
+        free(ibitmap);
+        free(dbitmap);
+        return -1;
+    }
+    for (int i = 0; i < sb.num_inodes; i++)
+    {
+        if (disk_read(0, &inodes[i], sizeof(struct wfs_inode), sb.i_blocks_ptr + i * INODE_SIZE) != 0)
+        {
+            perror("Failed to read inodes\n");
+            free(ibitmap);
+            free(dbitmap);
+            free(inodes);
+            return -1;
+        }
+    }
+
+    inode_locks = malloc(sb.num_inodes * sizeof(pthread_rwlock_t));
+    if (inode_locks == NULL)
+    {
+        perror("Failed to allocate memory for inode locks\n");
+        return -1;
+    }
+    for (int i = 0; i < sb.num_inodes; i++)
+        pthread_rwlock_init(&inode_locks[i], NULL);
+
+    lookups = calloc(sb.num_inodes, sizeof(uint64_t));
+    parents = calloc(sb.num_inodes, sizeof(int));
+    if (lookups == NULL || parents == NULL)
+    {
+        perror("Failed to allocate memory for lookup counts\n");
+        return -1;
+    }
+    // the kernel holds the root from the mount on
+    lookups[0] = 1;
+
+    // nothing is dirty right after loading
+    inode_dirty = calloc(sb.num_inodes, 1);
+    ibitmap_dirty = calloc((ibitmap_size + BLOCK_SIZE - 1) / BLOCK_SIZE, 1);
+    dbitmap_dirty = calloc((dbitmap_size + BLOCK_SIZE - 1) / BLOCK_SIZE, 1);
+    if (inode_dirty == NULL || ibitmap_dirty == NULL || dbitmap_dirty == NULL)
+    {
+        perror("Failed to allocate memory for dirty flags\n");
+        return -1;
+    }
+    last_flush = time(NULL);
+
+    ibit_free = bitmap_count_free(ibitmap, sb.num_inodes);
+    dbit_free = bitmap_count_free(dbitmap, sb.num_data_blocks);
+
+    if (sb.raid == 2 && loadChecksums() != 0)
+        return -1;
+    if (sb.j_blocks > 0 && journalInit() != 0)
+        return -1;
+
+    // return 0 on success
+    return 0;
+}
+
+int checkValidDiskfile(char *name, char **diskimgs)
+{
+    int fd = -1;
+    fd = open(name, O_RDWR);
+    if (fd == -1)
+    {
+        perror("Error opening disk image\n");
+        return 1;
+    }
+
+    // read the superblock
+    if (read(fd, &sb, sizeof(struct wfs_sb)) != sizeof(struct wfs_sb))
+    {
+        perror("Failed to read superblock\n");
+        return 1;
+    }
+    close(fd);
+
+    // store name in correct diskimg
+    diskimgs[sb.diskIndex] = name;
+    return 0;
+}
+
+// take the wfs options (--name=value) out of argv, the rest goes to FUSE
+int parse_wfs_options(int *argc, char *argv[])
+{
+    int kept = 1;
+    for (int i = 1; i < *argc; i++)
+    {
+        if (strncmp(argv[i], "--cache-blocks=", 15) == 0)
+        {
+            cache_blocks = strtoul(argv[i] + 15, NULL, 10);
+            continue;
+        }
+        if (strncmp(argv[i], "--parallel-io=", 14) == 0)
+        {
+            parallel_io = atoi(argv[i] + 14) != 0;
+            continue;
+        }
+        if (strncmp(argv[i], "--trace=", 8) == 0)
+        {
+            if (traceParse(argv[i] + 8) != 0)
+                return -1;
+            continue;
+        }
+        if (strncmp(argv[i], "--inline=", 9) == 0)
+        {
+            inline_files = atoi(argv[i] + 9) != 0;
+            continue;
+        }
+        if (strncmp(argv[i], "--dirs=", 7) == 0)
+        {
+            if (strcmp(argv[i] + 7, "linear") == 0)
+                dir_format = DIR_LINEAR;
+            else if (strcmp(argv[i] + 7, "hashed") == 0)
+                dir_format = DIR_HASHED;
+            else
+            {
+                fprintf(stderr, "Error: unknown directory format %s\n", argv[i] + 7);
+                return -1;
+            }
+            continue;
+        }
+        if (strncmp(argv[i], "--rebuild=", 10) == 0)
+        {
+            rebuild_image = argv[i] + 10;
+            continue;
+        }
+        if (strncmp(argv[i], "--rebuild-rate=", 15) == 0)
+        {
+            rebuild_rate = atoi(argv[i] + 15);
+            continue;
+        }
+        if (strncmp(argv[i], "--entry-timeout=", 16) == 0)
+        {
+            entry_timeout = strtod(argv[i] + 16, NULL);
+            continue;
+        }
+        if (strncmp(argv[i], "--attr-timeout=", 15) == 0)
+        {
+            attr_timeout = strtod(argv[i] + 15, NULL);
+            continue;
+        }
+        if (strncmp(argv[i], "--direct-io=", 12) == 0)
+        {
+            direct_io = atoi(argv[i] + 12) != 0;
+            continue;
+        }
+        if (strncmp(argv[i], "--readahead=", 12) == 0)
+        {
+            readahead_blocks = atoi(argv[i] + 12);
+            continue;
+        }
+        if (strncmp(argv[i], "--write-behind=", 15) == 0)
+        {
+            write_behind_blocks = atoi(argv[i] + 15);
+            continue;
+        }
+        if (strncmp(argv[i], "--io=", 5) == 0)
+        {
+            if (strcmp(argv[i] + 5, "mmap") == 0)
+                disk_io = DISK_IO_MMAP;
+            else if (strcmp(argv[i] + 5, "pread") == 0)
+                disk_io = DISK_IO_PREAD;
+            else if (strcmp(argv[i] + 5, "uring") == 0)
+                disk_io = DISK_IO_URING;
+            else
+            {
+                fprintf(stderr, "Error: unknown io backend %s\n", argv[i] + 5);
+                return -1;
+            }
+            continue;
+        }
+        argv[kept++] = argv[i];
+    }
+    *argc = kept;
+    argv[kept] = NULL;
+    return 0;
+}
+
+void filter_argv(int *argc, char *argv[], int i)
+{
+    // move argv pointer, from 1 to i
+    for (int j = 1; j + i < *argc; j++)
+    {
+        argv[j] = argv[j + i];
+    }
+
+    *argc -= i;
+}
+// tracing
+// traceEvent formats into the next slot of a ring shared by all threads, claimed with one
+// atomic add and published by storing its sequence number, so writers never block
+// the SIGUSR1 handler copies out the slots written since the last dump with write(2) only,
+// a slot being written or overwritten while it is copied is skipped
+struct trace_slot
+{
+    uint64_t seq; // 1 + the event number held, 0 while the slot is written
+    int len;
+    char msg[TRACE_MSG];
+};
+unsigned trace_mask = 0;
+static struct trace_slot trace_ring[TRACE_ENTRIES];
+static uint64_t trace_head;
+static uint64_t trace_dumped;
+static const char *trace_names[] = {"ops", "io", "alloc", "cache", "journal"};
+
+void traceEvent(const char *fmt, ...)
+{
+    uint64_t n = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    struct trace_slot *slot = &trace_ring[n % TRACE_ENTRIES];
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int len = snprintf(slot->msg, TRACE_MSG, "%ld.%06ld %ld ", (long)ts.tv_sec, ts.tv_nsec / 1000, (long)syscall(SYS_gettid));
+    va_list ap;
+    va_start(ap, fmt);
+    len += vsnprintf(slot->msg + len, TRACE_MSG - len, fmt, ap);
+    va_end(ap);
+    // a long event is cut short, every one ends its line
+    if (len > TRACE_MSG - 1)
+        len = TRACE_MSG - 1;
+    slot->msg[len++] = '\n';
+    slot->len = len;
+    __atomic_store_n(&slot->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+static void traceDump(int sig)
+{
+    int saved_errno = errno;
+    uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint64_t n = trace_dumped;
+    if (head - n > TRACE_ENTRIES)
+        n = head - TRACE_ENTRIES;
+    for (; n < head; n++)
+    {
+        struct trace_slot *slot = &trace_ring[n % TRACE_ENTRIES];
+        char msg[TRACE_MSG];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != n + 1)
+            continue;
+        int len = slot->len;
+        memcpy(msg, slot->msg, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != n + 1)
+            continue;
+        if (write(STDERR_FILENO, msg, len) != len)
+            break;
+    }
+    trace_dumped = head;
+    errno = saved_errno;
+}
+
+// turn on a comma separated list of categories
+int traceParse(const char *list)
+{
+    char names[256];
+    snprintf(names, sizeof(names), "%s", list);
+    for (char *save, *name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+    {
+        if (strcmp(name, "all") == 0)
+        {
+            trace_mask = ~0u;
+            continue;
+        }
+        size_t c = 0;
+        while (c < sizeof(trace_names) / sizeof(trace_names[0]) && strcmp(name, trace_names[c]) != 0)
+            c++;
+        if (c == sizeof(trace_names) / sizeof(trace_names[0]))
+        {
+            fprintf(stderr, "Error: unknown trace category %s\n", name);
+            return -1;
+        }
+        trace_mask |= 1u << c;
+    }
+    return 0;
+}
+
+// dump the ring on SIGUSR1, only when something is traced
+void traceStart()
+{
+    if (trace_mask == 0)
+        return;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = traceDump;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+// statistics
+// counters are bumped with relaxed atomics from every thread and read without a snapshot,
+// so a report taken under load may be a few events apart between its lines
+struct op_stats
+{
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[STAT_BUCKETS];
+};
+struct disk_stats
+{
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t writes;
+    uint64_t write_bytes;
+};
+static struct op_stats op_stats[STAT_OPS];
+static struct disk_stats disk_stats[MAX_DISKS];
+static uint64_t scan_calls, scan_words, scan_max;
+static const char *op_names[STAT_OPS] = {"lookup", "getattr", "mknod", "mkdir", "unlink", "rmdir", "read", "write", "readdir", "fsync"};
+
+uint64_t statsClock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void statsMax(uint64_t *max, uint64_t value)
+{
+    uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > old && !__atomic_compare_exchange_n(max, &old, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// count a call to op that started at start
+void statsOp(int op, uint64_t start)
+{
+    uint64_t ns = statsClock() - start;
+    struct op_stats *st = &op_stats[op];
+    __atomic_fetch_add(&st->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->total_ns, ns, __ATOMIC_RELAXED);
+    statsMax(&st->max_ns, ns);
+    int b = 0;
+    while (b < STAT_BUCKETS - 1 && ns / 1000 >= (1ULL << b))
+        b++;
+    __atomic_fetch_add(&st->hist[b], 1, __ATOMIC_RELAXED);
+}
+
+uint64_t statsCalls()
+{
+    uint64_t calls = 0;
+    for (int op = 0; op < STAT_OPS; op++)
+        calls += __atomic_load_n(&op_stats[op].calls, __ATOMIC_RELAXED);
+    return calls;
+}
+
+void statsDisk(int disk, int write, size_t len)
+{
+    struct disk_stats *st = &disk_stats[disk];
+    __atomic_fetch_add(write ? &st->writes : &st->reads, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(write ? &st->write_bytes : &st->read_bytes, len, __ATOMIC_RELAXED);
+}
+
+// count one allocator search that looked at words bitmap words
+void statsScan(size_t words)
+{
+    __atomic_fetch_add(&scan_calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&scan_words, words, __ATOMIC_RELAXED);
+    statsMax(&scan_max, words);
+}
+
+void statsReset()
+{
+    // a reset racing an update may keep that one event, which is fine for a profile
+    for (int op = 0; op < STAT_OPS; op++)
+    {
+        __atomic_store_n(&op_stats[op].calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&op_stats[op].total_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&op_stats[op].max_ns, 0, __ATOMIC_RELAXED);
+        for (int b = 0; b < STAT_BUCKETS; b++)
+            __atomic_store_n(&op_stats[op].hist[b], 0, __ATOMIC_RELAXED);
+    }
+    for (int d = 0; d < MAX_DISKS; d++)
+    {
+        __atomic_store_n(&disk_stats[d].reads, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&disk_stats[d].read_bytes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&disk_stats[d].writes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&disk_stats[d].write_bytes, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&scan_calls, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&scan_words, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&scan_max, 0, __ATOMIC_RELAXED);
+    cache_stats_reset();
+    readahead_stats_reset();
+}
+
+// the report, one line per operation, per disk, for the cache and for the allocator
+// histogram entries read <N:calls for calls that took under N microseconds
+int statsFormat(char *buf, size_t size)
+{
+    size_t len = 0;
+#define STATS_PRINT(...) len += snprintf(buf + len, len < size ? size - len : 0, __VA_ARGS__)
+    for (int op = 0; op < STAT_OPS; op++)
+    {
+        struct op_stats *st = &op_stats[op];
+        uint64_t calls = __atomic_load_n(&st->calls, __ATOMIC_RELAXED);
+        uint64_t total = __atomic_load_n(&st->total_ns, __ATOMIC_RELAXED);
+        STATS_PRINT("%s: %ju calls, avg %ju us, max %ju us,", op_names[op], (uintmax_t)calls,
+                    (uintmax_t)(calls ? total / calls / 1000 : 0),
+                    (uintmax_t)(__atomic_load_n(&st->max_ns, __ATOMIC_RELAXED) / 1000));
+        for (int b = 0; b < STAT_BUCKETS; b++)
+        {
+            uint64_t n = __atomic_load_n(&st->hist[b], __ATOMIC_RELAXED);
+            if (n != 0)
+                STATS_PRINT(" <%ju:%ju", (uintmax_t)1 << b, (uintmax_t)n);
+        }
+        STATS_PRINT("\n");
+    }
+    for (int d = 0; d < sb.diskNum; d++)
+    {
+        struct disk_stats *st = &disk_stats[d];
+        STATS_PRINT("disk %d: %ju reads, %ju bytes read, %ju writes, %ju bytes written\n", d + 1,
+                    (uintmax_t)__atomic_load_n(&st->reads, __ATOMIC_RELAXED),
+                    (uintmax_t)__atomic_load_n(&st->read_bytes, __ATOMIC_RELAXED),
+                    (uintmax_t)__atomic_load_n(&st->writes, __ATOMIC_RELAXED),
+                    (uintmax_t)__atomic_load_n(&st->write_bytes, __ATOMIC_RELAXED));
+    }
+    len += cache_stats_format(buf + len, len < size ? size - len : 0);
+    len += rebuild_stats_format(buf + len, len < size ? size - len : 0);
+    len += readahead_stats_format(buf + len, len < size ? size - len : 0);
+    STATS_PRINT("allocator: %ju scans, %ju bitmap words, at most %ju in one scan\n",
+                (uintmax_t)__atomic_load_n(&scan_calls, __ATOMIC_RELAXED),
+                (uintmax_t)__atomic_load_n(&scan_words, __ATOMIC_RELAXED),
+                (uintmax_t)__atomic_load_n(&scan_max, __ATOMIC_RELAXED));
+#undef STATS_PRINT
+    return len < size ? len : size - 1;
+}
+
+// block device layer
+// every disk image is opened and mapped once at mount, all block I/O goes through these
+// both backends are positional, so threads can transfer disjoint ranges at once
+int openDisks()
+{
+    for (int i = 0; i < sb.diskNum; i++)
+    {
+        // a mirror about to be rebuilt is opened, a missing raid 5 disk is not
+        if (diskimgs[i] == NULL)
+        {
+            diskfds[i] = -1;
+            continue;
+        }
+        diskfds[i] = open(diskimgs[i], O_RDWR);
+        if (diskfds[i] == -1)
+        {
+            perror("Error opening disk image\n");
+            return -1;
+        }
+        struct stat st;
+        if (fstat(diskfds[i], &st) == -1)
+        {
+            perror("Error: get disk image stats\n");
+            return -1;
+        }
+        disksizes[i] = st.st_size;
+        diskmaps[i] = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, diskfds[i], 0);
+        if (diskmaps[i] == MAP_FAILED)
+        {
+            perror("Error mapping disk image\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// flush every mapping back to its disk image
+int syncDisks()
+{
+    int res = 0;
+    for (int i = 0; i < sb.diskNum; i++)
+    {
+        if (syncDiskRange(i, 0, disksizes[i]) != 0)
+            res = -1;
+    }
+    return res;
+}
+
+// make len bytes at offset of a disk image durable
+int syncDiskRange(int disk, off_t offset, size_t len)
+{
+    int res;
+    if (disk == missing_disk)
+        return 0;
+    if (disk_io != DISK_IO_MMAP)
+        res = fdatasync(diskfds[disk]);
+    else
+    {
+        // msync wants a page-aligned start
+        off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+        res = msync(diskmaps[disk] + start, len + (offset - start), MS_SYNC);
+    }
+    if (res == -1)
+    {
+        perror("Error syncing disk image\n");
+        return -1;
+    }
+    return 0;
+}
+
+void closeDisks()
+{
+    for (int i = 0; i < sb.diskNum; i++)
+    {
+        if (i == missing_disk)
+            continue;
+        munmap(diskmaps[i], disksizes[i]);
+        close(diskfds[i]);
+    }
+}
+
+static ssize_t iov_total(const struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    return total;
+}
+
+// io_uring backend
+// rings are set up with the raw system calls, like copy_file_range below, one per thread
+// on its first transfer so submitting never takes a lock, and torn down when it exits
+// the disks are registered files, the block cache is a registered buffer, a transfer
+// landing in it uses the fixed-buffer opcodes
+struct uring
+{
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_size;
+    size_t cq_size;
+    int fixed_buffer; // the block cache is registered as buffer 0
+};
+
+static pthread_key_t uring_key;
+static int uring_ready = 0;
+static char *uring_buffer = NULL;
+static size_t uring_buffer_len = 0;
+
+void uringRegisterBuffer(void *base, size_t len)
+{
+    uring_buffer = base;
+    uring_buffer_len = len;
+}
+
+static void uringFree(void *arg)
+{
+    struct uring *ring = arg;
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_size);
+    close(ring->fd);
+    free(ring);
+}
+
+static struct uring *uringSetup()
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    struct uring *ring = calloc(1, sizeof(struct uring));
+    if (ring == NULL)
+        return NULL;
+    ring->fd = syscall(SYS_io_uring_setup, URING_DEPTH, &p);
+    if (ring->fd < 0)
+    {
+        free(ring);
+        return NULL;
+    }
+    ring->entries = p.sq_entries;
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // newer kernels put both rings in one mapping
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sq_size = ring->cq_size = MAX(ring->sq_size, ring->cq_size);
+    ring->sq_ring = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+        ring->cq_ring = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED ||
+        syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_FILES, diskfds, sb.diskNum) != 0)
+    {
+        uringFree(ring);
+        return NULL;
+    }
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    // pinning the cache may go over the locked memory limit, the ring works without it
+    struct iovec buffer = {.iov_base = uring_buffer, .iov_len = uring_buffer_len};
+    ring->fixed_buffer = uring_buffer != NULL &&
+                         syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &buffer, 1) == 0;
+    return ring;
+}
+
+// the calling thread's ring, NULL before the FUSE init callback or if it cannot be set up
+static struct uring *uringGet()
+{
+    if (!__atomic_load_n(&uring_ready, __ATOMIC_ACQUIRE))
+        return NULL;
+    struct uring *ring = pthread_getspecific(uring_key);
+    if (ring == NULL && (ring = uringSetup()) != NULL)
+        pthread_setspecific(uring_key, ring);
+    return ring;
+}
+
+// FUSE has forked by now, rings set up before would be shared with the parent
+// the calling thread's ring doubles as a probe, without io_uring wfs falls back to pread
+int uringInit()
+{
+    if (pthread_key_create(&uring_key, uringFree) != 0)
+        return -1;
+    __atomic_store_n(&uring_ready, 1, __ATOMIC_RELEASE);
+    if (uringGet() == NULL)
+    {
+        __atomic_store_n(&uring_ready, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
+
+// the threads FUSE served from free their rings as they exit, the one unmounting does not
+void uringStop()
+{
+    if (!__atomic_load_n(&uring_ready, __ATOMIC_ACQUIRE))
+        return;
+    __atomic_store_n(&uring_ready, 0, __ATOMIC_RELEASE);
+    struct uring *ring = pthread_getspecific(uring_key);
+    if (ring != NULL)
+    {
+        pthread_setspecific(uring_key, NULL);
+        uringFree(ring);
+    }
+}
+
+static void uringPrepare(struct uring *ring, struct disk_job *job, int tag)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    char *base = job->iov[0].iov_base;
+    if (ring->fixed_buffer && job->iovcnt == 1 && base >= uring_buffer &&
+        base + job->iov[0].iov_len <= uring_buffer + uring_buffer_len)
+    {
+        sqe->opcode = job->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (uintptr_t)base;
+        sqe->len = job->iov[0].iov_len;
+        sqe->buf_index = 0;
+    }
+    else
+    {
+        sqe->opcode = job->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uintptr_t)job->iov;
+        sqe->len = job->iovcnt;
+    }
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = job->disk;
+    sqe->off = job->offset;
+    sqe->user_data = tag;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// submit the jobs in rounds of at most a ring's worth, each round with one system call
+// that also waits for it, and take the completions in whatever order the disks finish
+// a short transfer fails like it does with pread
+// if the ring fails, what the kernel has not taken is dropped and what it has is waited
+// for, those transfers point into the caller's buffers and their completions at its jobs
+static int uringRun(struct uring *ring, struct disk_job *jobs, int njobs)
+{
+    int i = 0;
+    int failed = 0;
+    while (i < njobs && !failed)
+    {
+        int n = 0;
+        for (; i < njobs && n < (int)ring->entries; i++)
+        {
+            // a missing disk's reads are redirected or rebuilt a piece at a time
+            if (jobs[i].disk == missing_disk)
+            {
+                jobs[i].res = jobs[i].write ? 0 : disk_readv(jobs[i].disk, jobs[i].iov, jobs[i].iovcnt, jobs[i].offset);
+                continue;
+            }
+            statsDisk(jobs[i].disk, jobs[i].write, iov_total(jobs[i].iov, jobs[i].iovcnt));
+            jobs[i].res = -1;
+            uringPrepare(ring, &jobs[i], i);
+            n++;
+        }
+        int submitted = 0;
+        int done = 0;
+        while (done < (failed ? submitted : n))
+        {
+            int ret = syscall(SYS_io_uring_enter, ring->fd, failed ? 0 : n - submitted, (failed ? submitted : n) - done,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                perror("Error: io_uring_enter\n");
+                if (failed)
+                {
+                    // nothing can be waited for, closing the ring cancels what is left
+                    pthread_setspecific(uring_key, NULL);
+                    uringFree(ring);
+                    return -1;
+                }
+                failed = 1;
+                __atomic_store_n(ring->sq_tail, __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+                continue;
+            }
+            if (ret > 0 && !failed)
+                submitted += ret;
+            unsigned head = *ring->cq_head;
+            while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+            {
+                struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+                struct disk_job *job = &jobs[cqe->user_data];
+                job->res = cqe->res == iov_total(job->iov, job->iovcnt) ? 0 : -1;
+                head++;
+                done++;
+            }
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    int res = failed ? -1 : 0;
+    for (int k = 0; k < i; k++)
+    {
+        if (jobs[k].res != 0)
+            res = -1;
+    }
+    return res;
+}
+
+// whether the bytes at offset are the same on every disk, the metadata and the journal are
+// and mirrors hold everything
+static int replicated(off_t offset)
+{
+    return sb.raid == 1 || sb.raid == 2 || offset < sb.d_blocks_ptr || (sb.j_blocks_ptr != 0 && offset >= sb.j_blocks_ptr);
+}
+
+// the missing disk's metadata is read from the next disk, its data blocks cannot be read
+// and writes to it are dropped
+int disk_read(int disk, void *buf, size_t len, off_t offset)
+{
+    if (disk == missing_disk)
+    {
+        if (!replicated(offset))
+            return -1;
+        disk = (disk + 1) % sb.diskNum;
+    }
+    if (offset < 0 || offset + len > disksizes[disk])
+    {
+        fprintf(stderr, "Error: read past the end of disk %d\n", disk + 1);
+        return -1;
+    }
+    struct uring *ring;
+    if (disk_io == DISK_IO_URING && (ring = uringGet()) != NULL)
+    {
+        struct iovec iov = {.iov_base = buf, .iov_len = len};
+        struct disk_job job = {.disk = disk, .iov = &iov, .iovcnt = 1, .offset = offset};
+        return uringRun(ring, &job, 1);
+    }
+    statsDisk(disk, 0, len);
+    if (disk_io != DISK_IO_MMAP)
+        return pread(diskfds[disk], buf, len, offset) == len ? 0 : -1;
+    memcpy(buf, diskmaps[disk] + offset, len);
+    return 0;
+}
+
+int disk_write(int disk, const void *buf, size_t len, off_t offset)
+{
+    if (disk == missing_disk)
+        return 0;
+    if (offset < 0 || offset + len > disksizes[disk])
+    {
+        fprintf(stderr, "Error: write past the end of disk %d\n", disk + 1);
+        return -1;
+    }
+    struct uring *ring;
+    if (disk_io == DISK_IO_URING && (ring = uringGet()) != NULL)
+    {
+        struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+        struct disk_job job = {.disk = disk, .iov = &iov, .iovcnt = 1, .offset = offset, .write = 1};
+        return uringRun(ring, &job, 1);
+    }
+    statsDisk(disk, 1, len);
+    if (disk_io != DISK_IO_MMAP)
+        return pwrite(diskfds[disk], buf, len, offset) == len ? 0 : -1;
+    memcpy(diskmaps[disk] + offset, buf, len);
+    return 0;
+}
+
+// gathered read/write of consecutive bytes starting at offset
+int disk_readv(int disk, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    // the mapped path counts every piece through disk_read
+    struct uring *ring;
+    if (disk_io == DISK_IO_URING && disk != missing_disk && (ring = uringGet()) != NULL)
+    {
+        struct disk_job job = {.disk = disk, .iov = iov, .iovcnt = iovcnt, .offset = offset};
+        return uringRun(ring, &job, 1);
+    }
+    if (disk_io != DISK_IO_MMAP && disk != missing_disk)
+    {
+        statsDisk(disk, 0, iov_total(iov, iovcnt));
+        return preadv(diskfds[disk], iov, iovcnt, offset) == iov_total(iov, iovcnt) ? 0 : -1;
+    }
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (disk_read(disk, iov[i].iov_base, iov[i].iov_len, offset) != 0)
+            return -1;
+        offset += iov[i].iov_len;
+    }
+    return 0;
+}
+
+int disk_writev(int disk, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    if (disk == missing_disk)
+        return 0;
+    struct uring *ring;
+    if (disk_io == DISK_IO_URING && (ring = uringGet()) != NULL)
+    {
+        struct disk_job job = {.disk = disk, .iov = iov, .iovcnt = iovcnt, .offset = offset, .write = 1};
+        return uringRun(ring, &job, 1);
+    }
+    if (disk_io != DISK_IO_MMAP)
+    {
+        statsDisk(disk, 1, iov_total(iov, iovcnt));
+        return pwritev(diskfds[disk], iov, iovcnt, offset) == iov_total(iov, iovcnt) ? 0 : -1;
+    }
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (disk_write(disk, iov[i].iov_base, iov[i].iov_len, offset) != 0)
+            return -1;
+        offset += iov[i].iov_len;
+    }
+    return 0;
+}
+
+// per-disk I/O workers
+// a transfer spanning several disks gives each disk its share and waits for all of them,
+// so the disks are copied to or from at the same time instead of one after another
+struct disk_batch
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending; // jobs handed to workers and not finished yet
+};
+
+struct disk_worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct disk_job *head; // FIFO of jobs for this disk
+    struct disk_job *tail;
+    int stop;
+};
+
+static struct disk_worker workers[MAX_DISKS];
+static int workers_running = 0;
+
+static void doDiskJob(struct disk_job *job)
+{
+    if (job->write)
+        job->res = disk_writev(job->disk, job->iov, job->iovcnt, job->offset);
+    else
+        job->res = disk_readv(job->disk, job->iov, job->iovcnt, job->offset);
+}
+
+static void *diskWorker(void *arg)
+{
+    struct disk_worker *w = arg;
+    pthread_mutex_lock(&w->lock);
+    while (1)
+    {
+        while (w->head == NULL && !w->stop)
+            pthread_cond_wait(&w->wake, &w->lock);
+        if (w->head == NULL)
+            break;
+        struct disk_job *job = w->head;
+        w->head = job->next;
+        if (w->head == NULL)
+            w->tail = NULL;
+        pthread_mutex_unlock(&w->lock);
+
+        // the job lives on the submitter's stack, it is gone once the batch is done
+        struct disk_batch *batch = job->batch;
+        doDiskJob(job);
+        pthread_mutex_lock(&batch->lock);
+        if (--batch->pending == 0)
+            pthread_cond_signal(&batch->done);
+        pthread_mutex_unlock(&batch->lock);
+
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// one worker per disk
+int startDiskWorkers()
+{
+    for (int i = 0; i < sb.diskNum; i++)
+    {
+        struct disk_worker *w = &workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->wake, NULL);
+        w->head = w->tail = NULL;
+        w->stop = 0;
+        if (pthread_create(&w->thread, NULL, diskWorker, w) != 0)
+        {
+            stopDiskWorkers();
+            return -1;
+        }
+        workers_running = i + 1;
+    }
+    return 0;
+}
+
+void stopDiskWorkers()
+{
+    for (int i = 0; i < workers_running; i++)
+    {
+        pthread_mutex_lock(&workers[i].lock);
+        workers[i].stop = 1;
+        pthread_cond_signal(&workers[i].wake);
+        pthread_mutex_unlock(&workers[i].lock);
+    }
+    for (int i = 0; i < workers_running; i++)
+        pthread_join(workers[i].thread, NULL);
+    workers_running = 0;
+}
+
+// run the jobs, each disk in parallel when the workers are up and the transfer is worth it
+// the calling thread does the first job itself
+// return -1 if any job failed
+int runDiskJobs(struct disk_job *jobs, int njobs)
+{
+    size_t bytes = 0;
+    for (int i = 0; i < njobs; i++)
+        bytes += iov_total(jobs[i].iov, jobs[i].iovcnt);
+
+    int res = 0;
+    // io_uring takes the whole transfer in one submission
+    struct uring *ring;
+    if (disk_io == DISK_IO_URING && njobs > 1 && (ring = uringGet()) != NULL)
+        return uringRun(ring, jobs, njobs);
+    if (workers_running == 0 || njobs < 2 || bytes < PARALLEL_IO_MIN)
+    {
+        for (int i = 0; i < njobs; i++)
+        {
+            doDiskJob(&jobs[i]);
+            if (jobs[i].res != 0)
+                res = -1;
+        }
+        return res;
+    }
+
+    struct disk_batch batch;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    batch.pending = njobs - 1;
+    for (int i = 1; i < njobs; i++)
+    {
+        struct disk_worker *w = &workers[jobs[i].disk];
+        jobs[i].batch = &batch;
+        jobs[i].next = NULL;
+        pthread_mutex_lock(&w->lock);
+        if (w->tail == NULL)
+            w->head = &jobs[i];
+        else
+            w->tail->next = &jobs[i];
+        w->tail = &jobs[i];
+        pthread_cond_signal(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+    }
+    doDiskJob(&jobs[0]);
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending > 0)
+        pthread_cond_wait(&batch.done, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+
+    for (int i = 0; i < njobs; i++)
+    {
+        if (jobs[i].res != 0)
+            res = -1;
+    }
+    return res;
+}
+
+// disk holding data block db_index (any mirror holds it under raid 1 and 1v)
+int db_disk(int db_index)
+{
+    // a raid 5 stripe's data starts on the disk after its parity
+    if (sb.raid == 5)
+        return (parityDisk(db_index / STRIPE_DATA) + 1 + db_index % STRIPE_DATA) % sb.diskNum;
+    return sb.raid == 0 ? db_index % sb.diskNum : 0;
+}
+
+// mirror to serve the next raid 1 read, they take turns, passing over a disk being rebuilt
+int readMirror()
+{
+    int disk = __atomic_fetch_add(&diskTurn, 1, __ATOMIC_RELAXED) % sb.diskNum;
+    return disk == __atomic_load_n(&rebuild_disk, __ATOMIC_ACQUIRE) ? nextMirror(disk) : disk;
+}
+
+int nextMirror(int disk)
+{
+    disk = (disk + 1) % sb.diskNum;
+    return disk == __atomic_load_n(&rebuild_disk, __ATOMIC_ACQUIRE) ? (disk + 1) % sb.diskNum : disk;
+}
+
+// offset of data block db_index inside its disk
+off_t db_offset(int db_index)
+{
+    if (sb.raid == 0)
+        return sb.d_blocks_ptr + (off_t)(db_index / sb.diskNum) * BLOCK_SIZE;
+    if (sb.raid == 5)
+        return sb.d_blocks_ptr + (off_t)(db_index / STRIPE_DATA) * BLOCK_SIZE;
+    return sb.d_blocks_ptr + (off_t)db_index * BLOCK_SIZE;
+}
+
+// raid 5
+// stripe s is the blocks at offset s of every disk's data region, STRIPE_DATA of data and their parity
+// a write covering whole stripes takes the parity from the new data alone and goes out in one
+// transfer per disk, the partial stripes at the ends of a run are updated one at a time under
+// their stripe lock from what the disks hold
+// without missing_disk, its blocks are rebuilt from the rest of their stripe
+static pthread_mutex_t stripe_locks[STRIPE_LOCKS];
+
+// the parity moves one disk to the left every stripe
+int parityDisk(int stripe)
+{
+    return sb.diskNum - 1 - stripe % sb.diskNum;
+}
+
+void stripeInit()
+{
+    for (int i = 0; i < STRIPE_LOCKS; i++)
+        pthread_mutex_init(&stripe_locks[i], NULL);
+}
+
+static pthread_mutex_t *stripeLock(int stripe)
+{
+    return &stripe_locks[stripe % STRIPE_LOCKS];
+}
+
+// dst ^= src a word at a time, the loop is vectorized
+typedef uint64_t xor_word __attribute__((may_alias, aligned(1)));
+static void xorBlock(void *dst, const void *src)
+{
+    xor_word *d = dst;
+    const xor_word *s = src;
+    for (size_t i = 0; i < BLOCK_SIZE / sizeof(xor_word); i++)
+        d[i] ^= s[i];
+}
+
+// what disk holds in a stripe, from the other disks, the caller holds the stripe lock
+static int stripeRebuild(int stripe, int disk, char *buffer)
+{
+    char block[BLOCK_SIZE];
+    off_t offset = sb.d_blocks_ptr + (off_t)stripe * BLOCK_SIZE;
+    memset(buffer, 0, BLOCK_SIZE);
+    for (int d = 0; d < sb.diskNum; d++)
+    {
+        if (d == disk)
+            continue;
+        if (disk_read(d, block, BLOCK_SIZE, offset) != 0)
+        {
+            perror("Error: rebuild datablock\n");
+            return -1;
+        }
+        xorBlock(buffer, block);
+    }
+    return 0;
+}
+
+// a data block from its disk, or rebuilt when that disk is missing or fails
+int stripeRead(void *buffer, int db_index)
+{
+    int disk = db_disk(db_index);
+    if (disk != missing_disk && disk_read(disk, buffer, BLOCK_SIZE, db_offset(db_index)) == 0)
+        return 0;
+    int stripe = db_index / STRIPE_DATA;
+    pthread_mutex_lock(stripeLock(stripe));
+    int res = stripeRebuild(stripe, disk, buffer);
+    pthread_mutex_unlock(stripeLock(stripe));
+    return res;
+}
+
+// write n data blocks of a stripe from position first and update its parity
+// read-modify-write reads the old data and parity, reconstruct-write reads the data left
+// alone, whichever reads less; rebuild always reconstructs, so the parity ends up right
+// even if an earlier write of the stripe only got halfway
+// with a data disk missing that the write leaves alone, its block is only known through
+// the parity, so even a rebuild has to trust the old parity and read-modify-write it
+static int stripeUpdate(int stripe, int first, int n, const char *data, int rebuild)
+{
+    int parity = parityDisk(stripe);
+    off_t offset = sb.d_blocks_ptr + (off_t)stripe * BLOCK_SIZE;
+    int reconstruct = rebuild || STRIPE_DATA - n < n + 1;
+    // a missing disk cannot be read, the data it should hold is only known if it is written
+    // or through the parity, which reconstructing would throw away
+    if (missing_disk >= 0 && missing_disk != parity)
+    {
+        int missing = (missing_disk - parity - 1 + sb.diskNum) % sb.diskNum;
+        reconstruct = missing >= first && missing < first + n;
+    }
+    char block[BLOCK_SIZE];
+    char sum[BLOCK_SIZE];
+    int res = 0;
+    pthread_mutex_lock(stripeLock(stripe));
+    // without the parity disk only the data is written
+    if (missing_disk != parity && reconstruct)
+    {
+        memset(sum, 0, BLOCK_SIZE);
+        for (int k = 0; k < STRIPE_DATA && res == 0; k++)
+        {
+            if (k >= first && k < first + n)
+                xorBlock(sum, data + (size_t)(k - first) * BLOCK_SIZE);
+            else if (disk_read((parity + 1 + k) % sb.diskNum, block, BLOCK_SIZE, offset) != 0)
+                res = -1;
+            else
+                xorBlock(sum, block);
+        }
+    }
+    else if (missing_disk != parity)
+    {
+        res = disk_read(parity, sum, BLOCK_SIZE, offset);
+        for (int k = first; k < first + n && res == 0; k++)
+        {
+            res = disk_read((parity + 1 + k) % sb.diskNum, block, BLOCK_SIZE, offset);
+            xorBlock(sum, block);
+            xorBlock(sum, data + (size_t)(k - first) * BLOCK_SIZE);
+        }
+    }
+    for (int k = first; k < first + n && res == 0; k++)
+        res = disk_write((parity + 1 + k) % sb.diskNum, data + (size_t)(k - first) * BLOCK_SIZE, BLOCK_SIZE, offset);
+    if (res == 0)
+        res = disk_write(parity, sum, BLOCK_SIZE, offset);
+    pthread_mutex_unlock(stripeLock(stripe));
+    if (res != 0)
+        perror("Error: write stripe\n");
+    return res;
+}
+
+int stripeWrite(int db_index, const void *buffer, int rebuild)
+{
+    return stripeUpdate(db_index / STRIPE_DATA, db_index % STRIPE_DATA, 1, buffer, rebuild);
+}
+
+// one block of a raid 5 transfer
+struct stripe_io
+{
+    int disk;
+    off_t offset;
+    char *data;
+};
+
+static int stripeIoOrder(const void *a, const void *b)
+{
+    const struct stripe_io *x = a;
+    const struct stripe_io *y = b;
+    if (x->disk != y->disk)
+        return x->disk - y->disk;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// blocks at consecutive offsets of a disk become one gathered job, the disks run in parallel
+static int runStripeIo(struct stripe_io *io, int n, int write)
+{
+    if (n == 0)
+        return 0;
+    qsort(io, n, sizeof(struct stripe_io), stripeIoOrder);
+    struct iovec *iov = malloc(n * sizeof(struct iovec));
+    struct disk_job *jobs = malloc(n * sizeof(struct disk_job));
+    if (iov == NULL || jobs == NULL)
+    {
+        free(iov);
+        free(jobs);
+        return -1;
+    }
+    int njobs = 0;
+    for (int i = 0; i < n; i++)
+    {
+        iov[i] = (struct iovec){.iov_base = io[i].data, .iov_len = BLOCK_SIZE};
+        struct disk_job *prev = njobs > 0 ? &jobs[njobs - 1] : NULL;
+        if (prev != NULL && prev->disk == io[i].disk && prev->offset + (off_t)prev->iovcnt * BLOCK_SIZE == io[i].offset)
+            prev->iovcnt++;
+        else
+            jobs[njobs++] = (struct disk_job){.disk = io[i].disk, .iov = &iov[i], .iovcnt = 1, .offset = io[i].offset, .write = write};
+    }
+    int res = runDiskJobs(jobs, njobs);
+    free(iov);
+    free(jobs);
+    return res;
+}
+
+int stripeTransfer(void *buffer, int db_start, int count, int write)
+{
+    char *buf = buffer;
+    int first_stripe = db_start / STRIPE_DATA;
+    int last_stripe = (db_start + count - 1) / STRIPE_DATA;
+    int nstripes = last_stripe - first_stripe + 1;
+    struct stripe_io *io = malloc((size_t)(count + nstripes) * sizeof(struct stripe_io));
+    char *parity = write ? malloc((size_t)nstripes * BLOCK_SIZE) : NULL;
+    if (io == NULL || (write && parity == NULL))
+    {
+        free(io);
+        free(parity);
+        perror("Error: transfer datablocks\n");
+        return -1;
+    }
+    int n = 0;
+    int res = 0;
+    if (write)
+    {
+        for (int s = first_stripe; s <= last_stripe && res == 0; s++)
+        {
+            int start = MAX(db_start, s * STRIPE_DATA);
+            int end = MIN(db_start + count, (s + 1) * STRIPE_DATA);
+            char *data = buf + (size_t)(start - db_start) * BLOCK_SIZE;
+            if (end - start < STRIPE_DATA)
+            {
+                res = stripeUpdate(s, start - s * STRIPE_DATA, end - start, data, 0);
+                continue;
+            }
+            // a whole stripe needs nothing from the disks
+            char *sum = parity + (size_t)(s - first_stripe) * BLOCK_SIZE;
+            memcpy(sum, data, BLOCK_SIZE);
+            for (int k = 1; k < STRIPE_DATA; k++)
+                xorBlock(sum, data + (size_t)k * BLOCK_SIZE);
+            for (int k = 0; k < STRIPE_DATA; k++)
+                io[n++] = (struct stripe_io){.disk = db_disk(start + k), .offset = db_offset(start), .data = data + (size_t)k * BLOCK_SIZE};
+            io[n++] = (struct stripe_io){.disk = parityDisk(s), .offset = db_offset(start), .data = sum};
+        }
+    }
+    else
+    {
+        for (int b = db_start; b < db_start + count; b++)
+        {
+            if (db_disk(b) != missing_disk)
+                io[n++] = (struct stripe_io){.disk = db_disk(b), .offset = db_offset(b), .data = buf + (size_t)(b - db_start) * BLOCK_SIZE};
+        }
+    }
+    if (res == 0)
+        res = runStripeIo(io, n, write);
+    // the blocks of a missing disk are rebuilt one by one
+    for (int b = db_start; b < db_start + count && res == 0 && !write; b++)
+    {
+        if (db_disk(b) == missing_disk)
+            res = stripeRead(buf + (size_t)(b - db_start) * BLOCK_SIZE, b);
+    }
+    free(io);
+    free(parity);
+    if (res != 0)
+        perror("Error: transfer datablocks\n");
+    return res;
+}
+
+// block cache
+// data blocks keyed by db_index, kept in LRU order and written back when dirty
+// a dirty block goes back with the dirty blocks next to it as one transfer, so small
+// writes left behind in the cache reach the disks as large ones
+// cache_lock guards the whole cache, the static helpers expect it held
+// disk I/O runs without it: a slot being read or written back is marked in io, the
+// others wait on cache_io_done for it instead of the whole cache waiting for the disks
+#define CACHE_IO_READ 1  // the data is being read in, nobody may look at it
+#define CACHE_IO_WRITE 2 // the data is being written back, it may be read but not changed
+struct cache_block
+{
+    int db_index; // -1 when the slot is empty
+    int dirty;
+    int io; // CACHE_IO_READ or CACHE_IO_WRITE while the slot's I/O runs, 0 otherwise
+    struct cache_block *prev; // LRU list, head is the most recently used
+    struct cache_block *next;
+    struct cache_block *hnext; // hash chain
+    char *data;
+};
+
+struct block_cache
+{
+    size_t capacity;
+    size_t nbuckets;
+    struct cache_block *slots;
+    struct cache_block **buckets;
+    struct cache_block *head;
+    struct cache_block *tail;
+    char *data;
+    size_t hits;
+    size_t misses;
+    size_t writebacks;
+    size_t writeback_runs;
+    size_t evictions;
+    size_t prefetched;
+};
+
+static struct block_cache cache;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_io_done = PTHREAD_COND_INITIALIZER;
+size_t cache_blocks = CACHE_BLOCKS;
+
+int cache_init(size_t capacity)
+{
+    memset(&cache, 0, sizeof(cache));
+    cache.capacity = capacity;
+    if (capacity == 0)
+        return 0;
+
+    cache.nbuckets = 1;
+    while (cache.nbuckets < capacity * 2)
+        cache.nbuckets <<= 1;
+    cache.slots = calloc(capacity, sizeof(struct cache_block));
+    cache.buckets = calloc(cache.nbuckets, sizeof(struct cache_block *));
+    cache.data = malloc(capacity * BLOCK_SIZE);
+    if (cache.slots == NULL || cache.buckets == NULL || cache.data == NULL)
+    {
+        perror("Failed to allocate memory for block cache\n");
+        return -1;
+    }
+
+    // every slot starts empty on the LRU list
+    for (size_t i = 0; i < capacity; i++)
+    {
+        struct cache_block *cb = &cache.slots[i];
+        cb->db_index = -1;
+        cb->data = cache.data + i * BLOCK_SIZE;
+        cb->prev = i == 0 ? NULL : &cache.slots[i - 1];
+        cb->next = i == capacity - 1 ? NULL : &cache.slots[i + 1];
+    }
+    cache.head = &cache.slots[0];
+    cache.tail = &cache.slots[capacity - 1];
+    uringRegisterBuffer(cache.data, capacity * BLOCK_SIZE);
+    return 0;
+}
+
+static struct cache_block **cache_bucket(int db_index)
+{
+    return &cache.buckets[(size_t)db_index & (cache.nbuckets - 1)];
+}
+
+static struct cache_block *cache_lookup(int db_index)
+{
+    for (struct cache_block *cb = *cache_bucket(db_index); cb != NULL; cb = cb->hnext)
+    {
+        if (cb->db_index == db_index)
+            return cb;
+    }
+    return NULL;
+}
+
+static void cache_unhash(struct cache_block *cb)
+{
+    struct cache_block **pp = cache_bucket(cb->db_index);
+    while (*pp != cb)
+        pp = &(*pp)->hnext;
+    *pp = cb->hnext;
+    cb->hnext = NULL;
+    cb->db_index = -1;
+    cb->dirty = 0;
+    cb->io = 0;
+}
+
+// look db_index up once its slot is no longer being read in, a writer also waits out
+// a writeback, the cache lock is dropped while waiting
+static struct cache_block *cache_lookup_wait(int db_index, int writer)
+{
+    struct cache_block *cb;
+    while ((cb = cache_lookup(db_index)) != NULL && (cb->io == CACHE_IO_READ || (writer && cb->io != 0)))
+        pthread_cond_wait(&cache_io_done, &cache_lock);
+    return cb;
+}
+
+// a slot's I/O is done, wake whoever waits for it
+static void cache_io_end(struct cache_block *cb)
+{
+    cb->io = 0;
+    pthread_cond_broadcast(&cache_io_done);
+}
+
+// move a slot to the head of the LRU list
+static void cache_touch(struct cache_block *cb)
+{
+    if (cache.head == cb)
+        return;
+    cb->prev->next = cb->next;
+    if (cb->next != NULL)
+        cb->next->prev = cb->prev;
+    else
+        cache.tail = cb->prev;
+    cb->prev = NULL;
+    cb->next = cache.head;
+    cache.head->prev = cb;
+    cache.head = cb;
+}
+
+// write back a dirty block with the run of dirty blocks around it, they stay cached clean
+// a run that fails stays dirty, the next flush tries it again
+// the disks are written without the cache lock, the run's slots are held by CACHE_IO_WRITE
+static int cache_write_run(struct cache_block *cb)
+{
+    struct cache_block *next;
+    int first = cb->db_index;
+    int last = cb->db_index;
+    while (first > 0 && (next = cache_lookup(first - 1)) != NULL && next->dirty && next->io == 0)
+        first--;
+    while ((next = cache_lookup(last + 1)) != NULL && next->dirty && next->io == 0)
+        last++;
+    int count = last - first + 1;
+    // without the memory to gather the run the block goes alone
+    char *buf = count > 1 ? malloc((size_t)count * BLOCK_SIZE) : NULL;
+    if (buf == NULL)
+        first = last = cb->db_index;
+    for (int b = first; b <= last; b++)
+    {
+        cache_lookup(b)->io = CACHE_IO_WRITE;
+        if (buf != NULL)
+            memcpy(buf + (size_t)(b - first) * BLOCK_SIZE, cache_lookup(b)->data, BLOCK_SIZE);
+    }
+    TRACE(TRACE_CACHE, "cache writeback %d+%d", first, last - first + 1);
+    pthread_mutex_unlock(&cache_lock);
+    int res = buf == NULL ? writeDataBlock(cb->db_index, cb->data) : transferDataBlocks(buf, first, count, 1);
+    free(buf);
+    pthread_mutex_lock(&cache_lock);
+    // nothing could change or drop the slots meanwhile
+    for (int b = first; b <= last; b++)
+    {
+        next = cache_lookup(b);
+        if (res == 0)
+            next->dirty = 0;
+        cache_io_end(next);
+    }
+    if (res != 0)
+        return res;
+    cache.writebacks += last - first + 1;
+    cache.writeback_runs++;
+    return 0;
+}
+
+// take the least recently used slot no I/O holds for db_index, which the caller found missing
+// a dirty one is written back first, without the cache lock, so the block may have been
+// cached by someone else meanwhile: then 1 comes back and the caller looks it up again
+// a slot that could not be written back keeps its data, once *tried is set only clean slots
+// are taken, so a caller waits for one writeback at most
+// *cbp is NULL when no slot can be had
+static int cache_claim(int db_index, int *tried, struct cache_block **cbp)
+{
+    struct cache_block *cb = cache.tail;
+    while (cb != NULL && (cb->io != 0 || (*tried && cb->db_index != -1 && cb->dirty)))
+        cb = cb->prev;
+    *cbp = cb;
+    if (cb == NULL)
+        return 0;
+    if (cb->db_index != -1 && cb->dirty)
+    {
+        *tried = 1;
+        cache_write_run(cb);
+        return 1;
+    }
+    if (cb->db_index != -1)
+    {
+        cache.evictions++;
+        cache_unhash(cb);
+    }
+    cb->db_index = db_index;
+    cb->hnext = *cache_bucket(db_index);
+    *cache_bucket(db_index) = cb;
+    cache_touch(cb);
+    return 0;
+}
+
+// the slot caching db_index, *claimed is set when it was missing and a slot was taken for it
+// NULL when it is missing and every slot is held or dirty
+static struct cache_block *cache_find(int db_index, int writer, int *claimed)
+{
+    int tried = 0;
+    struct cache_block *cb;
+    *claimed = 0;
+    while ((cb = cache_lookup_wait(db_index, writer)) == NULL)
+    {
+        if (cache_claim(db_index, &tried, &cb) == 0)
+        {
+            *claimed = cb != NULL;
+            break;
+        }
+    }
+    return cb;
+}
+
+// write every dirty block back to the disks
+int cache_flush()
+{
+    int res = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < cache.capacity; i++)
+    {
+        struct cache_block *cb = &cache.slots[i];
+        // a writeback already running may fail, the block is looked at once it is done
+        while (cb->io != 0)
+            pthread_cond_wait(&cache_io_done, &cache_lock);
+        if (cb->db_index != -1 && cb->dirty && cache_write_run(cb) != 0)
+            res = -1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return res;
+}
+
+// write a dirty cached block back to the disks and keep it cached clean
+int cache_writeback(int db_index)
+{
+    if (cache.capacity == 0)
+        return 0;
+    int res = 0;
+    pthread_mutex_lock(&cache_lock);
+    struct cache_block *cb = cache_lookup_wait(db_index, 1);
+    if (cb != NULL && cb->dirty)
+        res = cache_write_run(cb);
+    pthread_mutex_unlock(&cache_lock);
+    return res;
+}
+
+// drop a block that was freed or overwritten, its contents no longer matter
+void cache_invalidate(int db_index)
+{
+    if (cache.capacity == 0)
+        return;
+    // a read or writeback of the old contents must not land after whatever replaces them
+    pthread_mutex_lock(&cache_lock);
+    struct cache_block *cb = cache_lookup_wait(db_index, 1);
+    if (cb != NULL)
+        cache_unhash(cb);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int cache_get(void *buffer, int db_index)
+{
+    if (cache.capacity == 0)
+        return 0;
+    pthread_mutex_lock(&cache_lock);
+    struct cache_block *cb = cache_lookup_wait(db_index, 0);
+    if (cb != NULL && buffer != NULL)
+    {
+        cache.hits++;
+        cache_touch(cb);
+        memcpy(buffer, cb->data, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return cb != NULL;
+}
+
+// the blocks are read without the cache lock, a block cached meanwhile is newer and stays
+// the caller keeps the file they belong to from being written, so the disks still hold
+// what was read once it goes in
+int cache_prefetch(int db_start, int count)
+{
+    if (cache.capacity == 0)
+        return 0;
+    // a run longer than that would push its own first blocks out
+    count = MIN((size_t)count, MAX(cache.capacity / 2, 1));
+    char *buf = malloc((size_t)count * BLOCK_SIZE);
+    if (buf == NULL)
+        return -1;
+    int res = 0;
+    for (int b = db_start; b < db_start + count && res == 0;)
+    {
+        pthread_mutex_lock(&cache_lock);
+        int n = 0;
+        while (b + n < db_start + count && cache_lookup(b + n) == NULL)
+            n++;
+        pthread_mutex_unlock(&cache_lock);
+        if (n == 0)
+        {
+            b++;
+            continue;
+        }
+        res = transferDataBlocks(buf, b, n, 0);
+        pthread_mutex_lock(&cache_lock);
+        for (int i = 0; i < n && res == 0; i++)
+        {
+            int claimed;
+            struct cache_block *cb = cache_find(b + i, 0, &claimed);
+            if (cb == NULL)
+                res = -1;
+            else if (claimed)
+            {
+                memcpy(cb->data, buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+                cache.prefetched++;
+            }
+        }
+        pthread_mutex_unlock(&cache_lock);
+        b += n;
+    }
+    free(buf);
+    return res;
+}
+
+int cache_stats_format(char *buf, size_t size)
+{
+    pthread_mutex_lock(&cache_lock);
+    size_t lookups = cache.hits + cache.misses;
+    int len = snprintf(buf, size, "block cache: %zu blocks, %zu hits, %zu misses, %.1f%% hit rate, %zu writebacks in %zu runs, %zu evictions, %zu prefetched\n",
+                       cache.capacity, cache.hits, cache.misses, lookups ? 100.0 * cache.hits / lookups : 0.0,
+                       cache.writebacks, cache.writeback_runs, cache.evictions, cache.prefetched);
+    pthread_mutex_unlock(&cache_lock);
+    return len;
+}
+
+void cache_stats_reset()
+{
+    pthread_mutex_lock(&cache_lock);
+    cache.hits = 0;
+    cache.misses = 0;
+    cache.writebacks = 0;
+    cache.writeback_runs = 0;
+    cache.evictions = 0;
+    cache.prefetched = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// find the datablock (512b) corresponding to the db_index
+int getDataBlockByDbindex(void *buffer, int db_index)
+{
+    // a dentry or table block changed by the running transaction is only in the journal buffer
+    if (sb.j_blocks > 0 && journalRead(db_index, buffer))
+        return 0;
+    if (cache.capacity == 0)
+        return readDataBlock(buffer, db_index);
+
+    int claimed;
+    pthread_mutex_lock(&cache_lock);
+    struct cache_block *cb = cache_find(db_index, 0, &claimed);
+    if (cb != NULL && !claimed)
+    {
+        cache.hits++;
+        cache_touch(cb);
+        memcpy(buffer, cb->data, BLOCK_SIZE);
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    cache.misses++;
+    TRACE(TRACE_CACHE, "cache miss %d", db_index);
+    // with every slot held or stuck dirty the block is read past the cache
+    if (cb == NULL)
+    {
+        pthread_mutex_unlock(&cache_lock);
+        return readDataBlock(buffer, db_index);
+    }
+    // others asking for the block wait for the slot, not for the cache lock
+    cb->io = CACHE_IO_READ;
+    pthread_mutex_unlock(&cache_lock);
+    int res = readDataBlock(cb->data, db_index);
+    if (res == 0)
+        memcpy(buffer, cb->data, BLOCK_SIZE);
+    pthread_mutex_lock(&cache_lock);
+    if (res != 0)
+        cache_unhash(cb);
+    cache_io_end(cb);
+    pthread_mutex_unlock(&cache_lock);
+    return res;
+}
+
+// read a datablock from the disks, bypassing the cache
+int readDataBlock(void *buffer, int db_index)
+{
+    // striping and mirroring mode
+    if (sb.raid == 0 || sb.raid == 1)
+    {
+        int disk = sb.raid == 0 ? db_disk(db_index) : readMirror();
+        if (disk_read(disk, buffer, BLOCK_SIZE, db_offset(db_index)) != 0)
+        {
+            perror("Error: read from datablock\n");
+            return -1;
+        }
+    }
+    // verified mirroring reads one mirror and checks it against the block's checksum
+    else if (sb.raid == 2)
+    {
+        if (disk_read(readMirror(), buffer, BLOCK_SIZE, db_offset(db_index)) != 0)
+        {
+            perror("Error: read from datablock\n");
+            return -1;
+        }
+        if (!checksumMatches(db_index, buffer))
+            return recoverBlock(buffer, db_index);
+    }
+    else if (sb.raid == 5)
+        return stripeRead(buffer, db_index);
+    return 0;
+}
+
+// read every mirror of a raid 1v block and keep the copy matching its checksum
+// without a checksum or a matching copy the majority wins, as it did before checksums
+// mirrors holding anything else are rewritten with the copy kept
+int recoverBlock(void *buffer, int db_index)
+{
+    char temp_buffers[sb.diskNum][BLOCK_SIZE]; // the copy read from each disk
+    int votes[sb.diskNum];                     // disks holding the same copy
+    memset(votes, 0, sizeof(votes));
+    // a mirror being rebuilt neither votes nor gets repaired, the rebuild copies the block
+    int skip = __atomic_load_n(&rebuild_disk, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < sb.diskNum; i++)
+    {
+        if (i == skip)
+            continue;
+        if (disk_read(i, temp_buffers[i], BLOCK_SIZE, db_offset(db_index)) != 0)
+        {
+            perror("Error: read from datablock\n");
+            return -1;
+        }
+    }
+
+    int selected_index = -1;
+    for (int i = 0; i < sb.diskNum && selected_index < 0; i++)
+    {
+        if (i != skip && checksumMatches(db_index, temp_buffers[i]))
+            selected_index = i;
+    }
+
+    if (selected_index < 0)
+    {
+        for (int i = 0; i < sb.diskNum; i++)
+        {
+            for (int j = 0; j < sb.diskNum && i != skip; j++)
+            {
+                if (j != skip && memcmp(temp_buffers[i], temp_buffers[j], BLOCK_SIZE) == 0)
+                {
+                    votes[i]++;
+                }
+            }
+        }
+
+        int max_votes = -1;
+        selected_index = 0;
+        for (int i = 0; i < sb.diskNum; i++)
+        {
+            if (votes[i] > max_votes || (votes[i] == max_votes && i < selected_index))
+            {
+                max_votes = votes[i];
+                selected_index = i;
+            }
+        }
+        setChecksum(db_index, temp_buffers[selected_index]);
+    }
+
+    // self-repair
+    for (int i = 0; i < sb.diskNum; i++)
+    {
+        if (i == selected_index || i == skip || memcmp(temp_buffers[i], temp_buffers[selected_index], BLOCK_SIZE) == 0)
+            continue;
+        fprintf(stderr, "wfs: repairing block %d on disk %d\n", db_index, i + 1);
+        pthread_mutex_lock(&repair_lock);
+        disk_write(i, temp_buffers[selected_index], BLOCK_SIZE, db_offset(db_index));
+        pthread_mutex_unlock(&repair_lock);
+    }
+
+    memcpy(buffer, temp_buffers[selected_index], BLOCK_SIZE);
+    return 0;
+}
+
+// raid 1v checksums
+// one CRC-32C per data block, kept in memory and flushed to every mirror like the bitmaps
+// csum_lock guards the table and its dirty flags
+// the CRC-32C table in wfs.h also serves the journal, crc32cInit builds it at mount
+static pthread_mutex_t csum_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// load the checksum table, an entry the mirrors disagree on takes the majority value
+int loadChecksums()
+{
+    size_t size = checksum_size(&sb);
+    checksums = calloc(size, 1);
+    checksum_dirty = calloc(size / BLOCK_SIZE, 1);
+    uint32_t *copies = malloc(size * sb.diskNum);
+    if (checksums == NULL || checksum_dirty == NULL || copies == NULL)
+    {
+        perror("Failed to allocate memory for checksums\n");
+        free(copies);
+        return -1;
+    }
+    for (int i = 0; i < sb.diskNum; i++)
+    {
+        if (disk_read(i, copies + i * (size / sizeof(uint32_t)), size, sb.c_blocks_ptr) != 0)
+        {
+            perror("Failed to read checksums\n");
+            free(copies);
+            return -1;
+        }
+    }
+    for (size_t b = 0; b < sb.num_data_blocks; b++)
+    {
+        int best_votes = 0;
+        for (int i = 0; i < sb.diskNum; i++)
+        {
+            uint32_t value = copies[i * (size / sizeof(uint32_t)) + b];
+            int votes = 0;
+            for (int j = 0; j < sb.diskNum; j++)
+                votes += copies[j * (size / sizeof(uint32_t)) + b] == value;
+            if (votes > best_votes)
+            {
+                best_votes = votes;
+                checksums[b] = value;
+            }
+        }
+        if (best_votes < sb.diskNum)
+            checksum_dirty[b * sizeof(uint32_t) / BLOCK_SIZE] = 1;
+    }
+    free(copies);
+    return 0;
+}
+
+void setChecksum(int db_index, const void *data)
+{
+    uint32_t crc = blockChecksum(&sb, data);
+    pthread_mutex_lock(&csum_lock);
+    checksums[db_index] = crc;
+    checksum_dirty[db_index * sizeof(uint32_t) / BLOCK_SIZE] = 1;
+    pthread_mutex_unlock(&csum_lock);
+}
+
+int checksumMatches(int db_index, const void *data)
+{
+    pthread_mutex_lock(&csum_lock);
+    uint32_t crc = checksums[db_index];
+    pthread_mutex_unlock(&csum_lock);
+    return crc != 0 && blockChecksum(&sb, data) == crc;
+}
+
+// metadata journal
+// a flush is one transaction: every metadata write it makes goes to the journal region of
+// each disk first, is synced there and only then written in place
+// the in-place writes are not synced, the next commit syncs them before it reuses the
+// journal, so the journal only ever needs the last transaction
+// until their transaction commits, dentry and table blocks live in a buffer of their own
+// instead of the block cache, and data blocks freed by it are not handed out again
+#define JBLOCK_BUCKETS 1024
+
+struct jblock
+{
+    int db_index;
+    unsigned long seq; // bumped by every write, a commit only drops the copy it wrote
+    struct jblock *next;
+    char data[];
+};
+
+// journal_lock guards the block buffer, the free bitmaps belong to alloc_lock
+static struct jblock *jblocks[JBLOCK_BUCKETS];
+static size_t jblock_count = 0;
+static unsigned long jblock_seq = 0;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+// data blocks freed by the running transaction and by the one being committed
+static uint8_t *dbitmap_freeing = NULL;
+static uint8_t *dbitmap_committing = NULL;
+static uint32_t journal_seq = 0;
+
+// records of a transaction being put together, after room for the header
+struct txn
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+    uint32_t nrecords;
+};
+
+// a dentry or table block copied out of the buffer by a commit
+struct jcopy
+{
+    int db_index;
+    unsigned long seq;
+};
+
+int journalInit()
+{
+    size_t dbitmap_size = (sb.num_data_blocks / 8 * (sb.raid == 0 ? sb.diskNum : 1) + 7) / 8 * 8;
+    dbitmap_freeing = calloc(dbitmap_size, 1);
+    dbitmap_committing = calloc(dbitmap_size, 1);
+    if (dbitmap_freeing == NULL || dbitmap_committing == NULL)
+    {
+        perror("Failed to allocate memory for the journal\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void txnInit(struct txn *t)
+{
+    memset(t, 0, sizeof(struct txn));
+    t->len = sizeof(struct wfs_journal_header);
+}
+
+// queue a write of len bytes at offset, to every disk when disk is -1
+static int txnAdd(struct txn *t, int disk, off_t offset, const void *data, size_t len)
+{
+    size_t need = t->len + sizeof(struct wfs_journal_record) + len;
+    if (need > t->cap)
+    {
+        size_t cap = t->cap ? t->cap : 64 * 1024;
+        while (cap < need)
+            cap *= 2;
+        char *buf = realloc(t->buf, cap);
+        if (buf == NULL)
+        {
+            perror("Error: allocate journal transaction\n");
+            return -1;
+        }
+        t->buf = buf;
+        t->cap = cap;
+    }
+    struct wfs_journal_record record = {.disk = disk, .len = len, .offset = offset};
+    memcpy(t->buf + t->len, &record, sizeof(record));
+    memcpy(t->buf + t->len + sizeof(record), data, len);
+    t->len = need;
+    t->nrecords++;
+    return 0;
+}
+
+// do the writes of a transaction in place
+static int txnApply(const char *buf, size_t len)
+{
+    int res = 0;
+    int locked = mirrorWriteBegin();
+    for (size_t pos = sizeof(struct wfs_journal_header); pos < len;)
+    {
+        struct wfs_journal_record record;
+        memcpy(&record, buf + pos, sizeof(record));
+        pos += sizeof(record);
+        // the parity is taken from the whole stripe, so a replay also fixes one half written
+        // unless the set is degraded, see stripeUpdate
+        if (record.disk == WFS_JOURNAL_BLOCK && stripeWrite(record.offset, buf + pos, 1) != 0)
+            res = -1;
+        for (int i = 0; i < sb.diskNum && record.disk != WFS_JOURNAL_BLOCK; i++)
+        {
+            if ((record.disk == -1 || record.disk == i) && disk_write(i, buf + pos, record.len, record.offset) != 0)
+            {
+                perror("Error writing metadata\n");
+                res = -1;
+            }
+        }
+        pos += record.len;
+    }
+    mirrorWriteEnd(locked);
+    return res;
+}
+
+// log the transaction, then write it in place
+static int journalCommit(struct txn *t)
+{
+    if (t->nrecords == 0)
+        return 0;
+    if (t->len > (size_t)sb.j_blocks * BLOCK_SIZE)
+    {
+        // the last transaction must not be replayed over this one
+        fprintf(stderr, "wfs: %zu byte transaction does not fit the journal, writing it unjournaled\n", t->len);
+        if (journalClear() != 0)
+            return -1;
+        return txnApply(t->buf, t->len);
+    }
+    struct wfs_journal_header header = {
+        .magic = WFS_JOURNAL_MAGIC,
+        .seq = ++journal_seq,
+        .nrecords = t->nrecords,
+        .bytes = t->len - sizeof(struct wfs_journal_header),
+    };
+    memcpy(t->buf, &header, sizeof(header));
+    TRACE(TRACE_JOURNAL, "journal commit %u, %d records, %zu bytes", header.seq, t->nrecords, t->len);
+    header.checksum = crc32c(0, t->buf, t->len);
+    memcpy(t->buf, &header, sizeof(header));
+
+    // data and the last transaction's in-place writes have to be on disk before it is replaced
+    if (syncDisks() != 0)
+        return -1;
+    for (int i = 0; i < sb.diskNum; i++)
+    {
+        if (disk_write(i, t->buf, t->len, sb.j_blocks_ptr) != 0 ||
+            syncDiskRange(i, sb.j_blocks_ptr, t->len) != 0)
+        {
+            perror("Error writing journal\n");
+            return -1;
+        }
+    }
+    return txnApply(t->buf, t->len);
+}
+
+int journalClear()
+{
+    if (sb.j_blocks == 0)
+        return 0;
+    if (syncDisks() != 0)
+        return -1;
+    struct wfs_journal_header header;
+    memset(&header, 0, sizeof(header));
+    for (int i = 0; i < sb.diskNum; i++)
+    {
+        if (disk_write(i, &header, sizeof(header), sb.j_blocks_ptr) != 0 ||
+            syncDiskRange(i, sb.j_blocks_ptr, sizeof(header)) != 0)
+        {
+            perror("Error writing journal\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// read the transaction in the journal of a disk, return its length or 0 if it is not valid
+static size_t journalLoad(int disk, char *buf)
+{
+    struct wfs_journal_header header;
+    size_t size = (size_t)sb.j_blocks * BLOCK_SIZE;
+    if (disk_read(disk, &header, sizeof(header), sb.j_blocks_ptr) != 0 || header.magic != WFS_JOURNAL_MAGIC ||
+        header.bytes > size - sizeof(header))
+        return 0;
+    size_t len = sizeof(header) + header.bytes;
+    if (disk_read(disk, buf, len, sb.j_blocks_ptr) != 0)
+        return 0;
+    uint32_t checksum = header.checksum;
+    ((struct wfs_journal_header *)buf)->checksum = 0;
+    if (crc32c(0, buf, len) != checksum)
+        return 0;
+    // a torn record list would still have passed the checksum only by accident
+    size_t pos = sizeof(header);
+    for (uint32_t r = 0; r < header.nrecords && pos + sizeof(struct wfs_journal_record) <= len; r++)
+    {
+        struct wfs_journal_record record;
+        memcpy(&record, buf + pos, sizeof(record));
+        pos += sizeof(record) + record.len;
+    }
+    return pos == len ? len : 0;
+}
+
+// the disks may hold different transactions after a crash during a commit,
+// the one with the highest sequence number is the last one committed
+int journalRecover()
+{
+    if (sb.j_blocks == 0)
+        return 0;
+    char *buf = malloc((size_t)sb.j_blocks * BLOCK_SIZE);
+    if (buf == NULL)
+    {
+        perror("Failed to allocate memory for the journal\n");
+        return -1;
+    }
+    int best = -1;
+    for (int i = 0; i < sb.diskNum; i++)
+    {
+        if (journalLoad(i, buf) == 0)
+            continue;
+        uint32_t seq = ((struct wfs_journal_header *)buf)->seq;
+        if (best < 0 || seq > journal_seq)
+        {
+            best = i;
+            journal_seq = seq;
+        }
+    }
+
+    int res = 0;
+    if (best >= 0)
+    {
+        size_t len = journalLoad(best, buf);
+        res = txnApply(buf, len) != 0 || journalClear() != 0 ? -1 : 0;
+        fprintf(stderr, "wfs: replayed journal transaction %u\n", journal_seq);
+    }
+    free(buf);
+    return res;
+}
+
+int journalRead(int db_index, void *buffer)
+{
+    int found = 0;
+    pthread_mutex_lock(&journal_lock);
+    for (struct jblock *jb = jblocks[db_index % JBLOCK_BUCKETS]; jb != NULL; jb = jb->next)
+    {
+        if (jb->db_index == db_index)
+        {
+            memcpy(buffer, jb->data, BLOCK_SIZE);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return found;
+}
+
+void journalWrite(int db_index, const void *buffer)
+{
+    pthread_mutex_lock(&journal_lock);
+    struct jblock *jb = jblocks[db_index % JBLOCK_BUCKETS];
+    while (jb != NULL && jb->db_index != db_index)
+        jb = jb->next;
+    if (jb == NULL)
+    {
+        jb = malloc(sizeof(struct jblock) + BLOCK_SIZE);
+        if (jb == NULL)
+        {
+            // nothing better to do than to write it in place unjournaled
+            pthread_mutex_unlock(&journal_lock);
+            perror("Error: allocate journal block\n");
+            writeDataBlock(db_index, (void *)buffer);
+            return;
+        }
+        jb->db_index = db_index;
+        jb->next = jblocks[db_index % JBLOCK_BUCKETS];
+        jblocks[db_index % JBLOCK_BUCKETS] = jb;
+        jblock_count++;
+    }
+    jb->seq = ++jblock_seq;
+    memcpy(jb->data, buffer, BLOCK_SIZE);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// drop the buffered copy of a freed block, a commit no longer writes it
+// only drop it if it still is the copy seq, or any copy when seq is 0
+static void journalDrop(int db_index, unsigned long seq)
+{
+    pthread_mutex_lock(&journal_lock);
+    struct jblock **pp = &jblocks[db_index % JBLOCK_BUCKETS];
+    while (*pp != NULL && (*pp)->db_index != db_index)
+        pp = &(*pp)->next;
+    struct jblock *jb = *pp;
+    if (jb != NULL && (seq == 0 || jb->seq == seq))
+    {
+        *pp = jb->next;
+        jblock_count--;
+        free(jb);
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+void journalForget(int db_index)
+{
+    journalDrop(db_index, 0);
+}
+
+// add every buffered block to the transaction, raid 1v checksums are taken as they go in
+static struct jcopy *journalCollect(struct txn *t, size_t *ncopies)
+{
+    pthread_mutex_lock(&journal_lock);
+    struct jcopy *copies = malloc((jblock_count + 1) * sizeof(struct jcopy));
+    size_t n = 0;
+    for (int b = 0; b < JBLOCK_BUCKETS && copies != NULL; b++)
+    {
+        for (struct jblock *jb = jblocks[b]; jb != NULL; jb = jb->next)
+        {
+            int disk = sb.raid == 0 ? db_disk(jb->db_index) : -1;
+            off_t offset = db_offset(jb->db_index);
+            // a raid 5 block is logged by index, its parity is worked out when it is written
+            if (sb.raid == 5)
+            {
+                disk = WFS_JOURNAL_BLOCK;
+                offset = jb->db_index;
+            }
+            if (txnAdd(t, disk, offset, jb->data, BLOCK_SIZE) != 0)
+                continue;
+            copies[n++] = (struct jcopy){.db_index = jb->db_index, .seq = jb->seq};
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+    if (copies == NULL)
+        perror("Error: allocate journal transaction\n");
+
+    if (sb.raid == 2)
+    {
+        for (size_t pos = sizeof(struct wfs_journal_header); pos < t->len;)
+        {
+            struct wfs_journal_record record;
+            memcpy(&record, t->buf + pos, sizeof(record));
+            pos += sizeof(record);
+            setChecksum((record.offset - sb.d_blocks_ptr) / BLOCK_SIZE, t->buf + pos);
+            pos += record.len;
+        }
+    }
+    *ncopies = n;
+    return copies;
+}
+
+// once a transaction is on disk its blocks are read from their place again,
+// and the blocks it freed can be taken
+static void journalRelease(struct jcopy *copies, size_t ncopies)
+{
+    for (size_t i = 0; i < ncopies; i++)
+        journalDrop(copies[i].db_index, copies[i].seq);
+    free(copies);
+
+    size_t dbitmap_size = sb.num_data_blocks / 8 * (sb.raid == 0 ? sb.diskNum : 1);
+    pthread_mutex_lock(&alloc_lock);
+    for (size_t j = 0; j < dbitmap_size; j++)
+    {
+        if (dbitmap_committing[j] == 0)
+            continue;
+        dbit_free += __builtin_popcount(dbitmap_committing[j] & dbitmap[j]);
+        dbitmap[j] &= ~dbitmap_committing[j];
+        dbitmap_committing[j] = 0;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// an operation out of space commits the blocks freed before it and retries once
+// return 1 if anything was freed
+int journalReclaim()
+{
+    if (sb.j_blocks == 0)
+        return 0;
+    size_t dbitmap_size = sb.num_data_blocks / 8 * (sb.raid == 0 ? sb.diskNum : 1);
+    int freeing = 0;
+    pthread_mutex_lock(&alloc_lock);
+    for (size_t j = 0; j < dbitmap_size && !freeing; j++)
+        freeing = dbitmap_freeing[j] != 0;
+    pthread_mutex_unlock(&alloc_lock);
+    return freeing && updateMetadata() == 0;
+}
+
+// whether enough is waiting in the buffer that a flush should not wait for the timer
+static int journalFull()
+{
+    pthread_mutex_lock(&journal_lock);
+    int full = jblock_count * (BLOCK_SIZE + sizeof(struct wfs_journal_record)) * 2 > (size_t)sb.j_blocks * BLOCK_SIZE;
+    pthread_mutex_unlock(&journal_lock);
+    return full;
+}
+
+// dentry cache
+// a direct-mapped table, a colliding entry simply replaces the old one
+struct dcache_entry
+{
+    int parent; // -1 when empty
+    int num;
+    char name[MAX_NAME];
+};
+
+static struct dcache_entry dcache[DCACHE_SIZE];
+// held only while an entry is copied in or out
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t name_hash(const char *name, size_t seed)
+{
+    // FNV-1a
+    size_t h = 14695981039346656037ULL ^ seed;
+    for (; *name != '\0'; name++)
+    {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void dcache_init()
+{
+    for (int i = 0; i < DCACHE_SIZE; i++)
+        dcache[i].parent = -1;
+}
+
+static struct dcache_entry *dcache_slot(int parent, const char *name)
+{
+    return &dcache[name_hash(name, parent) % DCACHE_SIZE];
+}
+
+int dcache_lookup(int parent, const char *name)
+{
+    int num = -1;
+    pthread_mutex_lock(&dcache_lock);
+    struct dcache_entry *de = dcache_slot(parent, name);
+    if (de->parent == parent && strcmp(de->name, name) == 0)
+        num = de->num;
+    pthread_mutex_unlock(&dcache_lock);
+    return num;
+}
+
+void dcache_insert(int parent, const char *name, int num)
+{
+    // names that do not fit a dentry are never matched on disk either
+    if (strlen(name) >= MAX_NAME)
+        return;
+    pthread_mutex_lock(&dcache_lock);
+    struct dcache_entry *de = dcache_slot(parent, name);
+    de->parent = parent;
+    de->num = num;
+    strcpy(de->name, name);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_invalidate(int parent, const char *name)
+{
+    pthread_mutex_lock(&dcache_lock);
+    struct dcache_entry *de = dcache_slot(parent, name);
+    if (de->parent == parent && strcmp(de->name, name) == 0)
+        de->parent = -1;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// return the num corresponding to name in this inode with inode_index file
+// return -1 if file/dir with name do not exist
+int getInodeFromName(const char *name, int inode_index)
+{
+    int num = dcache_lookup(inode_index, name);
+    if (num >= 0)
+        return num;
+
+    // find file/dir name, -1 if it is not there
+    num = lookupDentry(&inodes[inode_index], name);
+    if (num >= 0)
+        dcache_insert(inode_index, name, num);
+    return num;
+}
+
+void lockInode(int inode_index, int lock)
+{
+    if (lock == LOCK_WRITE)
+        pthread_rwlock_wrlock(&inode_locks[inode_index]);
+    else
+        pthread_rwlock_rdlock(&inode_locks[inode_index]);
+}
+
+void unlockInode(int inode_index)
+{
+    pthread_rwlock_unlock(&inode_locks[inode_index]);
+}
+
+// write entry to file
+// mode=0, file entry; mode = 1, dir entry
+// the caller holds the write lock of the directory
+// return the new inode number, -2 if the disk is not enough
+int writeToDir(int inode_index, const char *name, int m, int mode)
+{
+    // the child inode comes first, nothing is left behind if the inodes ran out
+    int num = createNewInode(name, m, mode);
+    if (num < 0)
+    {
+        perror("Error: Not enough inodes\n");
+        return -2;
+    }
+
+    struct wfs_inode inode = inodes[inode_index];
+    char entry_name[MAX_NAME];
+    strncpy(entry_name, name, MAX_NAME - 1);
+    entry_name[MAX_NAME - 1] = '\0';
+    if (addDentry(&inode, entry_name, num) != 0)
+    {
+        perror("Error: Not enough data blocks\n");
+        clear_ibit(num);
+        return -2;
+    }
+
+    // update parent inode
+    inode.size += sizeof(struct wfs_dentry);
+    if (m == 1)
+        inode.nlinks++;
+    inodes[inode_index] = inode;
+    markInodeDirty(inode_index);
+    dcache_invalidate(inode_index, name);
+    dcache_insert(inode_index, entry_name, num);
+
+    return num;
+}
+// get the empty dentry to write from inode
+// return its index in the dentry block and store the block in datablock_block_idx
+// return -1 if there is not enough space
+off_t dataToWrite_ptr(struct wfs_inode *inode, int *datablock_block_idx)
+{
+    // find the first empty dentry
+    for (int i = 0; i < N_BLOCKS; i++)
+    {
+        off_t dentry_block_idx = inode->blocks[i] - 1;
+        // create a new dentry block, it starts zeroed
+        if (inode->blocks[i] == 0)
+        {
+            int dbit;
+            if (allocDbitRun(1, &dbit, -1) != 0)
+                return -1;
+            char clear_buffer[BLOCK_SIZE];
+            memset(clear_buffer, 0, BLOCK_SIZE);
+            write_metablock_toIdx(dbit, clear_buffer);
+            inode->blocks[i] = dbit + 1;
+            *datablock_block_idx = dbit;
+            return 0;
         }
         // search for empty dentry
         struct wfs_dentry db[DENTRY_NUM];
@@ -892,44 +4082,23 @@ off_t dataToWrite_ptr(struct wfs_inode *inode, int *datablock_block_idx)
             // find a empty dentry
             if (db[j].name[0] == '\0')
             {
-                if (sb.raid == 0)
-                {
-                    *datablock_block_idx = dentry_block_idx;
-                    return j;
-                }
-                else
-                {
-                    write_ptr = sb.d_blocks_ptr + dentry_block_idx * BLOCK_SIZE + j * sizeof(struct wfs_dentry);
-                    // printf("dentry: %d, write_ptr: %zu\n", j, write_ptr);
-                    return write_ptr;
-                }
+                *datablock_block_idx = dentry_block_idx;
+                return j;
             }
         }
     }
     return -1;
-    // if (inode->size % BLOCK_SIZE == 0)
-    // {
-    //     inode->blocks[inode->size / BLOCK_SIZE] = dbit + 1;
-    //     write_ptr = sb.d_blocks_ptr + dbit * BLOCK_SIZE;
-    //     set_dbit(dbit);
-    // }
-    // else
-    // {
-    //     size_t db_index = inode->blocks[inode->size / BLOCK_SIZE] - 1;
-    //     write_ptr = sb.d_blocks_ptr + db_index * BLOCK_SIZE + inode->size % BLOCK_SIZE;
-    // }
-    // printf("write_ptr: %zu\n", write_ptr);
-    // return write_ptr;
 }
 
 // create a inode in inodes
 // m 0-file 1-dir
-// mode:权限
-int createNewInode(char *name, int m, int mode)
+// mode permission bits
+// return the new inode number, -1 if every inode is taken
+int createNewInode(const char *name, int m, int mode)
 {
     struct wfs_inode newInode;
-    size_t ibit = getIbit();
-    if (ibit < 0)
+    size_t ibit = allocIbit();
+    if (ibit == sb.num_inodes)
     {
         return -1;
     }
@@ -944,434 +4113,1199 @@ int createNewInode(char *name, int m, int mode)
     {
         newInode.mode = mode;
         newInode.nlinks = 1;
+        if (inline_files && S_ISREG(mode))
+            newInode.flags |= WFS_INLINE_DATA;
     }
     // dir inode
     else
     {
         newInode.mode = S_IFDIR | mode;
         newInode.nlinks = 2;
+        if (dir_format == DIR_HASHED)
+            newInode.flags |= WFS_DIR_HASHED;
     }
+    // nothing links to it yet, only a metadata flush can be looking at it
+    lockInode(ibit, LOCK_WRITE);
     inodes[ibit] = newInode;
-    set_ibit(ibit);
-    // printf("Inode number: %d, atim: %ld\n", inodes[ibit - 1].num, inodes[ibit - 1].atim);
+    markInodeDirty(ibit);
+    unlockInode(ibit);
+    return ibit;
+}
+
+// record metadata changes, updateMetadata only flushes what is marked here
+void markInodeDirty(int inode_index)
+{
+    // updateMetadata peeks at the flag without the inode lock
+    __atomic_store_n(&inode_dirty[inode_index], 1, __ATOMIC_RELAXED);
+}
+void markIbitDirty(size_t n)
+{
+    ibitmap_dirty[n / 8 / BLOCK_SIZE] = 1;
+}
+void markDbitDirty(size_t n)
+{
+    dbitmap_dirty[n / 8 / BLOCK_SIZE] = 1;
+}
+
+// set by a change the last flush did not see, the flusher thread looks at it
+static int flush_pending;
+static pthread_t flusher_thread;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+static int flusher_running;
+static int flusher_stop;
+
+// flush dirty metadata once METADATA_FLUSH_INTERVAL has passed since the last flush,
+// or once the blocks waiting for a journal commit would fill half the journal
+// a mount going idle is flushed by the flusher thread, fsync and destroy flush unconditionally
+// callers must not hold any inode lock, the flush read-locks the inodes it writes
+int metadataChanged()
+{
+    __atomic_store_n(&flush_pending, 1, __ATOMIC_RELAXED);
+    // only one thread takes the flush, the others go on
+    if (pthread_mutex_trylock(&flush_lock) != 0)
+        return 0;
+    int due = time(NULL) - last_flush >= METADATA_FLUSH_INTERVAL || (sb.j_blocks > 0 && journalFull());
+    pthread_mutex_unlock(&flush_lock);
+    if (!due)
+        return 0;
+    if (cache_flush() != 0)
+        return -1;
+    return updateMetadata();
+}
+
+// flush the changes left behind METADATA_FLUSH_INTERVAL after the last flush, when no
+// later operation came to do it
+static void *flusherWorker(void *arg)
+{
+    pthread_mutex_lock(&flusher_lock);
+    while (!flusher_stop)
+    {
+        time_t now = time(NULL);
+        time_t due = __atomic_load_n(&last_flush, __ATOMIC_RELAXED) + METADATA_FLUSH_INTERVAL;
+        if (due > now || !__atomic_load_n(&flush_pending, __ATOMIC_RELAXED))
+        {
+            struct timespec until = {.tv_sec = due > now ? due : now + METADATA_FLUSH_INTERVAL};
+            pthread_cond_timedwait(&flusher_wake, &flusher_lock, &until);
+            continue;
+        }
+        pthread_mutex_unlock(&flusher_lock);
+        if (cache_flush() != 0 || updateMetadata() != 0)
+        {
+            fprintf(stderr, "wfs: timed metadata flush failed, retrying\n");
+            __atomic_store_n(&flush_pending, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_lock(&flusher_lock);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+int startFlusher()
+{
+    flusher_stop = 0;
+    if (pthread_create(&flusher_thread, NULL, flusherWorker, NULL) != 0)
+        return -1;
+    flusher_running = 1;
     return 0;
 }
 
+// the flush at unmount follows, whatever is still dirty goes there
+void stopFlusher()
+{
+    pthread_mutex_lock(&flusher_lock);
+    if (!flusher_running)
+    {
+        pthread_mutex_unlock(&flusher_lock);
+        return;
+    }
+    flusher_stop = 1;
+    flusher_running = 0;
+    pthread_cond_signal(&flusher_wake);
+    pthread_mutex_unlock(&flusher_lock);
+    pthread_join(flusher_thread, NULL);
+}
+
+void beginOp()
+{
+    pthread_rwlock_rdlock(&txn_lock);
+}
+
+void endOp()
+{
+    pthread_rwlock_unlock(&txn_lock);
+}
+
 // update metadata
+// write the dirty inodes, bitmap blocks and, with a journal, dentry and table blocks
+// to every disk image, a journal commits them as one transaction
 int updateMetadata()
 {
-    // write metadata to all disk images
-    for (int i = 0; i < sb.diskNum; i++)
+    size_t ibitmap_size = sb.num_inodes / 8;
+    size_t dbitmap_size = sb.num_data_blocks / 8;
+    int journal = sb.j_blocks > 0;
+    int res = 0;
+    struct txn t;
+    txnInit(&t);
+    struct jcopy *copies = NULL;
+    size_t ncopies = 0;
+    pthread_mutex_lock(&flush_lock);
+    __atomic_store_n(&last_flush, time(NULL), __ATOMIC_RELAXED);
+    // changes finishing after this call metadataChanged and are flushed next time
+    __atomic_store_n(&flush_pending, 0, __ATOMIC_RELAXED);
+    // the copy below only sees whole operations
+    pthread_rwlock_wrlock(&txn_lock);
+
+    // file data goes to disk ahead of the metadata pointing to it
+    if (journal)
+    {
+        if (cache_flush() != 0)
+            res = -1;
+        copies = journalCollect(&t, &ncopies);
+    }
+
+    // snapshot the dirty bitmap blocks, anything dirtied after this goes in the next flush
+    size_t ibitmap_blocks = (ibitmap_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t dbitmap_blocks = (dbitmap_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint8_t ibitmap_copy[ibitmap_size];
+    uint8_t dbitmap_copy[dbitmap_size];
+    uint8_t ibitmap_flush[ibitmap_blocks];
+    uint8_t dbitmap_flush[dbitmap_blocks];
+    pthread_mutex_lock(&alloc_lock);
+    memcpy(ibitmap_copy, ibitmap, ibitmap_size);
+    memcpy(dbitmap_copy, dbitmap, dbitmap_size);
+    memcpy(ibitmap_flush, ibitmap_dirty, ibitmap_blocks);
+    memcpy(dbitmap_flush, dbitmap_dirty, dbitmap_blocks);
+    memset(ibitmap_dirty, 0, ibitmap_blocks);
+    memset(dbitmap_dirty, 0, dbitmap_blocks);
+    if (journal)
+    {
+        // blocks freed by this transaction are free on disk, and taken again once it committed
+        for (size_t j = 0; j < dbitmap_size; j++)
+            dbitmap_copy[j] &= ~dbitmap_freeing[j];
+        uint8_t *committing = dbitmap_committing;
+        dbitmap_committing = dbitmap_freeing;
+        dbitmap_freeing = committing;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+    // dirty checksum blocks, copied under csum_lock one block at a time
+    if (sb.raid == 2)
+    {
+        size_t size = checksum_size(&sb);
+        for (size_t start = 0; start < size; start += BLOCK_SIZE)
+        {
+            char block[BLOCK_SIZE];
+            pthread_mutex_lock(&csum_lock);
+            int dirty = checksum_dirty[start / BLOCK_SIZE];
+            checksum_dirty[start / BLOCK_SIZE] = 0;
+            memcpy(block, (char *)checksums + start, BLOCK_SIZE);
+            pthread_mutex_unlock(&csum_lock);
+            if (dirty && txnAdd(&t, -1, sb.c_blocks_ptr + start, block, BLOCK_SIZE) != 0)
+                res = -1;
+        }
+    }
+
+    // dirty inodes, each one padded to its own INODE_SIZE slot
+    // the flag is cleared under the inode lock, so a change made after the copy marks it again
+    for (int j = 0; j < sb.num_inodes; j++)
+    {
+        if (!__atomic_load_n(&inode_dirty[j], __ATOMIC_RELAXED))
+            continue;
+        char slot[INODE_SIZE] = {0};
+        lockInode(j, LOCK_READ);
+        __atomic_store_n(&inode_dirty[j], 0, __ATOMIC_RELAXED);
+        memcpy(slot, &inodes[j], sizeof(struct wfs_inode));
+        unlockInode(j);
+        if (txnAdd(&t, -1, sb.i_blocks_ptr + j * INODE_SIZE, slot, INODE_SIZE) != 0)
+            res = -1;
+    }
+    pthread_rwlock_unlock(&txn_lock);
+
+    // dirty inode bitmap blocks
+    for (size_t start = 0; start < ibitmap_size; start += BLOCK_SIZE)
+    {
+        if (ibitmap_flush[start / BLOCK_SIZE] &&
+            txnAdd(&t, -1, sb.i_bitmap_ptr + start, ibitmap_copy + start, MIN(BLOCK_SIZE, ibitmap_size - start)) != 0)
+            res = -1;
+    }
+
+    // dirty data bitmap blocks
+    for (size_t start = 0; start < dbitmap_size; start += BLOCK_SIZE)
+    {
+        if (!dbitmap_flush[start / BLOCK_SIZE])
+            continue;
+        size_t len = MIN(BLOCK_SIZE, dbitmap_size - start);
+        if (sb.raid != 0)
+        {
+            if (txnAdd(&t, -1, sb.d_bitmap_ptr + start, dbitmap_copy + start, len) != 0)
+                res = -1;
+            continue;
+        }
+        // every disk only keeps the bits of the blocks it stores
+        for (int i = 0; i < sb.diskNum; i++)
+        {
+            uint8_t dbitmap_to_fill[BLOCK_SIZE];
+            memset(dbitmap_to_fill, 0, len);
+            for (size_t j = start * 8; j < (start + len) * 8; j++)
+            {
+                if ((j % sb.diskNum) == i && (dbitmap_copy[j / 8] & (1 << (j % 8))))
+                {
+                    dbitmap_to_fill[j / 8 - start] |= (1 << (j % 8));
+                }
+            }
+            if (txnAdd(&t, i, sb.d_bitmap_ptr + start, dbitmap_to_fill, len) != 0)
+                res = -1;
+        }
+    }
+
+    if (journal)
+    {
+        // a transaction that could not be put together whole is not committed
+        if (res != 0 || journalCommit(&t) != 0)
+        {
+            free(copies);
+            res = -1;
+        }
+        else
+            journalRelease(copies, ncopies);
+    }
+    else if (txnApply(t.buf, t.len) != 0)
+        res = -1;
+    free(t.buf);
+    pthread_mutex_unlock(&flush_lock);
+    return res;
+}
+
+// bitmap allocator
+// bitmaps are scanned a 64-bit word at a time from a next-fit cursor
+static uint64_t bitmap_word(const uint8_t *bitmap, size_t w)
+{
+    uint64_t word;
+    memcpy(&word, bitmap + w * 8, sizeof(word));
+    return le64toh(word);
+}
+
+// mask of the valid bits in word w of a bitmap with nbits bits
+static uint64_t bitmap_valid(size_t nbits, size_t w)
+{
+    size_t left = nbits - w * 64;
+    return left >= 64 ? ~0ULL : (1ULL << left) - 1;
+}
+
+// index of the first bit equal to value at or after start, or nbits if there is none
+// words looked at by this thread's running allocator search
+static __thread size_t scan_count;
+
+size_t bitmap_next(const uint8_t *bitmap, size_t nbits, size_t start, int value)
+{
+    for (size_t w = start / 64; w * 64 < nbits; w++)
+    {
+        scan_count++;
+        uint64_t bits = bitmap_word(bitmap, w);
+        if (value == 0)
+            bits = ~bits;
+        bits &= bitmap_valid(nbits, w);
+        if (w == start / 64)
+            bits &= ~0ULL << (start % 64);
+        if (bits != 0)
+            return w * 64 + __builtin_ctzll(bits);
+    }
+    return nbits;
+}
+
+// index of the first clear bit at or after start, wrapping around, or nbits if full
+size_t bitmap_find_zero(const uint8_t *bitmap, size_t nbits, size_t start)
+{
+    if (start >= nbits)
+        start = 0;
+    scan_count = 0;
+    size_t n = bitmap_next(bitmap, nbits, start, 0);
+    if (n == nbits && start > 0)
+        n = bitmap_next(bitmap, nbits, 0, 0);
+    statsScan(scan_count);
+    return n;
+}
+
+// find a run of up to want clear bits from cursor, wrapping around
+// a run of want bits starting on a multiple of align wins, then any run of want bits, then the longest run
+// return the run length (0 if full) and its first bit in *start
+size_t bitmap_find_run(const uint8_t *bitmap, size_t nbits, size_t cursor, size_t want, size_t align, size_t *start)
+{
+    size_t best_len = 0;
+    size_t best_start = 0;
+    if (cursor >= nbits)
+        cursor = 0;
+    scan_count = 0;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        size_t pos = pass == 0 ? cursor : 0;
+        size_t end = pass == 0 ? nbits : cursor;
+        while (pos < end)
+        {
+            size_t s = bitmap_next(bitmap, nbits, pos, 0);
+            if (s >= end)
+                break;
+            size_t e = bitmap_next(bitmap, nbits, s, 1);
+
+            size_t aligned = (s + align - 1) / align * align;
+            if (aligned + want <= e)
+            {
+                statsScan(scan_count);
+                *start = aligned;
+                return want;
+            }
+            size_t len = MIN(e - s, want);
+            if (len > best_len)
+            {
+                best_len = len;
+                best_start = s;
+            }
+            pos = e;
+        }
+    }
+    statsScan(scan_count);
+    *start = best_start;
+    return best_len;
+}
+
+size_t bitmap_count_free(const uint8_t *bitmap, size_t nbits)
+{
+    size_t used = 0;
+    for (size_t w = 0; w < (nbits + 63) / 64; w++)
+        used += __builtin_popcountll(bitmap_word(bitmap, w) & bitmap_valid(nbits, w));
+    return nbits - used;
+}
+
+// get the index of the next empty ibit in ibitmap
+// getIbit, getDbit, checkDbit, set_ibit and mark_dbit expect alloc_lock held
+size_t getIbit()
+{
+    if (ibit_free == 0)
+        return sb.num_inodes;
+    return bitmap_find_zero(ibitmap, sb.num_inodes, ibit_cursor);
+}
+// check if n db can be allocated in dbitmap
+int checkDbit(int n)
+{
+    return dbit_free >= n;
+}
+
+void read_from_indirect_db(int db_idx, off_t indirect_db[])
+{
+    getDataBlockByDbindex(indirect_db, db_idx);
+}
+
+// get the index of the next empty dbit in dbitmap
+size_t getDbit()
+{
+    if (dbit_free == 0)
+        return -1; // Return -1 if no empty bit is found
+    return bitmap_find_zero(dbitmap, sb.num_data_blocks, dbit_cursor);
+}
+// find and take a free inode, return sb.num_inodes if there is none
+size_t allocIbit()
+{
+    pthread_mutex_lock(&alloc_lock);
+    size_t n = getIbit();
+    if (n != sb.num_inodes)
+        set_ibit(n);
+    pthread_mutex_unlock(&alloc_lock);
+    TRACE(TRACE_ALLOC, "alloc inode %zu", n);
+    return n;
+}
+void set_ibit(size_t n)
+{
+    size_t byte_index = n / 8;
+    size_t bit_index = n % 8;
+    if (!(ibitmap[byte_index] & (1 << bit_index)))
+        ibit_free--;
+    ibitmap[byte_index] |= (1 << bit_index);
+    ibit_cursor = n + 1;
+    markIbitDirty(n);
+}
+void clear_ibit(size_t n)
+{
+    TRACE(TRACE_ALLOC, "free inode %zu", n);
+    pthread_mutex_lock(&alloc_lock);
+    if (ibitmap[n / 8] & (1 << (n % 8)))
+        ibit_free++;
+    ibitmap[n / 8] &= ~(1 << (n % 8));
+    markIbitDirty(n);
+    pthread_mutex_unlock(&alloc_lock);
+}
+void clear_dbit(size_t n)
+{
+    TRACE(TRACE_ALLOC, "free block %zu", n);
+    // drop the cached copy first, a dirty one must not land on the block's next owner
+    cache_invalidate(n);
+    if (sb.j_blocks > 0)
+        journalForget(n);
+    pthread_mutex_lock(&alloc_lock);
+    // with a journal the block stays taken until the transaction freeing it is committed,
+    // the metadata on disk may still point to it until then
+    if (sb.j_blocks > 0)
+        dbitmap_freeing[n / 8] |= dbitmap[n / 8] & (1 << (n % 8));
+    else
+    {
+        if (dbitmap[n / 8] & (1 << (n % 8)))
+            dbit_free++;
+        dbitmap[n / 8] &= ~(1 << (n % 8));
+    }
+    markDbitDirty(n);
+    pthread_mutex_unlock(&alloc_lock);
+}
+// reserve n data blocks as few contiguous runs as possible
+// under raid 0 and 5 runs prefer to start on a stripe boundary, raid 5 then writes
+// whole stripes without reading their parity
+// the free blocks from goal on are taken first, -1 has no goal
+// return -1 without reserving anything if there is not enough space
+int allocDbitRun(int n, int *blocks, int goal)
+{
+    int res = 0;
+    pthread_mutex_lock(&alloc_lock);
+    if (!checkDbit(n))
+        res = -1;
+    size_t align = sb.raid == 0 ? sb.diskNum : sb.raid == 5 ? STRIPE_DATA : 1;
+    int k = 0;
+    if (res == 0 && goal >= 0 && (size_t)goal < sb.num_data_blocks)
+    {
+        size_t end = MIN(bitmap_next(dbitmap, sb.num_data_blocks, goal, 1), (size_t)goal + n);
+        if (end > (size_t)goal)
+            TRACE(TRACE_ALLOC, "alloc blocks %d+%zu at the goal", goal, end - goal);
+        for (size_t b = goal; b < end; b++)
+        {
+            mark_dbit(b);
+            blocks[k++] = b;
+        }
+    }
+    while (res == 0 && k < n)
     {
-        int disk_fd = open(diskimgs[i], O_WRONLY);
-        if (disk_fd < 0)
+        size_t start;
+        size_t len = bitmap_find_run(dbitmap, sb.num_data_blocks, dbit_cursor, n - k, align, &start);
+        if (len == 0)
         {
-            perror("Error opening disk image");
+            res = -1;
+            break;
+        }
+        TRACE(TRACE_ALLOC, "alloc blocks %zu+%zu", start, len);
+        for (size_t i = 0; i < len; i++)
+        {
+            mark_dbit(start + i);
+            blocks[k++] = start + i;
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return res;
+}
+// mark a data block as used without clearing it
+void mark_dbit(size_t n)
+{
+    size_t byte_index = n / 8;
+    size_t bit_index = n % 8;
+    if (!(dbitmap[byte_index] & (1 << bit_index)))
+        dbit_free--;
+    dbitmap[byte_index] |= (1 << bit_index);
+    dbit_cursor = n + 1;
+    markDbitDirty(n);
+}
+
+// read or write count data blocks starting at db_start in one transfer per disk
+// they bypass the cache, so dirty cached copies are written back before a read
+// and dropped before a write
+int readDataBlocks(void *buffer, int db_start, int count)
+{
+    for (int b = db_start; b < db_start + count; b++)
+    {
+        if (cache_writeback(b) != 0)
             return -1;
+    }
+    return transferDataBlocks(buffer, db_start, count, 0);
+}
+
+int writeDataBlocks(int db_start, int count, const void *buffer)
+{
+    for (int b = db_start; b < db_start + count; b++)
+        cache_invalidate(b);
+    return transferDataBlocks((void *)buffer, db_start, count, 1);
+}
+
+// the next len bytes of a FUSE buffer when they are in one piece of memory, NULL otherwise
+// the bytes returned are used up
+static const char *bufvecMem(struct fuse_bufvec *src, size_t len)
+{
+    if (src->idx >= src->count)
+        return NULL;
+    struct fuse_buf *buf = &src->buf[src->idx];
+    if ((buf->flags & FUSE_BUF_IS_FD) || buf->size - src->off < len)
+        return NULL;
+    const char *mem = (const char *)buf->mem + src->off;
+    src->off += len;
+    if (src->off == buf->size)
+    {
+        src->idx++;
+        src->off = 0;
+    }
+    return mem;
+}
+
+// copy a range from one disk image to another without bringing it into wfs
+static int copyDiskRange(int from, int to, off_t offset, size_t len)
+{
+    off_t in = offset;
+    off_t out = offset;
+    statsDisk(from, 0, len);
+    statsDisk(to, 1, len);
+    while (len > 0)
+    {
+        // by syscall number, glibc only declares it with _GNU_SOURCE whose LOCK_READ clashes with ours
+        ssize_t n = syscall(SYS_copy_file_range, diskfds[from], &in, diskfds[to], &out, len, 0);
+        if (n <= 0)
+            break;
+        len -= n;
+    }
+    if (len == 0)
+        return 0;
+    // without copy_file_range between the two files the rest goes through memory
+    char *buf = malloc(len);
+    int res = buf == NULL || disk_read(from, buf, len, in) != 0 || disk_write(to, buf, len, out) != 0 ? -1 : 0;
+    free(buf);
+    return res;
+}
+
+int writeDataBlocksBuf(int db_start, int count, struct fuse_bufvec *src)
+{
+    size_t len = (size_t)count * BLOCK_SIZE;
+    const char *mem = bufvecMem(src, len);
+    if (mem != NULL)
+        return writeDataBlocks(db_start, count, mem);
+    // raid 1v checksums the data and raid 5 takes its parity, it has to pass through memory
+    if (sb.raid == 2 || sb.raid == 5)
+    {
+        char *buf = malloc(len);
+        int res = buf == NULL || copyFromBufvec(buf, src, len) != 0 ? -1 : writeDataBlocks(db_start, count, buf);
+        free(buf);
+        return res;
+    }
+
+    for (int b = db_start; b < db_start + count; b++)
+        cache_invalidate(b);
+    // under raid 0 every block goes to its own disk, raid 1 fills the first mirror
+    int nbufs = sb.raid == 0 ? count : 1;
+    struct fuse_bufvec *dst = malloc(sizeof(struct fuse_bufvec) + (size_t)(nbufs - 1) * sizeof(struct fuse_buf));
+    if (dst == NULL)
+        return -1;
+    int locked = sb.raid == 1 ? mirrorWriteBegin() : 0;
+    *dst = FUSE_BUFVEC_INIT(0);
+    dst->count = nbufs;
+    for (int i = 0; i < nbufs; i++)
+    {
+        int db_idx = db_start + i;
+        int disk = sb.raid == 0 ? db_disk(db_idx) : 0;
+        // a mapped image takes the pipe with one read into the mapping: splicing into
+        // the file would still copy the data, through its write path block by block
+        if (disk_io == DISK_IO_MMAP)
+            dst->buf[i] = (struct fuse_buf){
+                .size = sb.raid == 0 ? BLOCK_SIZE : len,
+                .mem = diskmaps[disk] + db_offset(db_idx),
+            };
+        else
+            dst->buf[i] = (struct fuse_buf){
+                .size = sb.raid == 0 ? BLOCK_SIZE : len,
+                .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK,
+                .fd = diskfds[disk],
+                .pos = db_offset(db_idx),
+            };
+        statsDisk(disk, 1, dst->buf[i].size);
+    }
+    ssize_t copied = fuse_buf_copy(dst, src, 0);
+    free(dst);
+    int res = 0;
+    if (copied != (ssize_t)len)
+    {
+        perror("Error: write datablocks\n");
+        res = -1;
+    }
+    // the other mirrors copy the run from the first one inside the kernel
+    for (int i = 1; sb.raid == 1 && i < sb.diskNum && res == 0; i++)
+        res = copyDiskRange(0, i, db_offset(db_start), len);
+    mirrorWriteEnd(locked);
+    return res;
+}
+
+int transferDataBlocks(void *buffer, int db_start, int count, int write)
+{
+    TRACE(TRACE_IO, "%s blocks %d+%d", write ? "write" : "read", db_start, count);
+    char *buf = buffer;
+    struct disk_job jobs[sb.diskNum];
+    int njobs = 0;
+    // striping mode, every disk gets its share of the run as one gathered transfer
+    if (sb.raid == 0)
+    {
+        struct iovec iov[sb.diskNum][count / sb.diskNum + 1];
+        for (int d = 0; d < sb.diskNum; d++)
+        {
+            // first block of the run stored on disk d, the next ones are diskNum apart
+            int first = db_start + (d - db_start % sb.diskNum + sb.diskNum) % sb.diskNum;
+            int iovcnt = 0;
+            for (int b = first; b < db_start + count; b += sb.diskNum)
+            {
+                iov[d][iovcnt].iov_base = buf + (size_t)(b - db_start) * BLOCK_SIZE;
+                iov[d][iovcnt].iov_len = BLOCK_SIZE;
+                iovcnt++;
+            }
+            if (iovcnt == 0)
+                continue;
+            jobs[njobs++] = (struct disk_job){.disk = d, .iov = iov[d], .iovcnt = iovcnt, .offset = db_offset(first), .write = write};
         }
-
-        // write inode bitmap
-        if (pwrite(disk_fd, ibitmap, sb.num_inodes / 8, sb.i_bitmap_ptr) != sb.num_inodes / 8)
+        if (runDiskJobs(jobs, njobs) != 0)
         {
-            perror("Error writing inode bitmap\n");
-            close(disk_fd);
+            perror("Error: transfer datablocks\n");
             return -1;
         }
-        // write data bitmap
-        uint8_t *dbitmap_to_fill = malloc(sb.num_data_blocks / 8);
-        if (!dbitmap_to_fill)
+        return 0;
+    }
+    if (sb.raid == 5)
+        return stripeTransfer(buf, db_start, count, write);
+    // mirroring modes write the whole run to every disk
+    if (write)
+    {
+        if (sb.raid == 2)
         {
-            perror("Error allocating memory for dbitmap_to_fill\n");
-            close(disk_fd);
-            return -1;
+            for (int b = 0; b < count; b++)
+                setChecksum(db_start + b, buf + (size_t)b * BLOCK_SIZE);
         }
-
-        if (sb.raid == 0)
+        struct iovec iov = {.iov_base = buf, .iov_len = (size_t)count * BLOCK_SIZE};
+        for (int i = 0; i < sb.diskNum; i++)
+            jobs[njobs++] = (struct disk_job){.disk = i, .iov = &iov, .iovcnt = 1, .offset = db_offset(db_start), .write = 1};
+        int locked = mirrorWriteBegin();
+        int res = runDiskJobs(jobs, njobs);
+        mirrorWriteEnd(locked);
+        if (res != 0)
+            perror("Error: write datablocks\n");
+        return res;
+    }
+    // mirroring modes read a small run from one mirror and split a large one across all of them
+    // raid 1v then checks every block and recovers the ones failing their checksum
+    if ((size_t)count * BLOCK_SIZE < PARALLEL_IO_MIN)
+    {
+        if (disk_read(readMirror(), buf, (size_t)count * BLOCK_SIZE, db_offset(db_start)) != 0)
         {
-            memset(dbitmap_to_fill, 0, sb.num_data_blocks / 8); // Initialize dbitmap_to_fill with 0
-
-            for (int j = 0; j < sb.num_data_blocks; j++)
-            {
-                if ((j % sb.diskNum) == i)
-                {
-                    int byte_index = j / 8;
-                    int bit_index = j % 8;
-                    if (dbitmap[byte_index] & (1 << bit_index))
-                    {
-                        dbitmap_to_fill[byte_index] |= (1 << bit_index);
-                    }
-                }
-            }
+            perror("Error: read datablocks\n");
+            return -1;
         }
-        else
+    }
+    else
+    {
+        struct iovec iov[sb.diskNum];
+        int mirrors = sb.diskNum - (__atomic_load_n(&rebuild_disk, __ATOMIC_ACQUIRE) >= 0);
+        int chunk = (count + mirrors - 1) / mirrors;
+        int disk = readMirror();
+        for (int b = 0; b < count; b += chunk)
         {
-            memcpy(dbitmap_to_fill, dbitmap, sb.num_data_blocks / 8);
+            int n = MIN(chunk, count - b);
+            iov[njobs].iov_base = buf + (size_t)b * BLOCK_SIZE;
+            iov[njobs].iov_len = (size_t)n * BLOCK_SIZE;
+            jobs[njobs] = (struct disk_job){.disk = disk, .iov = &iov[njobs], .iovcnt = 1, .offset = db_offset(db_start + b)};
+            disk = nextMirror(disk);
+            njobs++;
         }
-
-        if (pwrite(disk_fd, dbitmap_to_fill, sb.num_data_blocks / 8, sb.d_bitmap_ptr) != sb.num_data_blocks / 8)
+        if (runDiskJobs(jobs, njobs) != 0)
         {
-            perror("Error writing data bitmap\n");
-            free(dbitmap_to_fill);
-            close(disk_fd);
+            perror("Error: read datablocks\n");
             return -1;
         }
-
-        free(dbitmap_to_fill);
-
-        // // write data bitmap
-        // uint8_t *dbitmap_to_fill = malloc(sb.num_data_blocks / 8);
-        // if (sb.raid == 0)
-        // {
-        // }
-        // else
-        // {
-        //     memcpy(dbitmap_to_fill, dbitmap, sb.num_data_blocks / 8);
-        // }
-        // if (pwrite(disk_fd, dbitmap_to_fill, sb.num_data_blocks / 8, sb.d_bitmap_ptr) != sb.num_data_blocks / 8)
-        // {
-        //     perror("Error writing data bitmap\n");
-        //     close(disk_fd);
-        //     return -1;
-        // }
-
-        // write inodes
-        for (int j = 0; j < sb.num_inodes; j++)
-        {
-            off_t offset = sb.i_blocks_ptr + j * 512; // 每个 inode 写入第 j 个 512B 块
-            if (pwrite(disk_fd, &inodes[j], INODE_SIZE, offset) != INODE_SIZE)
-            {
-                perror("Error writing inode");
-                close(disk_fd);
+    }
+    if (sb.raid == 2)
+    {
+        for (int b = 0; b < count; b++)
+        {
+            char *block = buf + (size_t)b * BLOCK_SIZE;
+            if (!checksumMatches(db_start + b, block) && recoverBlock(block, db_start + b) != 0)
                 return -1;
-            }
         }
-
-        close(disk_fd); // 关闭当前磁盘映像文件
     }
-
     return 0;
 }
 
-// 修改后的函数
-void print_non_empty_entries(int disk_index)
+// Write data back to file
+// the block stays dirty in the cache until it is evicted or flushed
+int write_datablock_toIdx(int db_idx, void *buf)
 {
-    // printf("Debug: Entering print_non_empty_entries\n");
+    if (cache.capacity == 0)
+        return writeDataBlock(db_idx, buf);
 
-    // 打开文件
-    int fd = open(diskimgs[disk_index], O_RDONLY);
-    if (fd < 0)
+    int claimed;
+    pthread_mutex_lock(&cache_lock);
+    struct cache_block *cb = cache_find(db_idx, 1, &claimed);
+    if (cb == NULL)
     {
-        perror("Error opening disk file");
-        return;
+        // with every slot held or stuck dirty the block is written through
+        pthread_mutex_unlock(&cache_lock);
+        return writeDataBlock(db_idx, buf);
     }
+    cache_touch(cb);
+    memcpy(cb->data, buf, BLOCK_SIZE);
+    cb->dirty = 1;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
 
-    // printf("Debug: Disk file '%s' opened successfully\n", diskimgs[disk_index]);
+// dentry and table blocks are metadata, with a journal they are written in place only
+// once the transaction changing them has committed
+int write_metablock_toIdx(int db_idx, void *buf)
+{
+    if (sb.j_blocks == 0)
+        return write_datablock_toIdx(db_idx, buf);
+    cache_invalidate(db_idx);
+    journalWrite(db_idx, buf);
+    return 0;
+}
 
-    for (size_t block = 0; block < getDbit(); ++block)
+// write a datablock to the disks, bypassing the cache
+int writeDataBlock(int db_idx, void *buf)
+{
+    // striping mode
+    if (sb.raid == 0)
     {
-        // 检查数据块是否已分配
-        if (!(dbitmap[block / 8] & (1 << (block % 8))))
+        if (disk_write(db_disk(db_idx), buf, BLOCK_SIZE, db_offset(db_idx)) != 0)
         {
-            continue;
+            perror("Error writing dentry\n");
+            return -1;
         }
+        return 0;
+    }
+    if (sb.raid == 5)
+        return stripeWrite(db_idx, buf, 0);
+    // mirroring modes write every disk
+    if (sb.raid == 2)
+        setChecksum(db_idx, buf);
+    int res = 0;
+    int locked = mirrorWriteBegin();
+    for (int i = 0; i < sb.diskNum && res == 0; i++)
+    {
+        res = disk_write(i, buf, BLOCK_SIZE, db_offset(db_idx));
+        if (res != 0)
+            perror("Error writing dentry\n");
+    }
+    mirrorWriteEnd(locked);
+    return res;
+}
 
-        // printf("Debug: Accessing block %zu\n", block);
+// mirror rebuild
+// a raid 1 or 1v set mounted with --rebuild=image in place of a lost disk copies the
+// metadata to the image at mount, then a thread copies the allocated data blocks in
+// runs while operations go on, the image serves no reads until it is complete
+// writes reach it all along, rebuild_lock keeps a run's copy from interleaving with them
+static pthread_rwlock_t rebuild_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t rebuild_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rebuild_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t rebuild_thread;
+static int rebuild_running;
+static int rebuild_stop;
+static int rebuild_target = -1; // stays set once the rebuild is over, for the report
+static int rebuild_failed;      // given up, the image stays write-only until the next --rebuild
+static size_t rebuild_cursor;   // data blocks before it are copied
+static size_t rebuild_copied;
+static uint64_t rebuild_start;
 
-        // 计算数据块的偏移量
-        off_t block_offset = sb.d_blocks_ptr + block * BLOCK_SIZE;
-        if (lseek(fd, block_offset, SEEK_SET) < 0)
-        {
-            perror("Error seeking to block");
-            close(fd);
-            return;
-        }
-        // printf("block_offset: %jd\n", (intmax_t)block_offset);
+int mirrorWriteBegin()
+{
+    if (__atomic_load_n(&rebuild_disk, __ATOMIC_ACQUIRE) < 0)
+        return 0;
+    pthread_rwlock_rdlock(&rebuild_lock);
+    return 1;
+}
 
-        // 读取数据块内容
-        struct wfs_dentry entries[BLOCK_SIZE / sizeof(struct wfs_dentry)];
-        ssize_t bytes_read = read(fd, entries, sizeof(entries));
-        if (bytes_read < 0)
-        {
-            perror("Error reading block data");
-            close(fd);
-            return;
-        }
+void mirrorWriteEnd(int locked)
+{
+    if (locked)
+        pthread_rwlock_unlock(&rebuild_lock);
+}
 
-        // 遍历数据块中的目录项
-        for (int i = 0; i < BLOCK_SIZE / sizeof(struct wfs_dentry); ++i)
-        {
-            if (entries[i].name[0] != '\0')
-            {
-                printf("Name: %s, Num: %d, Index: %d, Block:%zu\n", entries[i].name, entries[i].num, i, block);
-            }
-        }
+// the mirror was mounted missing, so the journal was replayed without it
+// copy everything but the data blocks from another mirror, the superblock goes last,
+// so an image whose rebuild did not finish is never taken for a member of the set
+int rebuildInit()
+{
+    int target = missing_disk;
+    int from = (target + 1) % sb.diskNum;
+    if (disksizes[target] < disksizes[from])
+    {
+        fprintf(stderr, "Error: %s is smaller than the disks it mirrors\n", diskimgs[target]);
+        return -1;
     }
+    missing_disk = -1;
+    struct wfs_sb blank;
+    memset(&blank, 0, sizeof(blank));
+    off_t tail = sb.d_blocks_ptr + data_size(&sb);
+    if (disk_write(target, &blank, sizeof(blank), 0) != 0 ||
+        copyDiskRange(from, target, sizeof(struct wfs_sb), sb.d_blocks_ptr - sizeof(struct wfs_sb)) != 0 ||
+        copyDiskRange(from, target, tail, disksizes[from] - tail) != 0 ||
+        syncDiskRange(target, 0, disksizes[target]) != 0)
+    {
+        perror("Error: copying metadata to the rebuilt disk\n");
+        return -1;
+    }
+    rebuild_target = target;
+    __atomic_store_n(&rebuild_disk, target, __ATOMIC_RELEASE);
+    fprintf(stderr, "wfs: rebuilding disk %d of %d on %s\n", target + 1, sb.diskNum, diskimgs[target]);
+    return 0;
+}
 
-    close(fd); // 关闭文件
-    // printf("Debug: Exiting print_non_empty_entries\n");
+// sleep until ns have passed or the rebuild is stopped
+static void rebuildWait(uint64_t ns)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += (until.tv_nsec + ns) / 1000000000;
+    until.tv_nsec = (until.tv_nsec + ns) % 1000000000;
+    pthread_mutex_lock(&rebuild_mutex);
+    while (!rebuild_stop && pthread_cond_timedwait(&rebuild_wake, &rebuild_mutex, &until) == 0)
+        ;
+    pthread_mutex_unlock(&rebuild_mutex);
 }
-// get the index of first empty ibit in ibitmap
-size_t getIbit()
+
+// the new mirror holds every block, flush the metadata that may still point to blocks
+// freed in memory, then write its superblock and let it serve reads
+static int rebuildFinish(int target)
 {
-    for (size_t i = 0; i < sb.num_inodes; i++)
-    {
-        if (!(ibitmap[i / 8] & (1 << (i % 8))))
-        {
-            return i; // Return the index of the first empty bit
-        }
-    }
-    return sb.num_inodes; // Return -1 if no empty bit is found
+    struct wfs_sb disk_sb = sb;
+    disk_sb.diskIndex = target;
+    if (updateMetadata() != 0 || syncDiskRange(target, 0, disksizes[target]) != 0 ||
+        disk_write(target, &disk_sb, sizeof(disk_sb), 0) != 0 || syncDiskRange(target, 0, sizeof(disk_sb)) != 0)
+        return -1;
+    __atomic_store_n(&rebuild_disk, -1, __ATOMIC_RELEASE);
+    fprintf(stderr, "wfs: disk %d rebuilt, %zu blocks copied in %ju ms\n", target + 1, rebuild_copied,
+            (uintmax_t)((statsClock() - rebuild_start) / 1000000));
+    return 0;
 }
-// check if n db can be allocated in dbitmap
-int checkDbit(int n)
+
+// a step of the rebuild failed for the failures-th time in a row, wait before it is tried
+// again, or give the rebuild up once REBUILD_RETRIES is reached
+// returns 0 to try again
+static int rebuildRetry(int failures, const char *what)
 {
-    int count = 0; // 计数器，用于跟踪可用的空位数量
-    for (size_t i = 0; i < sb.num_data_blocks; i++)
+    if (failures > REBUILD_RETRIES)
     {
-        if (!(dbitmap[i / 8] & (1 << (i % 8))))
-        {
-            count++;        // 找到一个空位，计数加一
-            if (count >= n) // 如果找到了足够的空位
-            {
-                return 1; // 返回1表示可以分配n个位置
-            }
-        }
+        fprintf(stderr, "wfs: rebuild of disk %d failed %s %d times, giving up\n", rebuild_target + 1, what, failures);
+        __atomic_store_n(&rebuild_failed, 1, __ATOMIC_RELAXED);
+        return -1;
     }
-    return 0; // 返回0表示没有足够的空位
+    uint64_t ms = (uint64_t)REBUILD_RETRY_MS << (failures - 1);
+    fprintf(stderr, "wfs: rebuild of disk %d failed %s, retrying in %ju ms\n", rebuild_target + 1, what, (uintmax_t)ms);
+    rebuildWait(ms * 1000000);
+    return 0;
 }
 
-void read_from_indirect_db(int db_idx, off_t indirect_db[])
+// copy the runs of allocated blocks in order, each one from the next healthy mirror
+// a run that failed is tried again from the next mirror, see rebuildRetry
+// a run that saw operations complete is held to rebuild_rate, an idle set is copied
+// as fast as the disks go
+static void *rebuildWorker(void *arg)
 {
-    // TODO: raid0
-    if (sb.raid == 0)
+    int target = rebuild_target;
+    int from = nextMirror(target);
+    size_t max_run = MAX(REBUILD_CHUNK / BLOCK_SIZE, 1);
+    uint64_t calls = statsCalls();
+    int failures = 0;
+    rebuild_start = statsClock();
+    while (!__atomic_load_n(&rebuild_stop, __ATOMIC_RELAXED))
     {
-        FILE *diskimg = fopen(diskimgs[db_idx % sb.diskNum], "rb"); // 打开对应的文件
-        if (diskimg == NULL)
+        pthread_mutex_lock(&alloc_lock);
+        size_t start = bitmap_next(dbitmap, sb.num_data_blocks, rebuild_cursor, 1);
+        size_t end = bitmap_next(dbitmap, sb.num_data_blocks, start, 0);
+        pthread_mutex_unlock(&alloc_lock);
+        if (start >= sb.num_data_blocks)
         {
-            perror("Failed to open disk image");
-            return;
+            if (rebuildFinish(target) == 0 || rebuildRetry(++failures, "writing its superblock") != 0)
+                break;
+            continue;
         }
+        end = MIN(end, start + max_run);
 
-        // 计算数据块的起始位置
-        off_t db_ptr = sb.d_blocks_ptr + (db_idx / sb.diskNum) * BLOCK_SIZE; // 每个块512字节
-        fseek(diskimg, db_ptr, SEEK_SET);                                    // 移动到数据块的开始位置
+        uint64_t run_start = statsClock();
+        pthread_rwlock_wrlock(&rebuild_lock);
+        int res = copyDiskRange(from, target, db_offset(start), (end - start) * BLOCK_SIZE);
+        pthread_rwlock_unlock(&rebuild_lock);
+        if (res != 0)
+        {
+            char what[64];
+            snprintf(what, sizeof(what), "copying blocks %zu+%zu from disk %d", start, end - start, from + 1);
+            from = nextMirror(from);
+            if (rebuildRetry(++failures, what) != 0)
+                break;
+            continue;
+        }
+        failures = 0;
+        TRACE(TRACE_IO, "rebuild blocks %zu+%zu from disk %d", start, end - start, from + 1);
+        __atomic_store_n(&rebuild_copied, rebuild_copied + (end - start), __ATOMIC_RELAXED);
+        __atomic_store_n(&rebuild_cursor, end, __ATOMIC_RELAXED);
+        from = nextMirror(from);
 
-        // 读取数据块到indirect_db数组
-        fread(indirect_db, sizeof(off_t), BLOCK_SIZE / sizeof(off_t), diskimg);
+        uint64_t now_calls = statsCalls();
+        if (rebuild_rate > 0 && now_calls != calls)
+        {
+            uint64_t want = (uint64_t)(end - start) * BLOCK_SIZE * 1000000000 / ((uint64_t)rebuild_rate << 20);
+            uint64_t took = statsClock() - run_start;
+            if (want > took)
+                rebuildWait(want - took);
+        }
+        calls = now_calls;
+    }
+    return NULL;
+}
 
-        // 清空数据块
-        fseek(diskimg, db_ptr, SEEK_SET);                // 再次移动到数据块的开始位置
-        char zero_buffer[512] = {0};                     // 创建一个全为零的冲区
-        fwrite(zero_buffer, sizeof(char), 512, diskimg); // 写入零以清空数据块
+int startRebuild()
+{
+    if (rebuild_target < 0 || __atomic_load_n(&rebuild_disk, __ATOMIC_ACQUIRE) < 0)
+        return 0;
+    rebuild_stop = 0;
+    if (pthread_create(&rebuild_thread, NULL, rebuildWorker, NULL) != 0)
+        return -1;
+    rebuild_running = 1;
+    return 0;
+}
 
-        fclose(diskimg); // 关闭文件
+// an unmount in the middle leaves the image without a superblock, to be rebuilt again
+void stopRebuild()
+{
+    if (!rebuild_running)
         return;
-    }
-    else if (sb.raid == 1)
-    {
-        FILE *diskimg = fopen(diskimgs[0], "rb"); // 打开对应的文件
-        if (diskimg == NULL)
-        {
-            perror("Failed to open disk image");
-            return;
-        }
+    pthread_mutex_lock(&rebuild_mutex);
+    __atomic_store_n(&rebuild_stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&rebuild_wake);
+    pthread_mutex_unlock(&rebuild_mutex);
+    pthread_join(rebuild_thread, NULL);
+    rebuild_running = 0;
+    if (__atomic_load_n(&rebuild_disk, __ATOMIC_ACQUIRE) >= 0)
+        fprintf(stderr, "wfs: rebuild of disk %d stopped at block %zu of %zu, mount with --rebuild again to finish it\n",
+                rebuild_target + 1, rebuild_cursor, sb.num_data_blocks);
+}
 
-        // 计算数据块的起始位置
-        off_t db_ptr = sb.d_blocks_ptr + db_idx * BLOCK_SIZE; // 每个块512字节
-        fseek(diskimg, db_ptr, SEEK_SET);                     // 移动到数据块的开始位置
+int rebuild_stats_format(char *buf, size_t size)
+{
+    if (rebuild_target < 0)
+        return 0;
+    size_t copied = __atomic_load_n(&rebuild_copied, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&rebuild_disk, __ATOMIC_ACQUIRE) < 0)
+        return snprintf(buf, size, "rebuild: disk %d complete, %zu blocks copied\n", rebuild_target + 1, copied);
+    return snprintf(buf, size, "rebuild: disk %d %s at block %zu of %zu, %zu blocks copied\n", rebuild_target + 1,
+                    __atomic_load_n(&rebuild_failed, __ATOMIC_RELAXED) ? "failed" : "running",
+                    (size_t)__atomic_load_n(&rebuild_cursor, __ATOMIC_RELAXED), (size_t)sb.num_data_blocks, copied);
+}
 
-        // 读取数据块到indirect_db数组
-        fread(indirect_db, sizeof(off_t), BLOCK_SIZE / sizeof(off_t), diskimg);
+// readahead
+// a read going on from where the last one on the same open file stopped queues the blocks
+// after it, and a thread brings them in while the reader is busy with what it got
+// reads wfs answers with ranges of the disk image files have the kernel read those ranges
+// ahead, reads through memory find the blocks in the block cache
+struct ra_request
+{
+    int num;
+    int first; // file blocks first..first + count - 1
+    int count;
+    int mirror; // raid 1 mirror the reads come from
+};
 
-        // 清空数据块
-        fseek(diskimg, db_ptr, SEEK_SET);                // 再次移动到数据块的开始位置
-        char zero_buffer[512] = {0};                     // 创建一个全为零的冲区
-        fwrite(zero_buffer, sizeof(char), 512, diskimg); // 写入零以清空数据块
+static struct ra_request ra_queue[READAHEAD_QUEUE];
+static size_t ra_head; // requests from ra_head up to ra_tail are waiting
+static size_t ra_tail;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t ra_thread;
+static int ra_running;
+static int ra_stop;
+static size_t ra_requests; // queued
+static size_t ra_blocks;   // found mapped by the thread
+static size_t ra_dropped;
 
-        fclose(diskimg); // 关闭文件
+void readaheadQueue(int inode_index, int first, int count, int mirror)
+{
+    pthread_mutex_lock(&ra_lock);
+    if (!ra_running || ra_tail - ra_head == READAHEAD_QUEUE)
+        ra_dropped++;
+    else
+    {
+        ra_queue[ra_tail++ % READAHEAD_QUEUE] = (struct ra_request){inode_index, first, count, mirror};
+        ra_requests++;
+        pthread_cond_signal(&ra_wake);
     }
-    return;
+    pthread_mutex_unlock(&ra_lock);
 }
 
-// get the index of first empty dbit in dbitmap
-size_t getDbit()
+// ask the kernel to read a run of data blocks from the disks holding them
+static void diskReadahead(int db_start, int count, int mirror)
 {
-    for (size_t i = 0; i < sb.num_data_blocks; i++)
+    off_t start[MAX_DISKS];
+    off_t end[MAX_DISKS];
+    for (int d = 0; d < sb.diskNum; d++)
+        start[d] = end[d] = 0;
+    // a disk's share of a striped run is one range of it, parity blocks included
+    for (int b = db_start; b < db_start + count; b++)
     {
-        if (!(dbitmap[i / 8] & (1 << (i % 8))))
-        {
-            return i; // Return the index of the first empty bit
-        }
+        int disk = sb.raid == 1 ? mirror : db_disk(b);
+        off_t pos = db_offset(b);
+        if (end[disk] == 0 || pos < start[disk])
+            start[disk] = pos;
+        end[disk] = MAX(end[disk], pos + BLOCK_SIZE);
+    }
+    for (int d = 0; d < sb.diskNum; d++)
+    {
+        if (end[d] > 0)
+            posix_fadvise(diskfds[d], start[d], end[d] - start[d], POSIX_FADV_WILLNEED);
     }
-    return -1; // Return -1 if no empty bit is found
-}
-void set_ibit(size_t n)
-{
-    size_t byte_index = n / 8;
-    size_t bit_index = n % 8;
-    ibitmap[byte_index] |= (1 << bit_index);
 }
-void set_dbit(size_t n)
-{
-    size_t byte_index = n / 8;
-    size_t bit_index = n % 8;
-    dbitmap[byte_index] |= (1 << bit_index);
 
-    // 新增：当第 i 位 dbit 被设置为 1 ，打开对应的 diskimgs[i] 并清空相应区域
-    if (sb.raid == 0)
+// the file is read-locked while its blocks are read, so none of them is written meanwhile
+static void readaheadRun(struct ra_request *rq)
+{
+    lockInode(rq->num, LOCK_READ);
+    struct wfs_inode *inode = &inodes[rq->num];
+    // the file may have been removed since, an inode without links or lookups has no blocks
+    int gone = inode->nlinks == 0 && __atomic_load_n(&lookups[rq->num], __ATOMIC_RELAXED) == 0;
+    if (gone || !S_ISREG(inode->mode) || (inode->flags & WFS_INLINE_DATA))
     {
-        int fd = open(diskimgs[n % sb.diskNum], O_RDWR);
-        if (fd < 0)
-        {
-            perror("Error opening disk image\n");
-            return;
-        }
-        // // // 清空从指针 sb.d_blocks_ptr + BLOCK_SIZE * i 开始的区域
-        // off_t clear_ptr = sb.d_blocks_ptr + BLOCK_SIZE * (n % sb.diskNum + 1);
-        // char clear_buffer[BLOCK_SIZE] = {0}; // Create a buffer filled with zeros
-        // if (pwrite(fd, clear_buffer, sizeof(clear_buffer), clear_ptr) != sizeof(clear_buffer))
-        // {
-        //     perror("Error clearing block\n");
-        // }
-
-        close(fd); // Close the disk image
+        unlockInode(rq->num);
+        return;
     }
-    else
+    int end = MIN(rq->first + rq->count, (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    struct block_map map;
+    if (mapInit(&map, inode) != 0)
+    {
+        unlockInode(rq->num);
+        return;
+    }
+    // the same reads wfs_read_buf hands the kernel as file ranges
+    int in_place = sb.raid != 2 && missing_disk < 0;
+    for (int b = rq->first; b < end;)
     {
-        if (dbitmap[byte_index] & (1 << bit_index)) // Check if the bit was just set
+        off_t db_idx = mapDataBlock(&map, b);
+        if (db_idx < 0)
         {
-            int i = n;                           // Use n directly as the index
-            for (int j = 0; j < sb.diskNum; j++) // Ensure i is within bounds
-            {
-                int fd = open(diskimgs[j], O_RDWR);
-                if (fd < 0)
-                {
-                    perror("Error opening disk image\n");
-                    return;
-                }
-
-                // 清空从指针 sb.d_blocks_ptr + BLOCK_SIZE * i 开始的区域
-                off_t clear_ptr = sb.d_blocks_ptr + BLOCK_SIZE * i;
-                char clear_buffer[BLOCK_SIZE] = {0}; // Create a buffer filled with zeros
-                if (pwrite(fd, clear_buffer, sizeof(clear_buffer), clear_ptr) != sizeof(clear_buffer))
-                {
-                    perror("Error clearing block\n");
-                }
-
-                close(fd); // Close the disk image
-            }
+            b++;
+            continue;
         }
+        int run = 1;
+        while (b + run < end && mapDataBlock(&map, b + run) == db_idx + run)
+            run++;
+        TRACE(TRACE_IO, "readahead inode %d blocks %d+%d", rq->num, b, run);
+        if (in_place)
+            diskReadahead(db_idx, run, rq->mirror);
+        else
+            cache_prefetch(db_idx, run);
+        __atomic_fetch_add(&ra_blocks, run, __ATOMIC_RELAXED);
+        b += run;
     }
+    mapFree(&map);
+    unlockInode(rq->num);
 }
 
-// Write data back to file
-int write_datablock_toIdx(int db_idx, void *buf)
+static void *readaheadWorker(void *arg)
 {
-    // TODO: raid0
-    if (sb.raid == 0)
+    pthread_mutex_lock(&ra_lock);
+    while (1)
     {
-        int fd = open(diskimgs[db_idx % sb.diskNum], O_RDWR);
-        if (fd == -1)
-        {
-            perror("Error opening disk image\n");
-            return -1;
-        }
-        off_t db_block_ptr = sb.d_blocks_ptr + (db_idx / sb.diskNum) * BLOCK_SIZE;
-        printf("write_data_block: db_block_ptr: %zu, db_idx: %d\n", db_block_ptr, db_idx);
-        if (pwrite(fd, buf, BLOCK_SIZE, db_block_ptr) != BLOCK_SIZE)
-        {
-            perror("Error writing dentry\n");
-            close(fd);
-            return -1;
-        }
-        close(fd);
-        // printf("disk: %s have been written datablock, idx: %d\n content %s\n", diskimgs[db_idx % sb.diskNum], db_idx, (char *)buf);
-        return 0;
+        while (ra_head == ra_tail && !ra_stop)
+            pthread_cond_wait(&ra_wake, &ra_lock);
+        if (ra_stop)
+            break;
+        struct ra_request rq = ra_queue[ra_head++ % READAHEAD_QUEUE];
+        pthread_mutex_unlock(&ra_lock);
+        readaheadRun(&rq);
+        pthread_mutex_lock(&ra_lock);
     }
-    else
-    {
-        for (int i = 0; i < sb.diskNum; i++)
-        {
-            int fd = open(diskimgs[i], O_RDWR);
-            if (fd == -1)
-            {
-                perror("Error opening disk image\n");
-                return -1;
-            }
-            off_t db_block_ptr = sb.d_blocks_ptr + db_idx * BLOCK_SIZE;
-            // write the new datablock
-            if (pwrite(fd, buf, BLOCK_SIZE, db_block_ptr) != BLOCK_SIZE)
-            {
-                perror("Error writing dentry\n");
-                close(fd);
-                return -1;
-            }
+    pthread_mutex_unlock(&ra_lock);
+    return NULL;
+}
 
-            close(fd);
-            fd = -1;
-        }
+int startReadahead()
+{
+    if (readahead_blocks <= 0)
         return 0;
+    ra_stop = 0;
+    if (pthread_create(&ra_thread, NULL, readaheadWorker, NULL) != 0)
+        return -1;
+    ra_running = 1;
+    return 0;
+}
+
+// prefetches still waiting are dropped, they were only hints
+void stopReadahead()
+{
+    pthread_mutex_lock(&ra_lock);
+    if (!ra_running)
+    {
+        pthread_mutex_unlock(&ra_lock);
+        return;
     }
+    ra_stop = 1;
+    ra_running = 0;
+    pthread_cond_signal(&ra_wake);
+    pthread_mutex_unlock(&ra_lock);
+    pthread_join(ra_thread, NULL);
 }
 
-void free_inode_from_parent(const char *path, int inode_index)
+int readahead_stats_format(char *buf, size_t size)
 {
-    // free its parent thing
-    char name[MAX_NAME + 2];
-    int parent_inode_idx = parsePath(path, 2, name);
-    inodes[parent_inode_idx].nlinks--;
-    inodes[parent_inode_idx].size -= sizeof(struct wfs_dentry);
+    pthread_mutex_lock(&ra_lock);
+    int len = snprintf(buf, size, "readahead: %d blocks ahead, %zu prefetches, %zu blocks, %zu dropped\n", readahead_blocks,
+                       ra_requests, (size_t)__atomic_load_n(&ra_blocks, __ATOMIC_RELAXED), ra_dropped);
+    pthread_mutex_unlock(&ra_lock);
+    return len;
+}
 
-    // free its inode
-    ibitmap[inode_index / 8] &= ~(1 << inode_index % 8);
+void readahead_stats_reset()
+{
+    pthread_mutex_lock(&ra_lock);
+    ra_requests = 0;
+    __atomic_store_n(&ra_blocks, 0, __ATOMIC_RELAXED);
+    ra_dropped = 0;
+    pthread_mutex_unlock(&ra_lock);
+}
 
-    // find the dentry
-    for (int i = 0; i < N_BLOCKS; i++)
-    {
-        off_t dentry_block_idx = inodes[parent_inode_idx].blocks[i] - 1;
-        if (dentry_block_idx == -1)
-            break;
-        struct wfs_dentry db[DENTRY_NUM];
-        getDataBlockByDbindex(db, dentry_block_idx);
-        for (int j = 0; j < DENTRY_NUM; j++)
-        {
-            if (strcmp(db[j].name, name) == 0)
-            {
-                memset(&db[j], 0, sizeof(struct wfs_dentry));
+// remove the entry name of inode_index from its parent
+// the caller holds the write locks of both
+void free_inode_from_parent(int parent_inode_idx, const char *name, int inode_index)
+{
+    // free its parent thing, only a directory's .. links to the parent
+    if (S_ISDIR(inodes[inode_index].mode))
+        inodes[parent_inode_idx].nlinks--;
+    inodes[parent_inode_idx].size -= sizeof(struct wfs_dentry);
+    markInodeDirty(parent_inode_idx);
+    dcache_invalidate(parent_inode_idx, name);
+    removeDentry(&inodes[parent_inode_idx], name);
 
-                // // 输出 db[j] 从 0 到 DENTRY_NUM - 1 的所有 name 和 num
-                // for (int k = 0; k < DENTRY_NUM; k++)
-                // {
-                //     printf("db[%d]: name = %s, num = %d\n", k, db[k].name, db[k].num);
-                // }
+    // free its inode, unless the kernel still holds it, then the last forget does
+    inodes[inode_index].nlinks = 0;
+    markInodeDirty(inode_index);
+    if (__atomic_load_n(&lookups[inode_index], __ATOMIC_RELAXED) > 0)
+        inodes[inode_index].flags |= WFS_ORPHAN;
+    else
+        releaseInode(inode_index);
+}
 
-                write_datablock_toIdx(dentry_block_idx, (void *)db);
-                updateMetadata();
-                break;
-            }
-        }
-    }
+// give an unlinked inode back with its blocks, the caller holds its write lock
+// linear directories keep their dentry blocks
+void releaseInode(int inode_index)
+{
+    struct wfs_inode *inode = &inodes[inode_index];
+    if (!S_ISDIR(inode->mode) || (inode->flags & WFS_DIR_HASHED))
+        freeInodeBlocks(inode);
+    inode->flags &= ~WFS_ORPHAN;
+    markInodeDirty(inode_index);
+    clear_ibit(inode_index);
 }
 
-// New function to print all data blocks for a given inode
-void print_data_blocks(int inode_index)
+// free the inodes left unlinked while the kernel held them, at unmount FUSE forgets every
+// inode without telling wfs and a crash may leave them behind too
+void reclaimOrphans()
 {
-    struct wfs_inode inode = inodes[inode_index];
-    for (int i = 0; i < N_BLOCKS; i++)
+    for (size_t i = 0; i < sb.num_inodes; i++)
     {
-        int db_index = inode.blocks[i] - 1;
-        if (db_index == -1)
-            break; // No more data blocks
-
-        char block[BLOCK_SIZE];
-        getDataBlockByDbindex((void *)block, db_index);
-
-        // printf("Block %d: ", db_index);
-        // for (size_t j = 0; j < BLOCK_SIZE; j++)
-        // {
-        //     printf("%02x ", (unsigned char)block[j]);
-        // }
-        // printf("\n");
+        if ((ibitmap[i / 8] & (1 << (i % 8))) && (inodes[i].flags & WFS_ORPHAN))
+            releaseInode(i);
     }
 }
 
@@ -1380,16 +5314,13 @@ int main(int argc, char *argv[])
     // parse arguments
     if (argc < 3)
     {
-        fprintf(stderr, "Usage: %s disk1 disk2 [FUSE options] mount_point\n", argv[0]);
+        fprintf(stderr, "Usage: %s disk1 disk2 [--cache-blocks=N] [--io=mmap|pread|uring] [--parallel-io=0|1] [--dirs=linear|hashed] [--inline=0|1] [--trace=category,...|all] [--rebuild=new_disk] [--rebuild-rate=MB/s] [--entry-timeout=S] [--attr-timeout=S] [--direct-io=0|1] [--readahead=N] [--write-behind=N] [FUSE options] mount_point\n", argv[0]);
         return -1;
     }
 
     // parse disks
     int i = 1;
 
-    // initialize metedata for easy access
-    initialMetadata(argv[1]);
-
     while (i < argc - 1)
     {
         if (argv[i][0] == '-')
@@ -1403,21 +5334,87 @@ int main(int argc, char *argv[])
         }
         i++;
     }
+    if (parse_wfs_options(&argc, argv) != 0)
+        return -1;
 
-    if (sb.diskNum != i - 1)
+    // a mirror set mounts without one of its disks when a new image takes its place
+    if (rebuild_image != NULL)
+    {
+        for (int d = 0; d < sb.diskNum; d++)
+        {
+            if (diskimgs[d] == NULL)
+                missing_disk = d;
+        }
+        if ((sb.raid != 1 && sb.raid != 2) || sb.diskNum != i || missing_disk < 0)
+        {
+            fprintf(stderr, "Error: --rebuild takes the place of the one disk missing from a raid 1 or 1v set\n");
+            return -1;
+        }
+        diskimgs[missing_disk] = rebuild_image;
+    }
+    // a raid 5 set also mounts with one disk missing
+    if (sb.raid == 5 && sb.diskNum == i)
+    {
+        for (int d = 0; d < sb.diskNum; d++)
+        {
+            if (diskimgs[d] == NULL)
+                missing_disk = d;
+        }
+        if (missing_disk >= 0)
+            fprintf(stderr, "wfs: disk %d of %d is missing, its blocks are rebuilt from the others\n", missing_disk + 1, sb.diskNum);
+    }
+    if (sb.diskNum != i - 1 && missing_disk < 0)
     {
         perror("Error: Not enough disks\n");
         return -1;
     }
 
-    filter_argv(&argc, argv, i - 1);
+    // open and map every disk once, then initialize metedata for easy access
+    if (openDisks() != 0 || initialMetadata() != 0)
+    {
+        perror("Error: cannot load disks\n");
+        return -1;
+    }
+    if (rebuild_image != NULL && rebuildInit() != 0)
+        return -1;
 
-    // for (int i = 0; i < argc; i++)
-    // {
-    //     printf("%s\n", argv[i]);
-    // }
+    filter_argv(&argc, argv, i - 1);
+    // without -s FUSE serves requests from several threads
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint = NULL;
+    int foreground;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != 0 || mountpoint == NULL)
+    {
+        fprintf(stderr, "Error: no mount point\n");
+        return -1;
+    }
+    traceStart();
+    dcache_init();
+    if (cache_init(cache_blocks) != 0)
+        return -1;
+    reclaimOrphans();
 
-    // Initialize FUSE with specified operations
-    // Filter argc and argv here and then pass it to fuse_main
-    return fuse_main(argc, argv, &ops, NULL);
+    // the kernel's requests name inodes by number, see the operations above
+    int res = -1;
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch == NULL)
+        return -1;
+    struct fuse_session *se = fuse_lowlevel_new(&args, &ops, sizeof(ops), NULL);
+    if (se != NULL)
+    {
+        if (fuse_set_signal_handlers(se) == 0)
+        {
+            fuse_session_add_chan(se, ch);
+            if (fuse_daemonize(foreground) == 0)
+                res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+            fuse_remove_signal_handlers(se);
+            fuse_session_remove_chan(ch);
+        }
+        // this calls wfs_destroy
+        fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+    fuse_opt_free_args(&args);
+    free(mountpoint);
+    return res == 0 ? 0 : 1;
 }
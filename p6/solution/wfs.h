@@ -1,31 +1,151 @@
 #include <time.h>
 #include <sys/stat.h>
 #include <stdint.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
-#define BLOCK_SIZE (512)
+// data block size is picked by mkfs and read from the superblock at mount
+#define BLOCK_SIZE (sb.block_size)
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE (64 * 1024)
+#define DEFAULT_BLOCK_SIZE 512
 #define MAX_NAME (28)
 
 #define D_BLOCK (6)
 #define IND_BLOCK (D_BLOCK + 1)
-#define N_BLOCKS (IND_BLOCK + 1)
+#define DIND_BLOCK (IND_BLOCK + 1)
+#define TIND_BLOCK (DIND_BLOCK + 1)
+#define N_BLOCKS (TIND_BLOCK + 1)
+
+// block pointers held by one indirect table, and the largest file they can map
+#define PTRS_PER_BLOCK (BLOCK_SIZE / sizeof(off_t))
+#define MAX_FILE_BLOCKS (IND_BLOCK + PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK + \
+                         PTRS_PER_BLOCK * PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+
+// on-disk format written by mkfs, wfs only mounts this version
+// 2: superblock version field, double and triple indirect blocks
+// 3: block size in the superblock
+// 4: inode flags, hashed directories
+// 5: inline file data
+// 6: metadata journal
+// 7: raid 5
+#define WFS_VERSION 7
 
 #define MAX_DISKS 10
 #define INODE_SIZE (512)
-#define DENTRY_NUM 16
+#define DENTRY_NUM (BLOCK_SIZE / (int)sizeof(struct wfs_dentry))
+
+// seconds dirty metadata may stay in memory before an operation flushes it
+#define METADATA_FLUSH_INTERVAL 5
+// default number of data blocks kept in the block cache, --cache-blocks=N overrides it
+#define CACHE_BLOCKS 256
+// blocks a file read sequentially is prefetched ahead of its reads, --readahead=N overrides
+// it, 0 turns it off, and prefetches waiting for the readahead thread, more are dropped
+#define READAHEAD_BLOCKS 64
+#define READAHEAD_QUEUE 64
+// writes of fewer whole blocks than this stay dirty in the block cache until the file is
+// flushed or released, --write-behind=N overrides it, 0 writes them through
+// writes of WRITE_BEHIND_MAX bytes or more already make big enough transfers with large
+// blocks, merging them would only copy them through the cache
+#define WRITE_BEHIND_BLOCKS 32
+#define WRITE_BEHIND_MAX (64 * 1024)
+// entries in the (parent inode, name) dentry cache
+#define DCACHE_SIZE 1024
+// how lockInode locks an inode
+#define LOCK_READ 0
+#define LOCK_WRITE 1
+// transfers smaller than this stay on the calling thread, handing them to the disk
+// workers costs more than copying them, --parallel-io=0 turns the workers off
+#define PARALLEL_IO_MIN (64 * 1024)
+// data blocks in a raid 5 stripe, and locks partial stripe writes are spread over
+#define STRIPE_DATA (sb.diskNum - 1)
+#define STRIPE_LOCKS 64
+// a mirror replaced with --rebuild=image is copied from the others in runs of allocated
+// blocks of up to REBUILD_CHUNK bytes, held to --rebuild-rate=MB/s while operations are
+// running, 0 does not hold it back
+#define REBUILD_CHUNK (1024 * 1024)
+#define REBUILD_RATE 16
+// a run that fails to copy is tried again after REBUILD_RETRY_MS, doubling each time,
+// the rebuild is given up as failed after REBUILD_RETRIES failures in a row
+#define REBUILD_RETRY_MS 100
+#define REBUILD_RETRIES 8
+// disk I/O backend, --io=mmap (default), --io=pread or --io=uring
+#define DISK_IO_MMAP 0
+#define DISK_IO_PREAD 1
+#define DISK_IO_URING 2
+// submission queue entries of each thread's io_uring, larger batches go in several rounds
+#define URING_DEPTH 64
+// format of the directories mkdir creates, --dirs=linear (default) or --dirs=hashed
+#define DIR_LINEAR 0
+#define DIR_HASHED 1
+// bytes of a small regular file kept in its inode, --inline=1 turns it on for new files
+#define INLINE_DATA_SIZE 360
+
+// trace categories, --trace=ops,io,... or --trace=all turns them on at mount
+// events go to an in-memory ring of TRACE_ENTRIES, SIGUSR1 dumps the new ones to stderr
+#define TRACE_OPS 0x1     // every FUSE operation called
+#define TRACE_IO 0x2      // data block runs moved to and from the disks
+#define TRACE_ALLOC 0x4   // inodes and data blocks taken and given back
+#define TRACE_CACHE 0x8   // block cache misses and writebacks
+#define TRACE_JOURNAL 0x10 // journal commits
+#define TRACE_ENTRIES 4096
+#define TRACE_MSG 128
+// seconds the kernel caches names and attributes wfs hands it, --entry-timeout=S and
+// --attr-timeout=S override them, wfs is the only one changing its disks
+#define ENTRY_TIMEOUT 1.0
+#define ATTR_TIMEOUT 1.0
+// statistics file in the root of the mount, reading it reports the counters,
+// writing or truncating it resets them, it is not listed by readdir
+#define STATS_NAME ".wfs_stats"
+#define STATS_SIZE (16 * 1024)
+// latency histogram buckets, bucket i counts calls that took under 2^i microseconds
+#define STAT_BUCKETS 24
+// operations timed for the statistics
+enum
+{
+    STAT_LOOKUP,
+    STAT_GETATTR,
+    STAT_MKNOD,
+    STAT_MKDIR,
+    STAT_UNLINK,
+    STAT_RMDIR,
+    STAT_READ,
+    STAT_WRITE,
+    STAT_READDIR,
+    STAT_FSYNC,
+    STAT_OPS
+};
+
+// wfs_inode flags
+#define WFS_DIR_HASHED 0x1 // dentries live in a hash table of bucket blocks
+#define WFS_INLINE_DATA 0x2 // file contents live in inline_data, no data blocks
+#define WFS_ORPHAN 0x4      // unlinked while the kernel held it, freed once it lets go
 
 /*
   The fields in the superblock should reflect the structure of the filesystem.
   `mkfs` writes the superblock to offset 0 of the disk image.
   The disk image will have this format:
 
-          d_bitmap_ptr       d_blocks_ptr
-               v                  v
-+----+---------+---------+--------+--------------------------+
-| SB | IBITMAP | DBITMAP | INODES |       DATA BLOCKS        |
-+----+---------+---------+--------+--------------------------+
+          d_bitmap_ptr       d_blocks_ptr              c_blocks_ptr  j_blocks_ptr
+               v                  v                          v           v
++----+---------+---------+--------+--------------------------+-----------+---------+
+| SB | IBITMAP | DBITMAP | INODES |       DATA BLOCKS        | CHECKSUMS | JOURNAL |
++----+---------+---------+--------+--------------------------+-----------+---------+
 0    ^                   ^
 i_bitmap_ptr        i_blocks_ptr
 
+  CHECKSUMS only exists under raid 1v: one uint32_t per data block, 0 while
+  the block has no checksum yet. Every mirror keeps a copy.
+  Under raid 5 the DATA BLOCKS of every disk hold one block of each stripe, a
+  stripe is diskNum - 1 data blocks and their parity at the same offset of
+  every disk. The parity of stripe s is on disk diskNum - 1 - s % diskNum and
+  the stripe's data follows it on the next disks, wrapping around. The region
+  is num_data_blocks / (diskNum - 1) blocks, rounded up.
+  JOURNAL only exists when mkfs was given -j: j_blocks blocks holding the
+  last committed metadata transaction. Every disk keeps a copy.
+  Inodes always take INODE_SIZE bytes, data blocks take block_size bytes and
+  the data region starts on a block boundary. Small files may keep their
+  data in the inode instead of data blocks.
 */
 
 // Superblock
@@ -38,9 +158,14 @@ struct wfs_sb
     off_t i_blocks_ptr;
     off_t d_blocks_ptr;
     // Extend after this line
-    int raid;
+    int raid; // 0 striped, 1 mirrored, 2 mirrored and checksummed (1v), 5 striped with parity
     int diskNum;
     int diskIndex;
+    off_t c_blocks_ptr; // checksum region, 0 unless raid 1v
+    int version;        // WFS_VERSION of the format
+    int block_size;     // bytes per data block, a power of two from 512 to 64K
+    off_t j_blocks_ptr; // journal region, 0 without a journal
+    int j_blocks;       // blocks in the journal region
 };
 
 // Inode
@@ -57,7 +182,15 @@ struct wfs_inode
     time_t mtim; /* Time of last modification */
     time_t ctim; /* Time of last status change */
 
+    // linear directories use every slot for dentry blocks, regular files and
+    // hashed directories map blocks[0..D_BLOCK] directly and the rest through
+    // 1, 2 and 3 levels of tables
     off_t blocks[N_BLOCKS];
+
+    int flags;       /* WFS_* inode flags */
+    int dir_buckets; /* Bucket blocks of a hashed directory */
+
+    char inline_data[INLINE_DATA_SIZE]; /* Contents of an inline file */
 };
 
 // Directory entry
@@ -67,40 +200,354 @@ struct wfs_dentry
     int num;
 };
 
+// Metadata transaction at the start of the journal region
+// the header is followed by nrecords records, each followed by len bytes to write at offset
+#define WFS_JOURNAL_MAGIC 0x4a534657 // "WFSJ"
+struct wfs_journal_header
+{
+    uint32_t magic;
+    uint32_t seq;      /* Counts up across commits */
+    uint32_t nrecords;
+    uint32_t bytes;    /* Of the records after the header */
+    uint32_t checksum; /* CRC-32C of header and records, taken with this field 0 */
+};
+
+#define WFS_JOURNAL_BLOCK -2
+struct wfs_journal_record
+{
+    int32_t disk; /* -1 for every disk, WFS_JOURNAL_BLOCK for a raid 5 data block whose index is offset */
+    uint32_t len;
+    int64_t offset;
+};
+
+// on-disk layout and checksums shared by mkfs, wfs and wfsck
+// size of the checksum region, whole blocks
+static inline size_t checksum_size(const struct wfs_sb *sb)
+{
+    if (sb->c_blocks_ptr == 0)
+        return 0;
+    return (sb->num_data_blocks * sizeof(uint32_t) + sb->block_size - 1) / sb->block_size * sb->block_size;
+}
+
+// bytes of data blocks on every disk, raid 5 spreads a stripe's data over all but one disk
+static inline off_t data_size(const struct wfs_sb *sb)
+{
+    if (sb->raid == 5)
+        return (off_t)((sb->num_data_blocks + sb->diskNum - 2) / (sb->diskNum - 1)) * sb->block_size;
+    return (off_t)sb->num_data_blocks * sb->block_size;
+}
+
+// first byte past the data and checksum regions
+static inline off_t data_end(const struct wfs_sb *sb)
+{
+    if (sb->c_blocks_ptr != 0)
+        return sb->c_blocks_ptr + checksum_size(sb);
+    return sb->d_blocks_ptr + data_size(sb);
+}
+
+// first byte past the last region of the filesystem
+static inline off_t disk_end(const struct wfs_sb *sb)
+{
+    if (sb->j_blocks_ptr != 0)
+        return sb->j_blocks_ptr + (off_t)sb->j_blocks * sb->block_size;
+    return data_end(sb);
+}
+
+// CRC-32C of the raid 1v checksums and the journal, crc32cInit fills the table before use
+static uint32_t crc32c_table[256];
+
+static inline void crc32cInit()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        crc32c_table[i] = crc;
+    }
+}
+
+// CRC-32C of len bytes continuing from crc, start with 0
+static inline uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+        crc = crc32c_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// CRC-32C of a whole block, never 0 since 0 marks a block without a checksum
+static inline uint32_t blockChecksum(const struct wfs_sb *sb, const void *data)
+{
+    uint32_t crc = crc32c(0, data, sb->block_size);
+    return crc == 0 ? 1 : crc;
+}
+
 // Global variables (declared `extern` for external linkage)
 extern char *diskimgs[MAX_DISKS];
+extern int diskfds[MAX_DISKS];
+extern char *diskmaps[MAX_DISKS];
+extern off_t disksizes[MAX_DISKS];
 extern struct wfs_sb sb;
 extern uint8_t *ibitmap;
 extern uint8_t *dbitmap;
+extern size_t ibit_cursor;
+extern size_t dbit_cursor;
+extern size_t ibit_free;
+extern size_t dbit_free;
 extern struct wfs_inode *inodes;
+extern uint8_t *inode_dirty;
+extern uint8_t *ibitmap_dirty;
+extern uint8_t *dbitmap_dirty;
+extern time_t last_flush;
 extern size_t diskTurn;
+extern size_t cache_blocks;
+extern int readahead_blocks;
+extern int write_behind_blocks;
+extern int disk_io;
+extern int missing_disk;
+extern int rebuild_disk;
+extern char *rebuild_image;
+extern int rebuild_rate;
+extern int parallel_io;
+extern int dir_format;
+extern int inline_files;
+extern int multithreaded;
+extern double entry_timeout;
+extern double attr_timeout;
+extern int direct_io;
+extern uint64_t *lookups;
+extern int *parents;
+extern pthread_rwlock_t *inode_locks;
+extern pthread_mutex_t alloc_lock;
+extern pthread_mutex_t flush_lock;
+extern pthread_rwlock_t txn_lock;
 
 // Function declarations
-// Initialize metadata for the first disk
-int initialMetadata(char *name);
+// Initialize metadata from the mapped disk images
+int initialMetadata();
 // Check if a given disk image is valid and store its reference
 int checkValidDiskfile(char *name, char **diskimgs);
+// Take wfs options (--name=value) out of the arguments passed to FUSE
+int parse_wfs_options(int *argc, char *argv[]);
 // Filter FUSE-specific arguments from command-line arguments
 void filter_argv(int *argc, char *argv[], int i);
-// Retrieve a data block by its index
+// Open and mmap every disk image once at mount time
+int openDisks();
+// msync every mapping back to its disk image
+int syncDisks();
+int syncDiskRange(int disk, off_t offset, size_t len);
+void closeDisks();
+// Read/write len bytes at offset of a mapped disk image
+int disk_read(int disk, void *buf, size_t len, off_t offset);
+int disk_write(int disk, const void *buf, size_t len, off_t offset);
+// Gathered read/write of consecutive bytes of a disk image
+int disk_readv(int disk, const struct iovec *iov, int iovcnt, off_t offset);
+int disk_writev(int disk, const struct iovec *iov, int iovcnt, off_t offset);
+// A share of a transfer that goes to one disk
+struct disk_job
+{
+    int disk;
+    const struct iovec *iov;
+    int iovcnt;
+    off_t offset;
+    int write;
+    int res;
+    struct disk_batch *batch;
+    struct disk_job *next;
+};
+// io_uring backend, every thread submits to its own ring with the disks and the block
+// cache registered, a transfer's jobs on all disks go in one submission
+int uringInit();
+void uringStop();
+void uringRegisterBuffer(void *base, size_t len);
+// Per-disk worker threads, started from the FUSE init callback
+int startDiskWorkers();
+void stopDiskWorkers();
+// Run disk jobs, in parallel across disks when the workers are running
+int runDiskJobs(struct disk_job *jobs, int njobs);
+// Disk and offset where a data block lives
+int db_disk(int db_index);
+// Mirror the next raid 1 or 1v read goes to, round-robin over diskTurn
+int readMirror();
+// Mirror after disk, a disk being rebuilt serves no reads
+int nextMirror(int disk);
+off_t db_offset(int db_index);
+// raid 5, a set mounted without one of its disks rebuilds that disk's blocks from the others
+int parityDisk(int stripe);
+void stripeInit();
+int stripeRead(void *buffer, int db_index);
+// rebuild takes the parity from the whole stripe instead of updating it
+int stripeWrite(int db_index, const void *buffer, int rebuild);
+int stripeTransfer(void *buffer, int db_start, int count, int write);
+// Online rebuild of a replaced mirror, the copy runs on its own thread while mounted
+int rebuildInit();
+int startRebuild();
+void stopRebuild();
+int rebuild_stats_format(char *buf, size_t size);
+// Sequential readahead, a thread prefetches the blocks reads queue while they go on
+int startReadahead();
+void stopReadahead();
+void readaheadQueue(int inode_index, int first, int count, int mirror);
+int readahead_stats_format(char *buf, size_t size);
+void readahead_stats_reset();
+// Writes to every mirror run between these, so the rebuild copies a run before or after them
+int mirrorWriteBegin();
+void mirrorWriteEnd(int locked);
+// Block cache in front of the data blocks, LRU with dirty write-back
+// dirty blocks go back to the disks together with the dirty blocks next to them
+int cache_init(size_t capacity);
+int cache_flush();
+int cache_writeback(int db_index);
+void cache_invalidate(int db_index);
+// Copy a cached block out, or only look with a NULL buffer, 0 if it is not cached
+int cache_get(void *buffer, int db_index);
+// Read the blocks of a run that are not cached yet into the cache
+int cache_prefetch(int db_start, int count);
+int cache_stats_format(char *buf, size_t size);
+void cache_stats_reset();
+// Retrieve a data block by its index, through the block cache
 int getDataBlockByDbindex(void *buffer, int db_index);
+// Read or write a data block on the disks, bypassing the block cache
+int readDataBlock(void *buffer, int db_index);
+int writeDataBlock(int db_idx, void *buf);
+// Read or write a run of consecutive data blocks with one transfer per disk
+int readDataBlocks(void *buffer, int db_start, int count);
+int writeDataBlocks(int db_start, int count, const void *buffer);
+int transferDataBlocks(void *buffer, int db_start, int count, int write);
+// Write a run straight from a FUSE buffer, a pipe is read into mapped images or spliced into the files
+struct fuse_bufvec;
+int writeDataBlocksBuf(int db_start, int count, struct fuse_bufvec *src);
+// raid 1v checksums, loaded at mount and flushed with the other metadata
+int loadChecksums();
+void setChecksum(int db_index, const void *data);
+int checksumMatches(int db_index, const void *data);
+// Rebuild a raid 1v block from its mirrors and repair the bad copies
+int recoverBlock(void *buffer, int db_index);
+// Indirect tables loaded while walking one file's blocks, one per level
+// consecutive blocks share their tables, so a sequential walk reads each once
+struct block_map
+{
+    struct wfs_inode *inode;
+    int *pool;           // blocks reserved for missing tables, NULL when only reading
+    int pool_next;
+    int leaf;            // level of the table holding the last slot returned, -1 for the inode
+    off_t db[3];         // table (+1) loaded at each level, 0 when none
+    int dirty[3];
+    off_t *table[3];     // allocated by mapInit, released by mapFree
+};
+// Inode slot and table indexes leading to file block block_idx, returns the number of tables
+int blockPath(int block_idx, int *slot, int idx[3]);
+int mapInit(struct block_map *map, struct wfs_inode *inode);
+// Slot holding file block block_idx (data block + 1, 0 when unmapped)
+// a missing table is taken from the pool, without a pool the walk returns NULL
+off_t *mapBlock(struct block_map *map, int block_idx);
+off_t mapDataBlock(struct block_map *map, int block_idx);
+// Whether writing block_idx needs a data block, its missing tables are added to *tables
+// tables shared with a block between first and block_idx are counted there
+int mapMissing(struct block_map *map, int block_idx, int first, int *tables);
+void mapDirty(struct block_map *map);
+void mapFlush(struct block_map *map);
+void mapFree(struct block_map *map);
+// Free the data block (+1) ptr and, for depth > 0, everything its tables map
+void freeBlockTree(off_t ptr, int depth);
+// Free every block an inode maps
+void freeInodeBlocks(struct wfs_inode *inode);
+// Move an inline file's data out to a data block, -1 if there is no free block
+int promoteInline(struct wfs_inode *inode);
+// Directory entries, dispatching on the directory's format
+int lookupDentry(struct wfs_inode *dir, const char *name);
+int addDentry(struct wfs_inode *dir, const char *name, int num);
+void removeDentry(struct wfs_inode *dir, const char *name);
+// Hashed directories, bucket i is block i of the directory
+uint32_t nameHash(const char *name);
+int hashLookup(struct wfs_inode *dir, const char *name);
+int hashInsert(struct wfs_inode *dir, const char *name, int num);
+void hashRemove(struct wfs_inode *dir, const char *name);
+int hashGrow(struct wfs_inode *dir, int buckets);
+// Dentry cache keyed by (parent inode, name)
+void dcache_init();
+int dcache_lookup(int parent, const char *name);
+void dcache_insert(int parent, const char *name, int num);
+void dcache_invalidate(int parent, const char *name);
 // Find an inode by name within a directory inode
-int getInodeFromName(char *name, int inode_index);
-// Parse a path and return the inode index of the file/directory
-// mode 0: Read file/directory
-// mode 1: Create file in directory
-int parsePath(const char *path, int mode, char *output);
+int getInodeFromName(const char *name, int inode_index);
+// Per-inode reader/writer locks
+void lockInode(int inode_index, int lock);
+void unlockInode(int inode_index);
 // Write a new file/directory entry into a directory
-int writeToDir(int dir_inode_index, char *name, int m, int mode);
+int writeToDir(int dir_inode_index, const char *name, int m, int mode);
 off_t dataToWrite_ptr(struct wfs_inode *inode, int *data_block_idx);
-int createNewInode(char *name, int m, int mode);
+int createNewInode(const char *name, int m, int mode);
+// Mark an inode or the bitmap block holding bit n as needing a flush
+void markInodeDirty(int inode_index);
+void markIbitDirty(size_t n);
+void markDbitDirty(size_t n);
+// Flush dirty metadata if METADATA_FLUSH_INTERVAL has passed
+int metadataChanged();
+// A thread flushes what an idle mount leaves dirty once METADATA_FLUSH_INTERVAL has passed
+int startFlusher();
+void stopFlusher();
+// Flush dirty metadata to every disk, as one journal transaction when there is a journal
 int updateMetadata();
-void print_non_empty_entries(int disk_index);
+// Operations changing metadata run between beginOp and endOp, a flush waits for them
+void beginOp();
+void endOp();
+// Metadata journal, only used when the superblock has a journal region
+int journalInit();
+// Replay the newest committed transaction left in the journal
+int journalRecover();
+// Mark the journal empty once everything in it is on disk
+int journalClear();
+// Copy of a dentry or table block held by the running transaction, 0 if there is none
+int journalRead(int db_index, void *buffer);
+void journalWrite(int db_index, const void *buffer);
+void journalForget(int db_index);
+// Commit the running transaction if that frees data blocks, 1 if it did
+int journalReclaim();
+// Tracing, a disabled category costs one test of trace_mask
+extern unsigned trace_mask;
+#define TRACE(category, ...)                              \
+    do                                                    \
+    {                                                     \
+        if (__builtin_expect(trace_mask & (category), 0)) \
+            traceEvent(__VA_ARGS__);                      \
+    } while (0)
+void traceEvent(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int traceParse(const char *list);
+void traceStart();
+// Statistics counters, cheap enough to stay on all the time
+uint64_t statsClock();
+void statsOp(int op, uint64_t start);
+// Operations completed since the counters were reset
+uint64_t statsCalls();
+void statsDisk(int disk, int write, size_t len);
+void statsScan(size_t words);
+// Render the report read from STATS_NAME, return its length
+int statsFormat(char *buf, size_t size);
+void statsReset();
+// Word-at-a-time bitmap scan from a next-fit cursor, with cached free counts
+size_t bitmap_next(const uint8_t *bitmap, size_t nbits, size_t start, int value);
+size_t bitmap_find_zero(const uint8_t *bitmap, size_t nbits, size_t start);
+size_t bitmap_find_run(const uint8_t *bitmap, size_t nbits, size_t cursor, size_t want, size_t align, size_t *start);
+size_t bitmap_count_free(const uint8_t *bitmap, size_t nbits);
 size_t getIbit();
 size_t getDbit();
+size_t allocIbit();
+int checkDbit(int n);
+// Reserve n data blocks as contiguous runs, stripe-aligned under raid 0 and 5,
+// starting with the free ones from goal on when goal is not -1
+int allocDbitRun(int n, int *blocks, int goal);
 void set_ibit(size_t n);
-void set_dbit(size_t n);
+void mark_dbit(size_t n);
+void clear_ibit(size_t n);
+void clear_dbit(size_t n);
 int write_datablock_toIdx(int db_idx, void *buf);
+// Write a dentry or table block, through the journal when there is one
+int write_metablock_toIdx(int db_idx, void *buf);
 void read_from_indirect_db(int db_idx, off_t indirect_db[]);
-void free_inode_from_parent(const char *path, int inode_index);
-void print_data_blocks(int inode_index);
\ No newline at end of file
+// Take an entry out of its directory, its inode goes once the kernel forgot it
+void free_inode_from_parent(int parent_inode_idx, const char *name, int inode_index);
+void releaseInode(int inode_index);
+void reclaimOrphans();
\ No newline at end of file
@@ -0,0 +1,573 @@
+#include "wfs.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+// wfsck checks a wfs disk set that is not mounted
+// the metadata of every disk, and under raid 1 and 1v the data blocks in use, are
+// compared against the other disks by several threads at once, under raid 5 the parity
+// of every stripe in use is checked, then the tree is walked from the root inode on the
+// first disk
+// usage: wfsck [-r] [-t threads] disk1 disk2 ...
+//   -r writes the majority copy over copies that differ from it, under raid 1v a data
+//      block copy matching the block's checksum wins over the majority, a raid 5 parity
+//      block is worked out again from its data
+// exit status follows fsck: 0 clean, 1 every error repaired, 4 errors left, 8 not checked
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define FSCK_OK 0
+#define FSCK_REPAIRED 1
+#define FSCK_ERRORS 4
+#define FSCK_FAILED 8
+// bytes of a region a scrub thread takes at a time, compared whole before block by block
+#define SCRUB_CHUNK (1024 * 1024)
+#define MAX_THREADS 64
+
+// what a scrubbed region holds
+#define SCRUB_META 0
+#define SCRUB_CSUM 1
+#define SCRUB_DATA 2
+#define SCRUB_PARITY 3
+
+struct wfs_sb sb;
+static char *diskpaths[MAX_DISKS];
+static char *maps[MAX_DISKS];
+static off_t mapsizes[MAX_DISKS];
+static int repair = 0;
+static int nthreads = 0;
+
+// problems found, and how many of them were repaired
+static size_t errors = 0;
+static size_t repaired = 0;
+
+// the tree walk works on the first disk's bitmaps and inodes, after they were scrubbed
+static const uint8_t *ibits;
+static const uint8_t *dbits;
+static int *owner;     // inode using each data block, -1 for none
+static uint8_t *seen; // inodes reached from the root
+
+static void problem(int fixed, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void problem(int fixed, const char *fmt, ...)
+{
+    char line[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    printf("%s%s\n", line, fixed ? ", repaired" : "");
+    __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+    if (fixed)
+        __atomic_fetch_add(&repaired, 1, __ATOMIC_RELAXED);
+}
+
+static int bit(const uint8_t *bitmap, size_t n)
+{
+    return (bitmap[n / 8] >> (n % 8)) & 1;
+}
+
+// disks sharing a set agree on everything in the superblock but their index
+static int sameSet(const struct wfs_sb *a, const struct wfs_sb *b)
+{
+    return a->num_inodes == b->num_inodes && a->num_data_blocks == b->num_data_blocks &&
+           a->i_bitmap_ptr == b->i_bitmap_ptr && a->d_bitmap_ptr == b->d_bitmap_ptr &&
+           a->i_blocks_ptr == b->i_blocks_ptr && a->d_blocks_ptr == b->d_blocks_ptr &&
+           a->raid == b->raid && a->diskNum == b->diskNum && a->c_blocks_ptr == b->c_blocks_ptr &&
+           a->version == b->version && a->block_size == b->block_size &&
+           a->j_blocks_ptr == b->j_blocks_ptr && a->j_blocks == b->j_blocks;
+}
+
+// map every disk, ordered by the index in its superblock
+int openDisks(int ndisks, char *paths[])
+{
+    for (int i = 0; i < ndisks; i++)
+    {
+        int fd = open(paths[i], repair ? O_RDWR : O_RDONLY);
+        struct stat st;
+        struct wfs_sb disk_sb;
+        if (fd == -1 || fstat(fd, &st) == -1 || pread(fd, &disk_sb, sizeof(disk_sb), 0) != sizeof(disk_sb))
+        {
+            perror(paths[i]);
+            if (fd != -1)
+                close(fd);
+            return -1;
+        }
+        if (disk_sb.version != WFS_VERSION)
+        {
+            fprintf(stderr, "Error: %s is not a version %d wfs disk\n", paths[i], WFS_VERSION);
+            close(fd);
+            return -1;
+        }
+        int index = disk_sb.diskIndex;
+        if (index < 0 || index >= disk_sb.diskNum || disk_sb.diskNum > MAX_DISKS || maps[index] != NULL ||
+            (i > 0 && !sameSet(&sb, &disk_sb)))
+        {
+            fprintf(stderr, "Error: %s is not the next disk of the set\n", paths[i]);
+            close(fd);
+            return -1;
+        }
+        sb = disk_sb;
+        if (st.st_size < disk_end(&sb))
+        {
+            fprintf(stderr, "Error: %s is smaller than its filesystem\n", paths[i]);
+            close(fd);
+            return -1;
+        }
+        maps[index] = mmap(NULL, st.st_size, repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (maps[index] == MAP_FAILED)
+        {
+            perror(paths[i]);
+            maps[index] = NULL;
+            return -1;
+        }
+        madvise(maps[index], st.st_size, MADV_SEQUENTIAL);
+        mapsizes[index] = st.st_size;
+        diskpaths[index] = paths[i];
+    }
+    if (ndisks != sb.diskNum)
+    {
+        fprintf(stderr, "Error: %d disks given, the set has %d\n", ndisks, sb.diskNum);
+        return -1;
+    }
+    sb.diskIndex = 0;
+    return 0;
+}
+
+// scrub
+// a region that every disk holds a copy of, compared a unit at a time
+struct scrub
+{
+    int kind;
+    off_t start;
+    off_t end;
+    size_t next_chunk; // taken by the threads in turn
+};
+
+static void scrubUnit(struct scrub *s, off_t off, size_t len)
+{
+    size_t n = (off - s->start) / BLOCK_SIZE;
+    // only data blocks in use are compared, the others hold nothing to keep
+    if (s->kind == SCRUB_DATA && !bit(dbits, n))
+        return;
+
+    int same = 1;
+    for (int d = 1; d < sb.diskNum && same; d++)
+        same = memcmp(maps[0] + off, maps[d] + off, len) == 0;
+
+    // a raid 1v data block with a checksum keeps the copy matching it
+    int winner = -1;
+    uint32_t crc = 0;
+    if (s->kind == SCRUB_DATA && sb.raid == 2)
+        crc = ((const uint32_t *)(maps[0] + sb.c_blocks_ptr))[n];
+    for (int d = 0; d < sb.diskNum && crc != 0 && winner < 0; d++)
+    {
+        if (blockChecksum(&sb, maps[d] + off) == crc)
+            winner = d;
+    }
+
+    char what[64];
+    if (s->kind == SCRUB_META)
+        snprintf(what, sizeof(what), "metadata at byte %jd", (intmax_t)off);
+    else
+        snprintf(what, sizeof(what), "%s block %zu", s->kind == SCRUB_CSUM ? "checksum" : "data", n);
+    if (same)
+    {
+        if (crc != 0 && winner < 0)
+            problem(0, "%s does not match its checksum on any disk", what);
+        return;
+    }
+
+    // otherwise the copy more than half of the disks hold
+    for (int d = 0; d < sb.diskNum && winner < 0; d++)
+    {
+        int votes = 0;
+        for (int e = 0; e < sb.diskNum; e++)
+            votes += memcmp(maps[d] + off, maps[e] + off, len) == 0;
+        if (votes * 2 > sb.diskNum)
+            winner = d;
+    }
+    if (winner < 0)
+    {
+        problem(0, "%s differs between the disks and no copy has a majority", what);
+        return;
+    }
+    for (int d = 0; d < sb.diskNum; d++)
+    {
+        if (memcmp(maps[d] + off, maps[winner] + off, len) == 0)
+            continue;
+        if (repair)
+            memcpy(maps[d] + off, maps[winner] + off, len);
+        problem(repair, "%s on %s differs from %s", what, diskpaths[d], diskpaths[winner]);
+    }
+}
+
+// the disks of a raid 5 stripe in use must XOR to zero, a stripe with nothing in use is left alone
+static void parityUnit(off_t off)
+{
+    size_t stripe = (off - sb.d_blocks_ptr) / BLOCK_SIZE;
+    int used = 0;
+    for (size_t b = stripe * STRIPE_DATA; b < (stripe + 1) * STRIPE_DATA && b < sb.num_data_blocks; b++)
+        used |= bit(dbits, b);
+    if (!used)
+        return;
+
+    uint64_t sum[BLOCK_SIZE / sizeof(uint64_t)];
+    memset(sum, 0, BLOCK_SIZE);
+    for (int d = 0; d < sb.diskNum; d++)
+    {
+        const uint64_t *block = (const uint64_t *)(maps[d] + off);
+        for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++)
+            sum[i] ^= block[i];
+    }
+    int zero = 1;
+    for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t) && zero; i++)
+        zero = sum[i] == 0;
+    if (zero)
+        return;
+
+    // the data is taken as right, XORing the difference into the parity makes it match
+    int parity = sb.diskNum - 1 - stripe % sb.diskNum;
+    if (repair)
+    {
+        uint64_t *block = (uint64_t *)(maps[parity] + off);
+        for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++)
+            block[i] ^= sum[i];
+    }
+    problem(repair, "parity of stripe %zu on %s does not match its data", stripe, diskpaths[parity]);
+}
+
+static void *scrubWorker(void *arg)
+{
+    struct scrub *s = arg;
+    for (;;)
+    {
+        size_t chunk = __atomic_fetch_add(&s->next_chunk, 1, __ATOMIC_RELAXED);
+        off_t off = s->start + (off_t)chunk * SCRUB_CHUNK;
+        if (off >= s->end)
+            break;
+        off_t end = MIN(off + SCRUB_CHUNK, s->end);
+        if (s->kind == SCRUB_PARITY)
+        {
+            for (; off < end; off += BLOCK_SIZE)
+                parityUnit(off);
+            continue;
+        }
+
+        // whole chunks are compared first, memcmp runs vectorized over them
+        int same = 1;
+        for (int d = 1; d < sb.diskNum && same; d++)
+            same = memcmp(maps[0] + off, maps[d] + off, end - off) == 0;
+        // identical copies only need a look when raid 1v has checksums to verify
+        if (same && !(s->kind == SCRUB_DATA && sb.raid == 2))
+            continue;
+        for (; off < end; off += BLOCK_SIZE)
+            scrubUnit(s, off, MIN(BLOCK_SIZE, end - off));
+    }
+    return NULL;
+}
+
+static void scrubRegion(int kind, off_t start, off_t end)
+{
+    struct scrub s = {.kind = kind, .start = start, .end = end, .next_chunk = 0};
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+    while (started < nthreads && pthread_create(&threads[started], NULL, scrubWorker, &s) == 0)
+        started++;
+    // without threads the region is scrubbed right here
+    if (started == 0)
+        scrubWorker(&s);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+// the data bitmap of a raid 0 set, put together from the bits every disk keeps
+static uint8_t *stripedBitmap()
+{
+    uint8_t *bitmap = calloc(sb.num_data_blocks / 8, 1);
+    if (bitmap == NULL)
+    {
+        perror("Error: data bitmap");
+        exit(FSCK_FAILED);
+    }
+    for (int d = 0; d < sb.diskNum; d++)
+    {
+        const uint8_t *disk_bits = (const uint8_t *)maps[d] + sb.d_bitmap_ptr;
+        for (size_t b = 0; b < sb.num_data_blocks; b++)
+        {
+            if (!bit(disk_bits, b))
+                continue;
+            if (b % sb.diskNum != d)
+                problem(0, "%s marks data block %zu in use, which is stored on %s", diskpaths[d], b, diskpaths[b % sb.diskNum]);
+            bitmap[b / 8] |= 1 << (b % 8);
+        }
+    }
+    return bitmap;
+}
+
+// tree walk
+static struct wfs_inode *inodeAt(size_t num)
+{
+    return (struct wfs_inode *)(maps[0] + sb.i_blocks_ptr + num * INODE_SIZE);
+}
+
+static const char *dataBlock(off_t db_index)
+{
+    if (sb.raid == 0)
+        return maps[db_index % sb.diskNum] + sb.d_blocks_ptr + db_index / sb.diskNum * BLOCK_SIZE;
+    if (sb.raid == 5)
+    {
+        // a stripe's data starts on the disk after its parity
+        off_t stripe = db_index / STRIPE_DATA;
+        int disk = (sb.diskNum - 1 - stripe % sb.diskNum + 1 + db_index % STRIPE_DATA) % sb.diskNum;
+        return maps[disk] + sb.d_blocks_ptr + stripe * BLOCK_SIZE;
+    }
+    return maps[0] + sb.d_blocks_ptr + db_index * BLOCK_SIZE;
+}
+
+// take the data block behind pointer ptr (index + 1) for inode num, 0 if it can be read
+static int claim(off_t ptr, int num)
+{
+    off_t db_index = ptr - 1;
+    if (db_index < 0 || (size_t)db_index >= sb.num_data_blocks)
+    {
+        problem(0, "inode %d points to data block %jd, past the end", num, (intmax_t)db_index);
+        return -1;
+    }
+    if (owner[db_index] != -1)
+    {
+        problem(0, "data block %jd is used by inodes %d and %d", (intmax_t)db_index, owner[db_index], num);
+        return -1;
+    }
+    if (!bit(dbits, db_index))
+        problem(0, "inode %d uses data block %jd, which is marked free", num, (intmax_t)db_index);
+    owner[db_index] = num;
+    return 0;
+}
+
+// claim a block and, depth levels deep, every block its tables point to
+static void claimTree(off_t ptr, int depth, int num)
+{
+    if (ptr == 0 || claim(ptr, num) != 0 || depth == 0)
+        return;
+    const off_t *table = (const off_t *)dataBlock(ptr - 1);
+    for (size_t i = 0; i < PTRS_PER_BLOCK; i++)
+        claimTree(table[i], depth - 1, num);
+}
+
+// data block of block i of a file or hashed directory, -1 for a hole
+static off_t fileBlock(const struct wfs_inode *inode, size_t i)
+{
+    if (i <= D_BLOCK)
+        return inode->blocks[i] - 1;
+    i -= IND_BLOCK;
+    int depth = 1;
+    size_t span = PTRS_PER_BLOCK;
+    while (i >= span)
+    {
+        i -= span;
+        span *= PTRS_PER_BLOCK;
+        if (++depth > 3)
+            return -1;
+    }
+    off_t ptr = inode->blocks[D_BLOCK + depth];
+    for (; depth > 0 && ptr > 0 && (size_t)ptr <= sb.num_data_blocks; depth--)
+    {
+        span /= PTRS_PER_BLOCK;
+        ptr = ((const off_t *)dataBlock(ptr - 1))[i / span];
+        i %= span;
+    }
+    return depth == 0 ? ptr - 1 : -1;
+}
+
+static void walkInode(int num);
+
+static void walkDentry(const struct wfs_dentry *dentry, int parent)
+{
+    if (dentry->name[0] == '\0')
+        return;
+    if (memchr(dentry->name, '\0', MAX_NAME) == NULL)
+        problem(0, "directory inode %d has an entry without an end to its name", parent);
+    if (dentry->num <= 0 || (size_t)dentry->num >= sb.num_inodes)
+    {
+        problem(0, "entry %.*s of directory inode %d points to inode %d", MAX_NAME, dentry->name, parent, dentry->num);
+        return;
+    }
+    if (seen[dentry->num])
+    {
+        problem(0, "inode %d is linked from more than one entry", dentry->num);
+        return;
+    }
+    walkInode(dentry->num);
+}
+
+static void walkInode(int num)
+{
+    struct wfs_inode *inode = inodeAt(num);
+    seen[num] = 1;
+    if (!bit(ibits, num))
+        problem(0, "inode %d is in use but marked free", num);
+    if (inode->num != num)
+        problem(0, "inode %d holds number %d", num, inode->num);
+    int dir = S_ISDIR(inode->mode);
+    if (!dir && !S_ISREG(inode->mode))
+    {
+        problem(0, "inode %d has mode %o", num, (unsigned)inode->mode);
+        return;
+    }
+
+    if (inode->flags & WFS_INLINE_DATA)
+    {
+        if (dir || inode->size > INLINE_DATA_SIZE)
+            problem(0, "inode %d keeps %jd bytes inline", num, (intmax_t)inode->size);
+        for (int i = 0; i < N_BLOCKS; i++)
+        {
+            if (inode->blocks[i] != 0)
+                problem(0, "inline inode %d points to data block %jd", num, (intmax_t)inode->blocks[i] - 1);
+        }
+        return;
+    }
+
+    // linear directories only hold dentry blocks, everything else maps through tables
+    int linear = dir && !(inode->flags & WFS_DIR_HASHED);
+    for (int i = 0; i < N_BLOCKS; i++)
+        claimTree(inode->blocks[i], linear || i <= D_BLOCK ? 0 : i - D_BLOCK, num);
+    if (!dir)
+        return;
+
+    // a hashed directory's buckets start with a header that is no entry
+    int nblocks = linear ? N_BLOCKS : inode->dir_buckets;
+    for (int i = 0; i < nblocks; i++)
+    {
+        off_t db_index = linear ? inode->blocks[i] - 1 : fileBlock(inode, i);
+        if (db_index < 0 || (size_t)db_index >= sb.num_data_blocks || owner[db_index] != num)
+            continue;
+        const struct wfs_dentry *entries = (const struct wfs_dentry *)dataBlock(db_index);
+        for (int j = linear ? 0 : 1; j < DENTRY_NUM; j++)
+            walkDentry(&entries[j], num);
+    }
+}
+
+static void walkTree()
+{
+    ibits = (const uint8_t *)maps[0] + sb.i_bitmap_ptr;
+    owner = malloc(sb.num_data_blocks * sizeof(int));
+    seen = calloc(sb.num_inodes, 1);
+    if (owner == NULL || seen == NULL)
+    {
+        perror("Error: tree walk");
+        exit(FSCK_FAILED);
+    }
+    memset(owner, -1, sb.num_data_blocks * sizeof(int));
+
+    walkInode(0);
+    // not an error either, the next mount frees inodes unlinked while they were open
+    size_t orphans = 0;
+    for (size_t i = 1; i < sb.num_inodes; i++)
+    {
+        if (bit(ibits, i) && !seen[i] && (inodeAt(i)->flags & WFS_ORPHAN))
+        {
+            walkInode(i);
+            orphans++;
+        }
+    }
+    if (orphans > 0)
+        printf("wfsck: %zu inodes unlinked while open, freed at the next mount\n", orphans);
+
+    size_t inodes_used = 0;
+    for (size_t i = 0; i < sb.num_inodes; i++)
+    {
+        inodes_used += bit(ibits, i);
+        if (bit(ibits, i) && !seen[i])
+            problem(0, "inode %zu is allocated but not linked from any directory", i);
+    }
+    // not an error, linear directories keep their blocks after rmdir
+    size_t blocks_used = 0;
+    size_t unowned = 0;
+    for (size_t b = 0; b < sb.num_data_blocks; b++)
+    {
+        blocks_used += bit(dbits, b);
+        unowned += bit(dbits, b) && owner[b] == -1;
+    }
+    printf("wfsck: %zu of %zu inodes and %zu of %zu data blocks in use, %zu of those blocks unused by any inode\n",
+           inodes_used, sb.num_inodes, blocks_used, sb.num_data_blocks, unowned);
+    free(owner);
+    free(seen);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "rt:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            repair = 1;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r] [-t threads] disk1 disk2 ...\n", argv[0]);
+            return FSCK_FAILED;
+        }
+    }
+    if (optind == argc || argc - optind > MAX_DISKS)
+    {
+        fprintf(stderr, "Usage: %s [-r] [-t threads] disk1 disk2 ...\n", argv[0]);
+        return FSCK_FAILED;
+    }
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = nthreads < 1 ? 1 : MIN(nthreads, MAX_THREADS);
+    crc32cInit();
+    if (openDisks(argc - optind, argv + optind) != 0)
+        return FSCK_FAILED;
+
+    // a journal still holding a transaction was not unmounted cleanly, wfs replays it at mount
+    if (sb.j_blocks > 0)
+    {
+        const struct wfs_journal_header *header = (const struct wfs_journal_header *)(maps[0] + sb.j_blocks_ptr);
+        if (header->magic == WFS_JOURNAL_MAGIC)
+            problem(0, "the journal holds transaction %u, mount the disks once to replay it", header->seq);
+    }
+
+    // metadata is on every disk, the superblock differs in its index and is left out
+    // under raid 0 every disk has the data bitmap of the blocks it stores
+    if (sb.raid == 0)
+    {
+        scrubRegion(SCRUB_META, sb.i_bitmap_ptr, sb.d_bitmap_ptr);
+        scrubRegion(SCRUB_META, sb.i_blocks_ptr, sb.d_blocks_ptr);
+        dbits = stripedBitmap();
+    }
+    else
+    {
+        scrubRegion(SCRUB_META, sb.i_bitmap_ptr, sb.d_blocks_ptr);
+        dbits = (const uint8_t *)maps[0] + sb.d_bitmap_ptr;
+    }
+    if (sb.raid == 2)
+        scrubRegion(SCRUB_CSUM, sb.c_blocks_ptr, data_end(&sb));
+    if (sb.raid == 1 || sb.raid == 2)
+        scrubRegion(SCRUB_DATA, sb.d_blocks_ptr, sb.d_blocks_ptr + data_size(&sb));
+    if (sb.raid == 5)
+        scrubRegion(SCRUB_PARITY, sb.d_blocks_ptr, sb.d_blocks_ptr + data_size(&sb));
+    walkTree();
+
+    for (int i = 0; i < sb.diskNum; i++)
+    {
+        if (repaired > 0 && msync(maps[i], mapsizes[i], MS_SYNC) != 0)
+            perror(diskpaths[i]);
+        munmap(maps[i], mapsizes[i]);
+    }
+    printf("wfsck: %zu errors, %zu repaired\n", errors, repaired);
+    if (errors == 0)
+        return FSCK_OK;
+    return errors == repaired ? FSCK_REPAIRED : FSCK_ERRORS;
+}
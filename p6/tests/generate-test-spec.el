@@ -148,6 +148,14 @@ PREFIX directory names are always PREFIX and a number."
 (defun requires-indirect (size)
   (> size 3584))
 
+(defun indirect-blocks (size)
+  "Number of indirect tables a file of SIZE bytes needs, 64 pointers per table.
+Covers the single and double indirect blocks."
+  (let ((blocks (- (/ (roundup size 512) 512) 7)))
+    (cond ((<= blocks 0) 0)
+	  ((<= blocks 64) 1)
+	  (t (+ 2 (/ (+ (- blocks 64) 63) 64))))))
+
 (defun count-metadata (fs-state numdisks)
   "Generates an alist of expected metadata from a list denoting fs state.
 
@@ -171,9 +179,7 @@ FS-STATE the state of the filesystem."
 	       (if (not (zerop (cdr item))) ;; non-empty file
 		   (let ((fileblocks
 			  (+ (/ (+ (roundup (cdr item) 512)) 512)
-			     (if (requires-indirect (cdr item))
-				 1
-			       0)))) ;ind
+			     (indirect-blocks (cdr item))))) ;ind
 		     (setq blocks (+ blocks fileblocks))
 		     (setq indirect-adjust
 			   (if (requires-indirect (cdr item))
@@ -251,7 +257,7 @@ DIR a directory mounted with FUSE."
   "Test template for mfks.
 
 DESC description of the test
-RAID raid mode as string (0, 1, or 1v)
+RAID raid mode as string (0, 1, 1v or 5)
 NUMDISKS number of disks in the filesystem
 INODES number of inodes passed to mkfs
 BLOCKS number of blocks passed to mkfs
@@ -295,7 +301,7 @@ with FS-STATE.
 
 DESC test description.
 NUMDISKS the number of disks to create, at least two.
-RAID raid mode as string (0, 1, or 1v)
+RAID raid mode as string (0, 1, 1v or 5)
 FS-STATE a list describing the filesystem state
 OUTPUT the expected output. Generally \"Correct\" or an error."
   (define-test
@@ -322,7 +328,7 @@ each component of a test -- pre, post, run, out, etc.
 
 DESC test description.
 NUMDISKS the number of disks to create, at least two.
-RAID raid mode as string (0, 1, or 1v)
+RAID raid mode as string (0, 1, 1v or 5)
 FS-STATE a list describing the filesystem state
 OP the workload to running following filesystem initialization.
 POST-STATE the expected state of the filesystem after OP.
@@ -503,4 +509,87 @@ POST-BLOCKS additional blocks we should expect (e.g. no cleaning dir blocks)"
 			  (mount-cmd 3 "mnt")
 			  "diff mnt/file1 file1.test")
 		    "; ")
-		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))))
+		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0)
+		 ("raid0 -- multithreaded stress" ,'()
+		  ,(string-join
+		    (list "fusermount -u mnt"
+			  (format "../solution/wfs %s %s %s mnt" ; no -s, FUSE runs multithreaded
+				  (disk-path "test-disk1") (disk-path "test-disk2") (disk-path "test-disk3"))
+			  "./stress-mt.py 6 80")
+		    "; ")
+		  ,(n-file-directory 6 8000) 0 "0" 3 "Correct\nCorrect\nCorrect" 0)
+		 ("raid1 -- multithreaded stress" ,'()
+		  ,(string-join
+		    (list "fusermount -u mnt"
+			  (format "../solution/wfs %s %s mnt"
+				  (disk-path "test-disk1") (disk-path "test-disk2"))
+			  "./stress-mt.py 6 80")
+		    "; ")
+		  ,(n-file-directory 6 8000) 0 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		 ("raid1 -- read: double indirect file" ,'()
+		  "./read-write.py 1 400"
+		  ,'(("file1" . 40000)) 0 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		 ("raid1 -- stats file counts and resets" ,'()
+		  "./stats-check.py"
+		  ,'(("file1" . 1000)) 0 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		 ("raid1v -- wfsck repairs a corrupted disk" ,'()
+		  ,(string-join
+		    (list "./read-write.py 1 10"
+			  "fusermount -u mnt"
+			  (format "./corrupt-disk.py --disks %s"
+				  (disk-path "test-disk1"))
+			  (format "../solution/wfsck -r %s %s %s > /dev/null"
+				  (disk-path "test-disk1") (disk-path "test-disk2") (disk-path "test-disk3"))
+			  ;; 1 means everything found was repaired, the second pass must be clean
+			  (format "[ $? -eq 1 ] && ../solution/wfsck %s %s %s > /dev/null"
+				  (disk-path "test-disk1") (disk-path "test-disk2") (disk-path "test-disk3")))
+		    "; ")
+		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0)
+		 ("raid5 -- readback with a missing disk" ,'()
+		  ,(string-join
+		    (list "./read-write.py 1 10"
+			  "cat mnt/file1 > file1.test"
+			  "fusermount -u mnt"
+			  ;; disk 1 is left out, its blocks are rebuilt from the parity
+			  ;; wfs notes the missing disk on stderr, the readback is what is checked
+			  (format "../solution/wfs %s %s -s mnt 2> /dev/null"
+				  (disk-path "test-disk2") (disk-path "test-disk3"))
+			  "diff mnt/file1 file1.test")
+		    "; ")
+		  ,'(("file1" . 1000)) 0 "5" 3 "Correct\nCorrect\nCorrect" 0)
+		 ("raid1 -- online rebuild of a replaced disk" ,'()
+		  ,(string-join
+		    (list "./read-write.py 1 10"
+			  "cat mnt/file1 > file1.test"
+			  "fusermount -u mnt"
+			  ;; disk 2 is replaced with an empty image and copied back from disk 1
+			  ;; wfs names the image it rebuilds on stderr, which holds the user's name
+			  (format "rm -f %s" (disk-path "test-disk2"))
+			  (format "truncate -s 1M %s" (disk-path "test-disk2"))
+			  (format "../solution/wfs %s --rebuild=%s -s mnt 2> /dev/null"
+				  (disk-path "test-disk1") (disk-path "test-disk2"))
+			  "for n in $(seq 50); do grep -q complete mnt/.wfs_stats && break; sleep 0.1; done"
+			  "grep -q complete mnt/.wfs_stats || { echo \"rebuild did not complete\"; exit 1; }"
+			  "diff mnt/file1 file1.test"
+			  "fusermount -u mnt"
+			  ;; reads come from disk 1 either way, so the copy itself is compared
+			  (format "cmp -i $(python3 -c 'import sys, wfsverify; print(wfsverify.WfsState(sys.argv[1]).get_dblock_region())' %s) %s %s"
+				  (disk-path "test-disk1") (disk-path "test-disk1") (disk-path "test-disk2"))
+			  (format "../solution/wfs %s %s -s mnt"
+				  (disk-path "test-disk1") (disk-path "test-disk2")))
+		    "; ")
+		  ,'(("file1" . 1000)) 0 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		 ;; the root keeps its dentry block once the file is gone
+		 ("raid1 -- an unlinked file stays usable while open" ,'()
+		  "./unlink-open.py"
+		  ,'() 1 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		 ("raid1 -- small appends are merged and read ahead" ,'()
+		  ,(string-join
+		    (list "./stream-check.py write"
+			  "fusermount -u mnt"
+			  ;; every read reaches wfs, the kernel page cache would serve them otherwise
+			  (format "../solution/wfs %s %s --direct-io=1 -s mnt"
+				  (disk-path "test-disk1") (disk-path "test-disk2"))
+			  "./stream-check.py read")
+		    " && ")
+		  ,'(("file1" . 40000)) 0 "1" 2 "Correct\nCorrect\nCorrect\nCorrect" 0))))))
@@ -0,0 +1,46 @@
+#!/usr/bin/python3
+
+# write and read back a file, then check /.wfs_stats counted it
+# and that truncating the stats file resets the counters
+
+import os
+
+os.chdir("mnt")
+
+data = os.urandom(1000)
+with open("file1", "wb") as fh:
+    fh.write(data)
+with open("file1", "rb") as fh:
+    if fh.read() != data:
+        print("file1 readback does not match data written")
+        exit(1)
+
+
+def stats():
+    with open(".wfs_stats") as fh:
+        return {line.split(":")[0]: line for line in fh}
+
+
+def calls(report, op):
+    return int(report[op].split()[1])
+
+
+report = stats()
+if calls(report, "write") == 0 or calls(report, "read") == 0:
+    print("reads and writes were not counted")
+    exit(1)
+if "disk 1" not in report or "disk 2" not in report:
+    print("no per-disk counters")
+    exit(1)
+if ".wfs_stats" in os.listdir("."):
+    print("the stats file is listed")
+    exit(1)
+
+open(".wfs_stats", "w").close()
+report = stats()
+if calls(report, "write") != 0 or calls(report, "read") != 0:
+    print("counters were not reset")
+    exit(1)
+
+print("Correct")
+exit(0)
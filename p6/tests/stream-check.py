@@ -0,0 +1,55 @@
+#!/usr/bin/python3
+
+# write: append to file1 in 100 byte writes like a log, the blocks they leave
+# in the block cache reach the disks merged into runs when it is closed
+# read: read file1 back in order, which wfs should notice and read ahead of
+# run the read on a mount with --direct-io=1, so every read reaches wfs
+
+import os
+import sys
+
+size = 40000
+segment = 100
+data = bytes((i * 7 + 3) % 251 for i in range(size))
+
+os.chdir("mnt")
+
+
+def stats(name):
+    with open(".wfs_stats") as fh:
+        for line in fh:
+            if line.startswith(name + ":"):
+                return line.split()
+    print(f"no {name} line in the stats")
+    exit(1)
+
+
+def count(words, label):
+    return int(words[words.index(label) - 1])
+
+
+if sys.argv[1] == "write":
+    with open("file1", "wb", buffering=0) as fh:
+        for i in range(0, size, segment):
+            fh.write(data[i:i + segment])
+    cache = stats("block cache")
+    if count(cache, "writebacks") == 0 or count(cache, "runs,") >= count(cache, "writebacks"):
+        print("written blocks were not merged: " + " ".join(cache))
+        exit(1)
+else:
+    contents = b""
+    with open("file1", "rb", buffering=0) as fh:
+        while len(contents) < size:
+            chunk = fh.read(4096)
+            if not chunk:
+                break
+            contents += chunk
+    if contents != data:
+        print("file1 readback does not match data written")
+        exit(1)
+    if count(stats("readahead"), "prefetches,") == 0:
+        print("reading file1 in order did not read ahead")
+        exit(1)
+
+print("Correct")
+exit(0)
@@ -0,0 +1,60 @@
+#!/usr/bin/python3
+
+# hammer a multithreaded mount from numfiles threads at once
+# every thread owns one file it writes and reads back in small pieces,
+# while it also creates and removes a scratch file next to the others
+# and lists the directory
+
+import os
+import sys
+import threading
+
+numfiles = int(sys.argv[1])
+numwrites = int(sys.argv[2])
+rounds = int(sys.argv[3]) if len(sys.argv) > 3 else 5
+segment = 100
+
+os.chdir("mnt")
+errors = []
+
+
+def worker(n):
+    name = "file" + str(n + 1)
+    scratch = "tmp" + str(n + 1)
+    try:
+        for r in range(rounds):
+            data = os.urandom(segment * numwrites)
+            # wfs has no truncate, later rounds overwrite the file in place
+            with open(name, "wb" if r == 0 else "r+b") as fh:
+                for i in range(numwrites):
+                    fh.write(data[i * segment:(i + 1) * segment])
+                    fh.flush()
+
+            with open(scratch, "wb") as fh:
+                fh.write(os.urandom(1000))
+            os.listdir(".")
+            os.stat(name)
+            os.remove(scratch)
+
+            with open(name, "rb") as fh:
+                contents = fh.read()
+            if contents != data:
+                errors.append(f"{name} readback does not match data written")
+                return
+    except Exception as e:
+        errors.append(f"{name}: {e}")
+
+
+threads = [threading.Thread(target=worker, args=(n,)) for n in range(numfiles)]
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+
+if errors:
+    for e in errors:
+        print(e)
+    exit(1)
+
+print("Correct")
+exit(0)
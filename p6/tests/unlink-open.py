@@ -0,0 +1,36 @@
+#!/usr/bin/python3
+
+# a file unlinked while it is open loses its name at once
+# but stays readable and writable through the open file until it is closed
+
+import os
+
+os.chdir("mnt")
+
+data = os.urandom(3000)
+with open("file1", "wb") as fh:
+    fh.write(data)
+
+fh = open("file1", "r+b")
+os.unlink("file1")
+if "file1" in os.listdir("."):
+    print("file1 is still listed after unlink")
+    exit(1)
+if os.path.exists("file1"):
+    print("file1 can still be looked up after unlink")
+    exit(1)
+
+if fh.read() != data:
+    print("file1 readback after unlink does not match data written")
+    exit(1)
+more = os.urandom(2000)
+fh.write(more)
+fh.flush()
+fh.seek(0)
+if fh.read() != data + more:
+    print("file1 readback after a write past unlink does not match")
+    exit(1)
+fh.close()
+
+print("Correct")
+exit(0)
@@ -178,13 +178,35 @@ def verify_raid0(disks, expected_dirs, expected_files, expected_blocks, altblock
     # not a big deal though
     print("Correct")
 
+def verify_raid5(disks, expected_dirs, expected_files, expected_blocks, altblocks):
+    """Verify wfs formatted as raid5, the metadata is on every disk and the data is spread over them with its parity."""
+    filesystems = [wfsverify.WfsState(disk) for disk in disks]
+    for fs in filesystems:
+        test_eq(f"allocated inodes on {fs.diskname()}",
+                len(fs.list_allocated_inodes()), (expected_files + expected_dirs))
+        datablocks = len(fs.list_allocated_datablocks())
+        if datablocks != expected_blocks and datablocks != altblocks:
+            print(f"allocated datablocks on {fs.diskname()}: found {datablocks} expected either {expected_blocks} or {altblocks}.")
+            exit(1)
+    ref_fs = filesystems[0]
+    (dirs, files) = verify_inodes(ref_fs.list_allocated_inodes(), ref_fs)
+    test_eq(f"wfs directory inodes", dirs, expected_dirs)
+    test_eq(f"wfs regular file inodes", files, expected_files)
+    # compare inode regions on all disks
+    ref_region = ref_fs.read_inode_region()
+    for fs in filesystems[1:]:
+        if ref_region != fs.read_inode_region():
+            print(f"raid5 inode regions must be identical {ref_fs.diskname()} {fs.diskname()}")
+            exit(1)
+    print("Correct")
+
 def unimplemented(mode):
     print(f'{mode} verification not implemented')
     exit()
     
 if __name__ == '__main__':
     parser = argparse.ArgumentParser()
-    parser.add_argument("--mode", help="verify mode: mkfs, raid0, raid1, raid1v")
+    parser.add_argument("--mode", help="verify mode: mkfs, raid0, raid1, raid1v, raid5")
     parser.add_argument("--inodes", help="expected number of inodes")
     parser.add_argument("--blocks", help="expected number of data blocks")
     parser.add_argument("--altblocks", help="some tests have an alternate number of acceptable data blocks")
@@ -202,5 +224,7 @@ if __name__ == '__main__':
         verify_raid0(args.disks, int(args.dirs), int(args.files), int(args.blocks), int(args.altblocks))
     elif args.mode == 'raid1v':
         verify_raid1v(args.disks, int(args.dirs), int(args.files), int(args.blocks))
+    elif args.mode == 'raid5':
+        verify_raid5(args.disks, int(args.dirs), int(args.files), int(args.blocks), int(args.altblocks))
     else:
         unimplemented(args.mode)